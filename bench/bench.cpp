@@ -0,0 +1,638 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <functional>
+#include <random>
+#include <string>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "btree.h"
+#include "database.h"
+#include "lz.h"
+#include "sharded_store.h"
+#include "tree_stats.h"
+
+// Tiny micro-benchmark harness. Each case runs `fn` `iters` times and
+// prints the average cost of one iteration.
+
+static volatile uint64_t sink;
+
+static void runCase(const char *name, size_t iters,
+                    const std::function<void(size_t)> &fn) {
+  auto start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < iters; i++)
+    fn(i);
+  auto end = std::chrono::steady_clock::now();
+  double ns =
+      std::chrono::duration<double, std::nano>(end - start).count() / iters;
+  printf("%-28s %12.1f ns/op  (%zu ops)\n", name, ns, iters);
+}
+
+static std::vector<uint8_t> makeKey(uint32_t i) {
+  return {'k', static_cast<uint8_t>(i >> 24), static_cast<uint8_t>(i >> 16),
+          static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)};
+}
+
+static std::vector<uint8_t> makeIntKey(uint32_t i) {
+  std::vector<uint8_t> key(8);
+  BigEndian::store_u64(key.data(), uint64_t(i) * 1000003);
+  return key;
+}
+
+// Fills a leaf with small sequential keys until it no longer fits a page.
+static BNode makeFullLeaf(uint8_t format,
+                          std::vector<uint8_t> (*keyOf)(uint32_t) = makeKey) {
+  BNode node(BTREE_PAGE_SIZE);
+  node.setHeader(BNODE_LEAF, 0, format);
+  for (uint32_t i = 0;; i++) {
+    BNode next = node.leafInsert(node.getNumOfKeys(), keyOf(i), {'v'});
+    if (next.size() > BTREE_PAGE_USABLE_SIZE)
+      break;
+    node = next;
+  }
+  return node;
+}
+
+static void benchNode() {
+  BNode leaf = makeFullLeaf(BNODE_FORMAT_CLASSIC);
+  BNode slotted = makeFullLeaf(BNODE_FORMAT_SLOTTED);
+  BNode compact = makeFullLeaf(BNODE_FORMAT_COMPACT);
+  uint16_t n = leaf.getNumOfKeys();
+  printf("leaf with %u keys (%u slotted, %u compact)\n", n,
+         slotted.getNumOfKeys(), compact.getNumOfKeys());
+
+  std::mt19937 gen(42);
+  std::vector<std::vector<uint8_t>> probes;
+  for (int i = 0; i < 1024; i++)
+    probes.push_back(makeKey(gen() % n));
+
+  runCase("node.indexLookup", 1 << 20, [&](size_t i) {
+    sink += leaf.indexLookup(probes[i & 1023]);
+  });
+
+  runCase("node.indexLookup slotted", 1 << 20, [&](size_t i) {
+    sink += slotted.indexLookup(probes[i & 1023]);
+  });
+
+  runCase("node.indexLookup compact", 1 << 20, [&](size_t i) {
+    sink += compact.indexLookup(probes[i & 1023]);
+  });
+
+  for (auto [name, format] :
+       {std::pair{"node.indexLookup u64 classic", BNODE_FORMAT_CLASSIC},
+        std::pair{"node.indexLookup u64 slotted", BNODE_FORMAT_SLOTTED},
+        std::pair{"node.indexLookup u64 int64", BNODE_FORMAT_INT64},
+        std::pair{"node.indexLookup u64 compact", BNODE_FORMAT_COMPACT}}) {
+    BNode intLeaf = makeFullLeaf(format, makeIntKey);
+    uint16_t m = intLeaf.getNumOfKeys();
+    std::vector<std::vector<uint8_t>> intProbes;
+    for (int i = 0; i < 1024; i++)
+      intProbes.push_back(makeIntKey(gen() % m));
+    runCase(name, 1 << 20, [&](size_t i) {
+      sink += intLeaf.indexLookup(intProbes[i & 1023]);
+    });
+  }
+
+  runCase("node.getKey", 1 << 20,
+          [&](size_t i) { sink += leaf.getKey(i % n).size(); });
+
+  runCase("node.getPtr", 1 << 22, [&](size_t i) {
+    sink += leaf.getPtr(static_cast<uint16_t>(i % n));
+  });
+
+  runCase("node.leafInsert", 1 << 14, [&](size_t i) {
+    sink += leaf.leafInsert(i % n, {'k', 0xFF}, {'v'}).getNumOfKeys();
+  });
+
+  runCase("node.splitToFitPage", 1 << 12, [&](size_t i) {
+    BNode big = leaf.leafInsert(i % n, {'k', 0xFF}, {'v'});
+    sink += big.splitToFitPage().size();
+  });
+}
+
+static void removeFile(const std::string &path) {
+  std::remove(path.c_str());
+  MemoryBackend::remove(path);
+}
+
+// Drops the file's pages from the page cache so the next reads hit the disk.
+static void evictFromCache(const std::string &path) {
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  (void)posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+  ::close(fd);
+}
+
+static void benchScan(const std::shared_ptr<Pager> &pager,
+                      const std::string &path, uint16_t window,
+                      const char *label = "tree.scan cold") {
+  BTreeOptions options;
+  options.prefetchWindow = window;
+  BTree tree(pager, options);
+
+  char name[64];
+  snprintf(name, sizeof(name), "%s (window %u)", label, window);
+  evictFromCache(path);
+  runCase(name, 1, [&](size_t) {
+    tree.scan({}, {}, [](const auto &, const auto &) {
+      sink += 1;
+      return true;
+    });
+  });
+}
+
+static void benchTree() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/bench.db";
+  removeFile(file_name);
+
+  const uint32_t N = 2000;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+
+    PagePool::local().resetStats();
+    runCase("tree.insert (fsync/op)", N,
+            [&](size_t i) { tree.insert(makeKey(i), {'v', 'a', 'l'}); });
+    PagePool::Stats st = PagePool::local().stats();
+    printf("%-28s %12.2f allocs/op  (%llu of %llu buffers from malloc)\n",
+           "  page pool", double(st.allocated) / N,
+           (unsigned long long)st.allocated, (unsigned long long)st.acquired);
+
+    std::mt19937 gen(7);
+    runCase("tree.search", 1 << 16, [&](size_t) {
+      sink += tree.search(makeKey(gen() % N)).has_value();
+    });
+
+    benchScan(pager, file_name, 0);
+    benchScan(pager, file_name, 16);
+
+    // 256 random lookups against a cold cache, one at a time vs batched
+    std::vector<std::vector<uint8_t>> keys;
+    for (int i = 0; i < 256; i++)
+      keys.push_back(makeKey(gen() % N));
+    evictFromCache(file_name);
+    runCase("tree.search cold", keys.size(),
+            [&](size_t i) { sink += tree.search(keys[i]).has_value(); });
+    evictFromCache(file_name);
+    runCase("tree.multiSearch cold", keys.size(), [&](size_t i) {
+      if (i == 0)
+        sink += tree.multiSearch(keys).size();
+    });
+
+    // same lookups with O_DIRECT and only the pager's own cache
+    {
+      PagerOptions direct;
+      direct.directIO = true;
+      direct.cachePages = 8192;
+      auto directPager = std::make_shared<Pager>(file_name, direct);
+      BTree directTree(directPager);
+      runCase("tree.search O_DIRECT", 1 << 16, [&](size_t) {
+        sink += directTree.search(makeKey(gen() % N)).has_value();
+      });
+      PageCache::Stats st = directPager->cacheStats();
+      printf("%-28s %12.1f %% hits\n", "  page cache",
+             100.0 * st.hits / (st.hits + st.misses));
+    }
+
+    // one transaction dropping the middle half of the keys
+    runCase("tree.removeRange (N/2 keys)", 1, [&](size_t) {
+      sink += tree.removeRange(makeKey(N / 4), makeKey(3 * N / 4));
+    });
+
+    // backups from a cold cache: the key-ordered copy against the
+    // page-order snapshot stream, plain and renumbered
+    std::string backup_name = dir + "/bench-backup.db";
+    auto backup = [&](const char *name, const std::function<void()> &fn) {
+      removeFile(backup_name);
+      evictFromCache(file_name);
+      runCase(name, 1, [&](size_t) { fn(); });
+    };
+    backup("tree.copyTo cold", [&] { tree.copyTo(backup_name); });
+    backup("tree.snapshotTo cold", [&] { tree.snapshotTo(backup_name); });
+    backup("tree.snapshotTo compact",
+           [&] { tree.snapshotTo(backup_name, true); });
+    removeFile(backup_name);
+
+    uint32_t pages = pager->nextPageId();
+    runCase("tree.compact", 1, [&](size_t) { sink += tree.compact(); });
+    printf("%-28s %12u -> %u pages\n", "  file size", pages,
+           pager->nextPageId());
+
+    std::string copy_name = dir + "/bench-copy.db";
+    removeFile(copy_name);
+    tree.copyTo(copy_name);
+    benchScan(pager, file_name, 16, "compacted.scan cold");
+    benchScan(std::make_shared<Pager>(copy_name), copy_name, 16,
+              "copyTo.scan cold");
+    removeFile(copy_name);
+  }
+  removeFile(file_name);
+}
+
+// leaf page ids of the subtree at ptr, in key order
+static void collectLeaves(const Pager &pager, uint32_t ptr,
+                          std::vector<uint32_t> &out) {
+  BNode node(pager.readPage(ptr));
+  if (node.getType() == BNODE_LEAF) {
+    out.push_back(ptr);
+    return;
+  }
+  for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+    collectLeaves(pager, node.getPtr(i), out);
+}
+
+// Random inserts and deletes into a file with free space scatter a tree's
+// pages over it; the spread of key-adjacent leaves and a cold scan show how
+// well the allocator kept neighbours together.
+static void benchChurn() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/churn.db";
+  removeFile(file_name);
+
+  const uint32_t N = 3000;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    std::mt19937 gen(11);
+    for (uint32_t i = 0; i < N; i++)
+      tree.insert(makeKey(gen() % (4 * N)), std::vector<uint8_t>(64, 'v'));
+    // a bulk delete leaves plenty of free pages for the churn to reuse
+    tree.removeRange(makeKey(N), makeKey(3 * N));
+    for (uint32_t i = 0; i < N; i++) {
+      tree.insert(makeKey(gen() % (4 * N)), std::vector<uint8_t>(64, 'v'));
+      if (i % 3 == 2)
+        tree.remove(makeKey(gen() % (4 * N)));
+    }
+    std::vector<uint32_t> leaves;
+    collectLeaves(*pager, tree.rootPage(), leaves);
+    double gap = 0;
+    for (size_t i = 1; i < leaves.size(); i++)
+      gap += std::abs(static_cast<double>(leaves[i]) - leaves[i - 1]);
+    printf("%-28s %12.1f pages apart (%zu leaves, %u pages)\n",
+           "churn leaf spread", gap / std::max<size_t>(1, leaves.size() - 1),
+           leaves.size(), pager->nextPageId());
+    benchScan(pager, file_name, 16, "churn.scan cold");
+  }
+  removeFile(file_name);
+}
+
+// One logical update touching four keyspaces: four files with a commit
+// each, against four named trees committed together.
+// range counts over a counted tree against the same tree without counts,
+// which walks the subtrees left of the path, and against a scan
+static void benchCounted() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  const uint32_t N = 20000;
+  std::mt19937 gen(11);
+
+  for (uint8_t format : {uint8_t(BNODE_FORMAT_CLASSIC | BNODE_FLAG_COUNTED),
+                         BNODE_FORMAT_CLASSIC}) {
+    bool counted = format & BNODE_FLAG_COUNTED;
+    std::string file_name = dir + "/counted.db";
+    removeFile(file_name);
+    BTreeOptions options;
+    options.format = format;
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+
+    pager->beginTxn();
+    runCase(counted ? "counted.insert (1 txn)" : "plain.insert (1 txn)", N,
+            [&](size_t i) { tree.insert(makeKey(i * 7919 % N), {'v'}); });
+    pager->commitTxn();
+
+    runCase(counted ? "counted.count" : "plain.count", counted ? 1 << 14 : 64,
+            [&](size_t) {
+              uint32_t lo = gen() % N;
+              sink += tree.count(makeKey(lo), makeKey(lo + N / 4));
+            });
+    if (counted) {
+      runCase("counted.at", 1 << 14,
+              [&](size_t) { sink += tree.at(gen() % N).has_value(); });
+      runCase("scan count", 64, [&](size_t) {
+        uint32_t lo = gen() % N;
+        tree.scan(makeKey(lo), makeKey(lo + N / 4),
+                  [](const std::vector<uint8_t> &,
+                     const std::vector<uint8_t> &) {
+                    sink += 1;
+                    return true;
+                  });
+      });
+    }
+    removeFile(file_name);
+  }
+}
+
+// JSON-like values in compressed leaves against plain ones: pages taken,
+// a cold full scan, and what the codec cost
+static void benchCompressed() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  const uint32_t N = 20000;
+  auto json = [](uint32_t i) {
+    std::string s = "{\"id\":" + std::to_string(i) + ",\"name\":\"user" +
+                    std::to_string(i) +
+                    "\",\"active\":true,\"tags\":[\"a\",\"b\"],"
+                    "\"city\":\"Springfield\"}";
+    return std::vector<uint8_t>(s.begin(), s.end());
+  };
+
+  for (uint8_t format :
+       {uint8_t(BNODE_FLAG_COMPRESSED), BNODE_FORMAT_CLASSIC}) {
+    bool compressed = format & BNODE_FLAG_COMPRESSED;
+    std::string file_name = dir + "/compressed.db";
+    removeFile(file_name);
+    BTreeOptions options;
+    options.format = format;
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+
+    lzResetStats();
+    pager->beginTxn();
+    runCase(compressed ? "compressed.insert (1 txn)" : "plain.insert (1 txn)",
+            N, [&](size_t i) {
+              uint32_t k = i * 7919 % N;
+              tree.insert(makeKey(k), json(k));
+            });
+    pager->commitTxn();
+    tree.compact();
+
+    TreeStats stats = analyzeTree(*pager, 1);
+    printf("%-28s %12llu pages", "  tree",
+           (unsigned long long)stats.reachablePages);
+    if (compressed)
+      printf("  (%.2fx on %llu packed leaves)", stats.compressionRatio(),
+             (unsigned long long)stats.packedLeaves);
+    printf("\n");
+    benchScan(pager, file_name, 16,
+              compressed ? "compressed.scan cold" : "plain.scan cold");
+
+    LzStats lz = lzStats();
+    if (compressed)
+      printf("%-28s %12.1f MB/s in, %.1f MB/s out\n", "  lz codec",
+             lz.compressNs ? lz.compressedIn * 1e3 / lz.compressNs : 0.0,
+             lz.decompressNs ? lz.decompressedOut * 1e3 / lz.decompressNs
+                             : 0.0);
+    removeFile(file_name);
+  }
+}
+
+// lookups of keys that aren't there, with and without a Bloom filter
+static void benchFilter() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/filter.db";
+  removeFile(file_name);
+  const uint32_t N = 20000;
+
+  auto pager = std::make_shared<Pager>(file_name);
+  {
+    BTree tree(pager);
+    pager->beginTxn();
+    for (uint32_t i = 0; i < N; i++)
+      tree.insert(makeKey(2 * (i * 7919 % N)), {'v'});
+    pager->commitTxn();
+  }
+
+  for (uint16_t bits : {0, 10}) {
+    BTreeOptions options;
+    options.filterBitsPerKey = bits;
+    BTree tree(pager, options);
+    std::mt19937 gen(13);
+    runCase(bits ? "filtered.search absent" : "tree.search absent", 1 << 16,
+            [&](size_t) {
+              sink += tree.search(makeKey(2 * (gen() % N) + 1)).has_value();
+            });
+    if (bits) {
+      BTree::FilterStats st = tree.filterStats();
+      printf("%-28s %12zu bytes, %.2f%% false positives (%.2f%% expected)\n",
+             "  filter", st.memoryBytes, 100 * st.falsePositiveRate(),
+             100 * st.expectedFalsePositiveRate);
+    }
+  }
+  removeFile(file_name);
+}
+
+static void benchValueCache() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/cache.db";
+  removeFile(file_name);
+  const uint32_t N = 20000;
+  const std::vector<uint8_t> value(64, 'v');
+
+  auto pager = std::make_shared<Pager>(file_name);
+  {
+    BTree tree(pager);
+    pager->beginTxn();
+    for (uint32_t i = 0; i < N; i++)
+      tree.insert(makeKey(i * 7919 % N), value);
+    pager->commitTxn();
+  }
+
+  // nine lookups in ten go to the hottest 1% of the keys
+  for (size_t bytes : {size_t(0), size_t(1) << 20}) {
+    BTreeOptions options;
+    options.valueCacheBytes = bytes;
+    BTree tree(pager, options);
+    std::mt19937 gen(17);
+    runCase(bytes ? "cached.search skewed" : "tree.search skewed", 1 << 16,
+            [&](size_t) {
+              uint32_t k = gen() % 10 ? gen() % (N / 100) : gen() % N;
+              sink += tree.search(makeKey(k)).has_value();
+            });
+    if (bytes) {
+      ValueCache::Stats st = tree.valueCacheStats();
+      printf("%-28s %12zu bytes, %zu entries, %.1f%% hits\n", "  cache",
+             st.bytes, st.entries, 100 * st.hitRate());
+    }
+  }
+  removeFile(file_name);
+}
+
+// Batches of random writes, each shard's share committed by its own worker
+// with its own fsync.
+static void benchSharded() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  const std::vector<uint8_t> value(64, 'v');
+  const size_t batchSize = 512;
+
+  for (size_t shards : {1, 4}) {
+    std::string path = dir + "/sharded" + std::to_string(shards);
+    std::mt19937 gen(23);
+    {
+      ShardedStore store(path, shards);
+      std::string suffix = shards == 1 ? " shard" : " shards";
+      std::string name = "insertBatch " + std::to_string(shards) + suffix;
+      runCase(name.c_str(), 64, [&](size_t) {
+        std::vector<ShardedStore::Entry> batch;
+        for (size_t i = 0; i < batchSize; i++)
+          batch.emplace_back(makeKey(gen()), value);
+        store.insertBatch(batch);
+      });
+
+      std::vector<std::vector<uint8_t>> keys;
+      for (size_t i = 0; i < batchSize; i++)
+        keys.push_back(makeKey(gen()));
+      name = "multiSearch " + std::to_string(shards) + suffix;
+      runCase(name.c_str(), 64,
+              [&](size_t) { sink += store.multiSearch(keys).size(); });
+    }
+    for (size_t i = 0; i < shards; i++)
+      removeFile((path + "." + std::to_string(i)));
+  }
+}
+
+// Counter increments as a search and an insert, then as one merge.
+static void benchUpdate() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/update.db";
+  removeFile(file_name);
+  const uint32_t N = 20000;
+  const std::vector<uint8_t> zero(8, 0);
+
+  auto pager = std::make_shared<Pager>(file_name);
+  BTree tree(pager);
+  pager->beginTxn();
+  for (uint32_t i = 0; i < N; i++)
+    tree.insert(makeKey(i * 7919 % N), zero);
+  pager->commitTxn();
+
+  std::mt19937 gen(29);
+  std::vector<uint8_t> one(8);
+  LittleEndian::store_u64(one.data(), 1);
+  pager->beginTxn();
+  runCase("search + insert counter", 1 << 14, [&](size_t) {
+    std::vector<uint8_t> key = makeKey(gen() % N);
+    std::vector<uint8_t> value = *tree.search(key);
+    LittleEndian::store_u64(value.data(),
+                            LittleEndian::load_u64(value.data()) + 1);
+    tree.insert(key, value);
+  });
+  runCase("merge add64 counter", 1 << 14, [&](size_t) {
+    tree.merge("add64", makeKey(gen() % N), one);
+  });
+  pager->commitTxn();
+  removeFile(file_name);
+}
+
+static void benchDatabase() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  const int trees = 4;
+  const std::vector<uint8_t> value(64, 'v');
+  std::mt19937 gen(5);
+
+  {
+    std::vector<std::unique_ptr<BTree>> files;
+    for (int t = 0; t < trees; t++) {
+      std::string name = dir + "/multi" + std::to_string(t) + ".db";
+      removeFile(name);
+      files.push_back(std::make_unique<BTree>(std::make_shared<Pager>(name)));
+    }
+    runCase("update 4 files", 256, [&](size_t) {
+      for (auto &tree : files)
+        tree->insert(makeKey(gen() % 100000), value);
+    });
+  }
+
+  std::string file_name = dir + "/multi.db";
+  removeFile(file_name);
+  {
+    Database db(file_name);
+    std::vector<BTree *> named;
+    for (int t = 0; t < trees; t++)
+      named.push_back(&db.open("tree" + std::to_string(t)));
+    runCase("update 4 named trees", 256, [&](size_t) {
+      db.beginTxn();
+      for (BTree *tree : named)
+        tree->insert(makeKey(gen() % 100000), value);
+      db.commitTxn();
+    });
+  }
+
+  removeFile(file_name);
+  for (int t = 0; t < trees; t++)
+    removeFile((dir + "/multi" + std::to_string(t) + ".db"));
+}
+
+// DBITE_STORAGE=memory runs everything on memory files, which leaves the
+// CPU cost without the disk's noise
+// Opening a cold file and looking up its hot keys, with and without the
+// pages a hot-page manifest lists being prefetched at open.
+static void benchWarmUp() {
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/warmup.db";
+  removeFile(file_name);
+  const uint32_t N = 20000;
+  const std::vector<uint8_t> value(100, 'v');
+
+  PagerOptions options;
+  options.storage = STORAGE_FILE;
+  options.hotManifestLeaves = 256;
+
+  // hot keys are the first 1024 of a permuted order
+  std::vector<std::vector<uint8_t>> hot;
+  for (uint32_t i = 0; i < 1024; i++)
+    hot.push_back(makeKey(i * 7919 % N));
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    pager->beginTxn();
+    for (uint32_t i = 0; i < N; i++)
+      tree.insert(makeKey(i * 7919 % N), value);
+    pager->commitTxn();
+    for (int r = 0; r < 4; r++)
+      for (const auto &key : hot)
+        sink += tree.search(key).has_value();
+  }
+
+  for (bool warm : {false, true}) {
+    PagerOptions reopen = options;
+    if (!warm)
+      reopen.hotManifestLeaves = 0;
+    std::shared_ptr<Pager> pager;
+    std::unique_ptr<BTree> tree;
+    evictFromCache(file_name);
+    runCase(warm ? "open + hot search (manifest)" : "open + hot search (cold)",
+            hot.size(), [&](size_t i) {
+              if (i == 0) {
+                pager = std::make_shared<Pager>(file_name, reopen);
+                tree = std::make_unique<BTree>(pager);
+              }
+              sink += tree->search(hot[i]).has_value();
+            });
+  }
+  removeFile(file_name);
+  std::remove((file_name + ".hot").c_str());
+}
+
+int main() {
+  const char *storage = std::getenv("DBITE_STORAGE");
+  if (storage && std::string(storage) == "memory") {
+    Pager::setDefaultStorage(STORAGE_MEMORY);
+    printf("storage: memory\n");
+  }
+  benchNode();
+  benchTree();
+  benchChurn();
+  benchCounted();
+  benchCompressed();
+  benchFilter();
+  benchValueCache();
+  benchUpdate();
+  benchDatabase();
+  benchSharded();
+  benchWarmUp();
+  return 0;
+}
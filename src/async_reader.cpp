@@ -0,0 +1,42 @@
+#include "async_reader.h"
+
+AsyncReader::AsyncReader(size_t threads) {
+  if (threads == 0)
+    threads = 1;
+  threads_.reserve(threads);
+  for (size_t i = 0; i < threads; i++)
+    threads_.emplace_back([this] { run(); });
+}
+
+AsyncReader::~AsyncReader() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+  }
+  ready_.notify_all();
+  for (std::thread &t : threads_)
+    t.join();
+}
+
+void AsyncReader::submit(std::function<void()> job) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    queue_.push_back(std::move(job));
+  }
+  ready_.notify_one();
+}
+
+void AsyncReader::run() {
+  for (;;) {
+    std::function<void()> job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (queue_.empty())
+        return;
+      job = std::move(queue_.front());
+      queue_.pop_front();
+    }
+    job();
+  }
+}
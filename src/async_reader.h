@@ -0,0 +1,32 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A small fixed pool of I/O threads. Jobs are run in submission order by
+// whichever thread is free, so up to `threads` blocking reads can be in
+// flight at once. The destructor finishes the queued jobs before joining.
+class AsyncReader {
+public:
+  explicit AsyncReader(size_t threads);
+  ~AsyncReader();
+
+  AsyncReader(const AsyncReader &) = delete;
+  AsyncReader &operator=(const AsyncReader &) = delete;
+
+  void submit(std::function<void()> job);
+
+private:
+  void run();
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> queue_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
@@ -0,0 +1,71 @@
+#include "bloom.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace {
+
+constexpr uint64_t PRIME1 = 0x9E3779B185EBCA87ull;
+constexpr uint64_t PRIME2 = 0xC2B2AE3D27D4EB4Full;
+
+inline uint64_t mix(uint64_t h) {
+  h ^= h >> 33;
+  h *= PRIME2;
+  h ^= h >> 29;
+  h *= PRIME1;
+  h ^= h >> 32;
+  return h;
+}
+
+} // namespace
+
+BloomFilter::BloomFilter(size_t keys, unsigned bitsPerKey) {
+  size_t bits = std::max<size_t>(keys, 1) * std::max(bitsPerKey, 1u);
+  blocks_ = (bits + 64 * BLOCK_WORDS - 1) / (64 * BLOCK_WORDS);
+  words_.assign(blocks_ * BLOCK_WORDS, 0);
+  // k = bits per key * ln 2 minimizes false positives
+  hashes_ = std::clamp(static_cast<unsigned>(bitsPerKey * 0.69 + 0.5), 1u,
+                       16u);
+}
+
+uint64_t BloomFilter::hash(const uint8_t *key, size_t size) {
+  uint64_t h = PRIME1 ^ (size * PRIME2);
+  size_t i = 0;
+  for (; i + 8 <= size; i += 8) {
+    uint64_t word;
+    memcpy(&word, key + i, sizeof(word));
+    h = (h ^ mix(word)) * PRIME1;
+  }
+  uint64_t tail = 0;
+  if (i < size)
+    memcpy(&tail, key + i, size - i);
+  return mix(h ^ tail);
+}
+
+// The high half of the hash picks the block, the low half gives the bits
+// within it by double hashing.
+void BloomFilter::addHash(uint64_t h) {
+  uint64_t *block = &words_[(h >> 32) % blocks_ * BLOCK_WORDS];
+  uint32_t bit = static_cast<uint32_t>(h);
+  uint32_t delta = (bit >> 17) | (bit << 15) | 1;
+  for (unsigned i = 0; i < hashes_; i++, bit += delta)
+    block[(bit >> 6) % BLOCK_WORDS] |= uint64_t(1) << (bit & 63);
+}
+
+bool BloomFilter::mayContainHash(uint64_t h) const {
+  const uint64_t *block = &words_[(h >> 32) % blocks_ * BLOCK_WORDS];
+  uint32_t bit = static_cast<uint32_t>(h);
+  uint32_t delta = (bit >> 17) | (bit << 15) | 1;
+  for (unsigned i = 0; i < hashes_; i++, bit += delta) {
+    if (!(block[(bit >> 6) % BLOCK_WORDS] & (uint64_t(1) << (bit & 63))))
+      return false;
+  }
+  return true;
+}
+
+double BloomFilter::expectedFalsePositiveRate(uint64_t keys) const {
+  double bits = static_cast<double>(words_.size()) * 64;
+  return std::pow(1 - std::exp(-(hashes_ * static_cast<double>(keys)) / bits),
+                  hashes_);
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// A blocked Bloom filter: each key sets and tests all its bits within one
+// 64-byte block, so a lookup touches a single cache line. That costs a
+// little accuracy against a plain Bloom filter of the same size.
+class BloomFilter {
+public:
+  // sized for `keys` keys at `bitsPerKey` bits each
+  BloomFilter(size_t keys, unsigned bitsPerKey);
+
+  void add(const uint8_t *key, size_t size) { addHash(hash(key, size)); }
+  // false only if the key was never added
+  bool mayContain(const uint8_t *key, size_t size) const {
+    return mayContainHash(hash(key, size));
+  }
+
+  // the same by the key's hash, for keys hashed before the filter is sized
+  static uint64_t hash(const uint8_t *key, size_t size);
+  void addHash(uint64_t h);
+  bool mayContainHash(uint64_t h) const;
+
+  size_t memoryBytes() const { return words_.size() * sizeof(uint64_t); }
+  unsigned hashCount() const { return hashes_; }
+  // expected false-positive rate once `keys` keys are in
+  double expectedFalsePositiveRate(uint64_t keys) const;
+
+private:
+  static constexpr size_t BLOCK_WORDS = 8;
+
+  std::vector<uint64_t> words_;
+  size_t blocks_;
+  unsigned hashes_;
+};
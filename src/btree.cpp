@@ -1,14 +1,127 @@
 #include "btree.h"
 
+#include <limits>
+#include <type_traits>
+#include <unordered_map>
+
+#include "int_search.h"
+#include "lz.h"
+
+namespace {
+
+// field positions in the header of a packed leaf
+constexpr size_t PACKED_NODE_SIZE_POS = 3;
+constexpr size_t PACKED_DATA_SIZE_POS = 5;
+
+// LEB128: 7 bits a byte, low bits first, the high bit set on all but the
+// last byte
+size_t varintSize(size_t v) {
+  size_t n = 1;
+  while (v >= 0x80) {
+    v >>= 7;
+    n++;
+  }
+  return n;
+}
+
+uint8_t *putVarint(uint8_t *p, size_t v) {
+  while (v >= 0x80) {
+    *p++ = static_cast<uint8_t>(v) | 0x80;
+    v >>= 7;
+  }
+  *p++ = static_cast<uint8_t>(v);
+  return p;
+}
+
+const uint8_t *getVarint(const uint8_t *p, size_t &v) {
+  v = *p & 0x7F;
+  for (unsigned shift = 7; *p++ & 0x80; shift += 7)
+    v |= size_t(*p & 0x7F) << shift;
+  return p;
+}
+
+} // namespace
+
 BNode::BNode() : data_(BTREE_PAGE_SIZE, 0) {}
 
 BNode::BNode(size_t size) : data_(size, 0) {}
 
-BNode::BNode(const std::vector<uint8_t> &data) : data_(data) {}
+BNode::BNode(const PageBuffer &data)
+    : data_(isPacked(data) ? unpack(data) : data) {}
 
-BNode::BNode(std::vector<uint8_t> &&data) : data_(std::move(data)) {}
+BNode::BNode(PageBuffer &&data)
+    : data_(isPacked(data) ? unpack(data) : std::move(data)) {}
+
+const PageBuffer &BNode::data() const { return data_; }
+
+PageBuffer BNode::release() {
+  if (size() > BTREE_PAGE_USABLE_SIZE)
+    return pack();
+  data_.resize(BTREE_PAGE_SIZE);
+  return std::move(data_);
+}
+
+bool BNode::isPacked(const PageBuffer &page) {
+  return page.size() >= PACKED_HEADER_SIZE &&
+         (page[0] & BNODE_FLAG_COMPRESSED) &&
+         (page[0] & BNODE_TYPE_MASK) == BNODE_LEAF &&
+         LittleEndian::load_u16(page.data() + NODE_TYPE_SIZE) ==
+             BNODE_PACKED_MARKER;
+}
+
+size_t BNode::packedSize(const PageBuffer &page) {
+  assert(isPacked(page));
+  return PACKED_HEADER_SIZE +
+         LittleEndian::load_u16(page.data() + PACKED_DATA_SIZE_POS);
+}
+
+bool BNode::fitsPage() const {
+  if (size() <= BTREE_PAGE_USABLE_SIZE)
+    return true;
+  if (!isCompressed() || size() > COMPRESSED_LEAF_MAX_SIZE)
+    return false;
+  uint8_t scratch[BTREE_PAGE_USABLE_SIZE];
+  return packInto(scratch, BTREE_PAGE_USABLE_SIZE - PACKED_HEADER_SIZE) > 0;
+}
+
+size_t BNode::packInto(uint8_t *dst, size_t capacity) const {
+  assert(isCompressed());
+  return lzCompress(data_.data(), size(), dst, capacity);
+}
+
+PageBuffer BNode::pack() const {
+  if (!isCompressed() || size() > COMPRESSED_LEAF_MAX_SIZE)
+    throw std::runtime_error("BNode: node doesn't fit a page");
+  PageBuffer page(BTREE_PAGE_SIZE);
+  size_t n = packInto(page.data() + PACKED_HEADER_SIZE,
+                      BTREE_PAGE_USABLE_SIZE - PACKED_HEADER_SIZE);
+  if (n == 0)
+    throw std::runtime_error("BNode: leaf doesn't compress into a page");
+  page[0] = data_[0];
+  LittleEndian::store_u16(page.data() + NODE_TYPE_SIZE, BNODE_PACKED_MARKER);
+  LittleEndian::store_u16(page.data() + PACKED_NODE_SIZE_POS, size());
+  LittleEndian::store_u16(page.data() + PACKED_DATA_SIZE_POS,
+                          static_cast<uint16_t>(n));
+  return page;
+}
 
-const std::vector<uint8_t> &BNode::data() const { return data_; }
+PageBuffer BNode::unpack(const PageBuffer &page) {
+  size_t nodeSize = LittleEndian::load_u16(page.data() + PACKED_NODE_SIZE_POS);
+  size_t dataSize = LittleEndian::load_u16(page.data() + PACKED_DATA_SIZE_POS);
+  if (nodeSize > COMPRESSED_LEAF_MAX_SIZE ||
+      PACKED_HEADER_SIZE + dataSize > std::min(page.size(),
+                                               BTREE_PAGE_USABLE_SIZE))
+    throw std::runtime_error("BNode: corrupt packed leaf");
+
+  // whole pages, so a node read back has the room a page would give it
+  PageBuffer data((nodeSize + BTREE_PAGE_SIZE - 1) / BTREE_PAGE_SIZE *
+                  BTREE_PAGE_SIZE);
+  if (!lzDecompress(page.data() + PACKED_HEADER_SIZE, dataSize, data.data(),
+                    nodeSize) ||
+      nodeSize < PAGE_HEADER_SIZE || data[0] != page[0])
+    throw std::runtime_error("BNode: corrupt packed leaf");
+  return data;
+}
 
 void BNode::hexDump() const {
   const size_t bytesPerLine = 16;
@@ -37,74 +150,182 @@ void BNode::hexDump() const {
   }
 }
 
-uint16_t BNode::getType() const { return data_.at(0); }
+uint16_t BNode::getType() const { return data_.at(0) & BNODE_TYPE_MASK; }
+
+uint8_t BNode::getFormat() const { return data_.at(0) & ~BNODE_TYPE_MASK; }
 
 uint16_t BNode::getNumOfKeys() const {
-  return LittleEndian::read_u16(data_, NODE_TYPE_SIZE);
+  return LittleEndian::load_u16(data_.data() + NODE_TYPE_SIZE);
 }
 
-void BNode::setHeader(uint8_t type, uint16_t numOfKeys) {
-  data_[0] = type;
+void BNode::setHeader(uint8_t type, uint16_t numOfKeys, uint8_t format) {
+  assert((type & ~BNODE_TYPE_MASK) == 0);
+  data_[0] = type | format;
   LittleEndian::write_u16(data_, NODE_TYPE_SIZE, numOfKeys);
 }
 
 uint32_t BNode::getPtr(uint16_t index) const {
-  assert(index < getNumOfKeys());
+  assert(index < getNumOfKeys() && ptrStride() == PTR_SIZE);
   auto pos = PAGE_HEADER_SIZE + (PTR_SIZE * index);
-  return LittleEndian::read_u32(data_, pos);
+  return LittleEndian::load_u32(data_.data() + pos);
 }
 
 void BNode::setPtr(uint16_t index, uint32_t value) {
-  assert(index < getNumOfKeys());
+  assert(index < getNumOfKeys() && ptrStride() == PTR_SIZE);
   auto pos = PAGE_HEADER_SIZE + (PTR_SIZE * index);
-  LittleEndian::write_u32(data_, pos, value);
+  LittleEndian::store_u32(data_.data() + pos, value);
+}
+
+uint32_t BNode::getCount(uint16_t index) const {
+  assert(hasCounts() && index < getNumOfKeys());
+  return LittleEndian::load_u32(data_.data() + countsPos() +
+                                COUNT_SIZE * index);
+}
+
+void BNode::setCount(uint16_t index, uint32_t value) {
+  assert(hasCounts() && index < getNumOfKeys());
+  LittleEndian::store_u32(data_.data() + countsPos() + COUNT_SIZE * index,
+                          value);
+}
+
+uint64_t BNode::subtreeCount() const {
+  if (getType() == BNODE_LEAF)
+    return getNumOfKeys();
+  assert(hasCounts());
+  uint64_t total = 0;
+  for (uint16_t i = 0; i < getNumOfKeys(); i++)
+    total += getCount(i);
+  return total;
 }
 
 uint16_t BNode::getOffset(uint16_t index) const {
-  auto nok = getNumOfKeys();
   assert(index <= getNumOfKeys());
-  auto off = PAGE_HEADER_SIZE + PTR_SIZE * nok + OFFSET_SIZE * (index - 1);
-  return (index > 0) ? LittleEndian::read_u16(data_, off) : 0;
+  if (index == 0)
+    return 0;
+  return LittleEndian::load_u16(data_.data() + offsetsPos() +
+                                slotStride() * (index - 1));
 }
 
 void BNode::setOffset(uint16_t index, uint16_t value) {
   assert(index > 0);
-  auto nok = getNumOfKeys();
   assert(index <= getNumOfKeys());
-  auto off = PAGE_HEADER_SIZE + PTR_SIZE * nok + OFFSET_SIZE * (index - 1);
-  LittleEndian::write_u16(data_, off, value);
+  LittleEndian::store_u16(data_.data() + offsetsPos() +
+                              slotStride() * (index - 1),
+                          value);
 }
 
 uint16_t BNode::getKeyValuePos(uint16_t index) const {
-  auto nok = getNumOfKeys();
-  assert(index <= nok);
-  return PAGE_HEADER_SIZE + PTR_SIZE * nok + OFFSET_SIZE * nok +
-         getOffset(index);
+  assert(index <= getNumOfKeys());
+  return kvPos() + getOffset(index);
 }
 
 uint16_t BNode::size() const { return getKeyValuePos(getNumOfKeys()); }
 
+namespace {
+
+// a compact entry's header, with a value size in leaves only
+template <bool Leaf>
+const uint8_t *compactHeader(const uint8_t *entry, size_t &keySize,
+                             size_t &valueSize) {
+  entry = getVarint(entry, keySize);
+  valueSize = 0;
+  if constexpr (Leaf)
+    entry = getVarint(entry, valueSize);
+  return entry;
+}
+
+} // namespace
+
+BNode::EntryView BNode::entryAt(uint16_t index) const {
+  const uint8_t *entry = data_.data() + getKeyValuePos(index);
+  EntryView e;
+  if (!isCompact()) {
+    e.keySize = LittleEndian::load_u16(entry);
+    e.valueSize = LittleEndian::load_u16(entry + KEY_SIZE_FIELD_SIZE);
+    e.key = entry + ENTRY_HEADER_SIZE;
+  } else if ((data_[0] & BNODE_TYPE_MASK) == BNODE_LEAF) {
+    e.key = compactHeader<true>(entry, e.keySize, e.valueSize);
+  } else {
+    e.key = compactHeader<false>(entry, e.keySize, e.valueSize);
+  }
+  e.value = e.key + e.keySize;
+  assert(e.end() <= data_.data() + data_.size());
+  return e;
+}
+
+size_t BNode::entryHeaderSize(size_t keySize, size_t valueSize) const {
+  if (!isCompact())
+    return ENTRY_HEADER_SIZE;
+  if (getType() == BNODE_LEAF)
+    return varintSize(keySize) + varintSize(valueSize);
+  assert(valueSize == 0);
+  return varintSize(keySize);
+}
+
 std::vector<uint8_t> BNode::getKey(uint16_t index) const {
-  auto pos = getKeyValuePos(index);
-  auto keySize = LittleEndian::read_u16(data_, pos);
-  std::vector<uint8_t> res(keySize);
-  for (uint16_t i = 0; i < keySize; i++) {
-    assert(data_.size() > pos + ENTRY_HEADER_SIZE + i);
-    res[i] = data_[pos + ENTRY_HEADER_SIZE + i];
+  if (isInt64()) {
+    std::vector<uint8_t> res(INT64_KEY_SIZE);
+    BigEndian::store_u64(res.data(), decodeInt64Key(index));
+    return res;
   }
-  return res;
+  EntryView e = entryAt(index);
+  return std::vector<uint8_t>(e.key, e.key + e.keySize);
 }
 
 std::vector<uint8_t> BNode::getValue(uint16_t index) const {
-  auto pos = getKeyValuePos(index);
-  auto keySize = LittleEndian::read_u16(data_, pos);
-  auto valueSize = LittleEndian::read_u16(data_, pos + KEY_SIZE_FIELD_SIZE);
-  std::vector<uint8_t> res(valueSize);
-  for (uint16_t i = 0; i < valueSize; i++) {
-    assert(data_.size() > pos + ENTRY_HEADER_SIZE + keySize + i);
-    res[i] = data_[pos + ENTRY_HEADER_SIZE + keySize + i];
+  EntryView e = entryAt(index);
+  return std::vector<uint8_t>(e.value, e.value + e.valueSize);
+}
+
+bool BNode::acceptsKey(const std::vector<uint8_t> &key) const {
+  return !isInt64() || key.size() == INT64_KEY_SIZE;
+}
+
+uint16_t BNode::entrySize(uint16_t index) const {
+  return static_cast<uint16_t>(entryAt(index).end() - data_.data() -
+                               getKeyValuePos(index));
+}
+
+int BNode::compareKeyAt(uint16_t index, const std::vector<uint8_t> &key) const {
+  return compareKeyAt<BytewiseOrder>(index, key,
+                                     keyPrefix(key.data(), key.size()));
+}
+
+// Under bytewise order, int64 nodes compare against the dense array and
+// slotted nodes settle most comparisons on the slot array alone: differing
+// prefixes order the keys, and equal prefixes of two keys no longer than
+// the prefix leave only the lengths to compare.
+template <typename Order>
+int BNode::compareKeyAt(uint16_t index, const std::vector<uint8_t> &key,
+                        uint32_t prefix) const {
+  if constexpr (std::is_same_v<Order, BytewiseOrder>) {
+    if (isInt64() && key.size() == INT64_KEY_SIZE) {
+      int64_t stored = denseKeyAt(index);
+      int64_t probe = encodeInt64Key(key.data());
+      return (stored > probe) - (stored < probe);
+    }
+
+    if (slotStride() == SLOT_SIZE) {
+      const uint8_t *slot = data_.data() + offsetsPos() + SLOT_SIZE * index;
+      uint32_t slotPrefix =
+          BigEndian::load_u32(slot + OFFSET_SIZE + KEY_SIZE_FIELD_SIZE);
+      if (slotPrefix != prefix)
+        return slotPrefix < prefix ? -1 : 1;
+
+      size_t keySize = LittleEndian::load_u16(slot + OFFSET_SIZE);
+      if (keySize <= KEY_PREFIX_SIZE && key.size() <= KEY_PREFIX_SIZE)
+        return (keySize > key.size()) - (keySize < key.size());
+    }
+  }
+
+  if (isInt64()) {
+    auto stored = getKey(index);
+    return Order::compare(stored.data(), stored.size(), key.data(),
+                          key.size());
   }
-  return res;
+
+  EntryView e = entryAt(index);
+  return Order::compare(e.key, e.keySize, key.data(), key.size());
 }
 
 // this function doesn't respect any key/value after index
@@ -112,20 +333,49 @@ std::vector<uint8_t> BNode::getValue(uint16_t index) const {
 void BNode::setPtrAndKeyValue(uint16_t index, uint32_t ptr,
                               const std::vector<uint8_t> &key,
                               const std::vector<uint8_t> &value) {
-  setPtr(index, ptr);
+  if (ptrStride() == PTR_SIZE)
+    setPtr(index, ptr);
+  else
+    assert(ptr == 0);
+
+  // int64 nodes keep the key in the dense array only
+  size_t entryKeySize = key.size();
+  if (isInt64()) {
+    assert(key.size() == INT64_KEY_SIZE);
+    LittleEndian::store_u64(denseKeysPtr() + INT64_KEY_SIZE * index,
+                            encodeInt64Key(key.data()));
+    entryKeySize = 0;
+  }
 
   uint16_t pos = getKeyValuePos(index);
+  size_t headerSize = entryHeaderSize(entryKeySize, value.size());
+  size_t recordSize = headerSize + entryKeySize + value.size();
+  assert(pos + recordSize <= data_.size());
+
+  uint8_t *entry = data_.data() + pos;
+  if (isCompact()) {
+    uint8_t *p = putVarint(entry, entryKeySize);
+    if (getType() == BNODE_LEAF)
+      p = putVarint(p, value.size());
+    assert(p == entry + headerSize);
+  } else {
+    LittleEndian::store_u16(entry, static_cast<uint16_t>(entryKeySize));
+    LittleEndian::store_u16(entry + KEY_SIZE_FIELD_SIZE,
+                            static_cast<uint16_t>(value.size()));
+  }
+  if (entryKeySize)
+    memcpy(entry + headerSize, key.data(), entryKeySize);
+  if (!value.empty())
+    memcpy(entry + headerSize + entryKeySize, value.data(), value.size());
+
+  if (slotStride() == SLOT_SIZE) {
+    uint8_t *slot = data_.data() + offsetsPos() + SLOT_SIZE * index;
+    LittleEndian::store_u16(slot + OFFSET_SIZE,
+                            static_cast<uint16_t>(key.size()));
+    BigEndian::store_u32(slot + OFFSET_SIZE + KEY_SIZE_FIELD_SIZE,
+                         keyPrefix(key.data(), key.size()));
+  }
 
-  LittleEndian::write_u16(data_, pos + 0, static_cast<uint16_t>(key.size()));
-  LittleEndian::write_u16(data_, pos + 2, static_cast<uint16_t>(value.size()));
-
-  size_t recordSize = ENTRY_HEADER_SIZE;
-  memcpy(data_.data() + pos + recordSize, key.data(), key.size());
-
-  recordSize += key.size();
-  memcpy(data_.data() + pos + recordSize, value.data(), value.size());
-
-  recordSize += value.size();
   uint32_t newOffset = static_cast<uint32_t>(getOffset(index)) + recordSize;
 
   assert(newOffset <= UINT16_MAX);
@@ -134,6 +384,11 @@ void BNode::setPtrAndKeyValue(uint16_t index, uint32_t ptr,
   assert(getOffset(index + 1) == static_cast<uint16_t>(newOffset));
 }
 
+// Copies n entries as three block moves: the pointer (and count) arrays, the
+// KV bytes and the offsets/slots, whose offsets are then rebased onto this
+// node.
+// The end of the range comes from the last entry's own header rather than
+// the source's trailing offset, like the old entry-by-entry copy did.
 void BNode::copyRange(const BNode &srcNode, uint16_t dstStartIndex,
                       uint16_t srcStartIndex, uint16_t n) {
   if (n == 0)
@@ -141,33 +396,92 @@ void BNode::copyRange(const BNode &srcNode, uint16_t dstStartIndex,
 
   assert(dstStartIndex + n <= getNumOfKeys());
   assert(srcStartIndex + n <= srcNode.getNumOfKeys());
+  assert(slotStride() == srcNode.slotStride());
+  assert(countStride() == srcNode.countStride());
+
+  assert(ptrStride() == srcNode.ptrStride());
+
+  const size_t ptrs = ptrStride();
+  memcpy(data_.data() + PAGE_HEADER_SIZE + ptrs * dstStartIndex,
+         srcNode.data_.data() + PAGE_HEADER_SIZE + ptrs * srcStartIndex,
+         ptrs * n);
+  if (hasCounts())
+    memcpy(data_.data() + countsPos() + COUNT_SIZE * dstStartIndex,
+           srcNode.data_.data() + srcNode.countsPos() +
+               COUNT_SIZE * srcStartIndex,
+           COUNT_SIZE * n);
+
+  uint16_t srcLast = srcStartIndex + n - 1;
+  size_t srcBegin = srcNode.getOffset(srcStartIndex);
+  size_t srcEnd = srcNode.getOffset(srcLast) + srcNode.entrySize(srcLast);
+  size_t dstBegin = getOffset(dstStartIndex);
+  size_t bytes = srcEnd - srcBegin;
+
+  assert(kvPos() + dstBegin + bytes <= data_.size());
+  assert(dstBegin + bytes <= UINT16_MAX);
+  memcpy(data_.data() + kvPos() + dstBegin,
+         srcNode.data_.data() + srcNode.kvPos() + srcBegin, bytes);
+
+  // slot i holds offsets[i + 1], so slots [start, start + n - 1) carry the
+  // offsets that need rebasing; the last one is set from bytes below
+  const size_t stride = slotStride();
+  uint8_t *dstSlots = data_.data() + offsetsPos() + stride * dstStartIndex;
+  memcpy(dstSlots,
+         srcNode.data_.data() + srcNode.offsetsPos() + stride * srcStartIndex,
+         stride * n);
+
+  uint16_t delta = static_cast<uint16_t>(dstBegin - srcBegin);
+  if (stride == OFFSET_SIZE) {
+    uint16_t chunk[256];
+    for (uint16_t done = 0; done < n - 1;) {
+      uint16_t m = std::min<uint16_t>(n - 1 - done, 256);
+      uint8_t *p = dstSlots + OFFSET_SIZE * done;
+      LittleEndian::load_u16_array(p, chunk, m);
+      for (uint16_t i = 0; i < m; i++)
+        chunk[i] = static_cast<uint16_t>(chunk[i] + delta);
+      LittleEndian::store_u16_array(p, chunk, m);
+      done += m;
+    }
+  } else {
+    for (uint16_t i = 0; i + 1 < n; i++) {
+      uint8_t *p = dstSlots + stride * i;
+      LittleEndian::store_u16(p, LittleEndian::load_u16(p) + delta);
+    }
+  }
+  setOffset(dstStartIndex + n, static_cast<uint16_t>(dstBegin + bytes));
 
-  for (uint16_t i = 0; i < n; i++) {
-    auto srcKey = srcNode.getKey(srcStartIndex + i);
-    auto srcValue = srcNode.getValue(srcStartIndex + i);
-    uint32_t ptr = srcNode.getPtr(srcStartIndex + i);
-
-    uint16_t pos = getKeyValuePos(dstStartIndex + i);
-
-    size_t requiredSize =
-        pos + ENTRY_HEADER_SIZE + srcKey.size() + srcValue.size();
-
-    assert(requiredSize <= data_.size());
-
-    setPtrAndKeyValue(dstStartIndex + i, ptr, srcKey, srcValue);
+  if (isInt64()) {
+    assert(srcNode.isInt64());
+    memcpy(denseKeysPtr() + INT64_KEY_SIZE * dstStartIndex,
+           srcNode.denseKeysPtr() + INT64_KEY_SIZE * srcStartIndex,
+           INT64_KEY_SIZE * n);
   }
 }
 
+uint16_t BNode::indexLookup(const std::vector<uint8_t> &key) const {
+  return indexLookup<BytewiseOrder>(key);
+}
+
+template <typename Order>
 uint16_t BNode::indexLookup(const std::vector<uint8_t> &key) const {
   uint16_t nkeys = getNumOfKeys();
   if (nkeys == 0)
     return 0;
 
+  uint32_t prefix = keyPrefix(key.data(), key.size());
   uint16_t l = 0, r = nkeys;
 
+  // int64 nodes get the lower bound from the dense array in one go
+  if constexpr (std::is_same_v<Order, BytewiseOrder>) {
+    if (isInt64() && key.size() == INT64_KEY_SIZE) {
+      l = int64LowerBound(denseKeysPtr(), nkeys, encodeInt64Key(key.data()));
+      r = l;
+    }
+  }
+
   while (l < r) {
     uint16_t mid = l + (r - l) / 2;
-    int cmp = keyCompare(getKey(mid), key);
+    int cmp = compareKeyAt<Order>(mid, key, prefix);
 
     if (cmp < 0) {
       l = mid + 1;
@@ -183,18 +497,28 @@ uint16_t BNode::indexLookup(const std::vector<uint8_t> &key) const {
     return l;
   }
 
-  if (keyCompare(getKey(l), key) != 0 && getType() == BNODE_INTERNAL && l > 0) {
+  if (compareKeyAt<Order>(l, key, prefix) != 0 &&
+      getType() == BNODE_INTERNAL && l > 0) {
     return l - 1;
   }
 
   return l;
 }
 
+template uint16_t
+BNode::indexLookup<BytewiseOrder>(const std::vector<uint8_t> &key) const;
+template uint16_t
+BNode::indexLookup<U64Order>(const std::vector<uint8_t> &key) const;
+template uint16_t
+BNode::indexLookup<ReverseOrder>(const std::vector<uint8_t> &key) const;
+template uint16_t
+BNode::indexLookup<TupleOrder>(const std::vector<uint8_t> &key) const;
+
 BNode BNode::leafInsert(uint16_t index, const std::vector<uint8_t> &key,
                         const std::vector<uint8_t> &value) const {
 
-  BNode newNode(2 * BTREE_PAGE_SIZE);
-  newNode.setHeader(BNODE_LEAF, getNumOfKeys() + 1);
+  BNode newNode(workSize());
+  newNode.setHeader(BNODE_LEAF, getNumOfKeys() + 1, getFormat());
   newNode.copyRange(*this, 0, 0, index);
   newNode.setPtrAndKeyValue(index, 0, key, value);
   newNode.copyRange(*this, index + 1, index, getNumOfKeys() - index);
@@ -204,8 +528,8 @@ BNode BNode::leafInsert(uint16_t index, const std::vector<uint8_t> &key,
 BNode BNode::leafUpdate(uint16_t index, const std::vector<uint8_t> &key,
                         const std::vector<uint8_t> &value) const {
 
-  BNode newNode(2 * BTREE_PAGE_SIZE);
-  newNode.setHeader(BNODE_LEAF, getNumOfKeys());
+  BNode newNode(workSize());
+  newNode.setHeader(BNODE_LEAF, getNumOfKeys(), getFormat());
   newNode.copyRange(*this, 0, 0, index);
   newNode.setPtrAndKeyValue(index, 0, key, value);
   newNode.copyRange(*this, index + 1, index + 1, getNumOfKeys() - index - 1);
@@ -220,21 +544,40 @@ std::pair<BNode, BNode> BNode::splitHalf() const {
 
   // Left = arbitrary size
   // Right = MUST fit on a single page
-  BNode left(2 * BTREE_PAGE_SIZE);
-  BNode right(BTREE_PAGE_SIZE);
-
-  uint16_t splitIndex = 0;
-  for (uint16_t i = 1; i < total; i++) {
-
-    BNode tmp(2 * BTREE_PAGE_SIZE);
-    tmp.setHeader(getType(), total - i);
+  BNode left(workSize());
+  BNode right(workSize());
 
+  auto rightFits = [&](uint16_t i) {
+    BNode tmp(workSize());
+    tmp.setHeader(getType(), total - i, getFormat());
     tmp.copyRange(*this, 0, i, total - i);
+    return tmp.fitsPage();
+  };
 
-    if (tmp.size() <= BTREE_PAGE_SIZE) {
-      splitIndex = i;
-      break;
+  // A compressed leaf is cut at its middle byte when the right half packs,
+  // leaving both halves room to take inserts before they split again.
+  uint16_t splitIndex = 0;
+  if (isCompressed()) {
+    uint16_t mid = 1;
+    while (mid + 1 < total && getOffset(mid) < getOffset(total) / 2)
+      mid++;
+    if (rightFits(mid))
+      splitIndex = mid;
+  }
+
+  // Otherwise the right side is made as big as fits. It only shrinks as
+  // the split index grows, so that index is found by bisection; each probe
+  // of a compressed leaf compresses it.
+  if (splitIndex == 0) {
+    uint16_t lo = 1, hi = total;
+    while (lo < hi) {
+      uint16_t mid = lo + (hi - lo) / 2;
+      if (rightFits(mid))
+        hi = mid;
+      else
+        lo = mid + 1;
     }
+    splitIndex = lo;
   }
 
   // Must find a split point
@@ -243,39 +586,46 @@ std::pair<BNode, BNode> BNode::splitHalf() const {
   const uint16_t leftN = splitIndex;
   const uint16_t rightN = total - splitIndex;
 
-  left.setHeader(getType(), leftN);
+  left.setHeader(getType(), leftN, getFormat());
   left.copyRange(*this, 0, 0, leftN);
 
-  right.setHeader(getType(), rightN);
+  right.setHeader(getType(), rightN, getFormat());
   right.copyRange(*this, 0, splitIndex, rightN);
 
-  assert(right.size() <= BTREE_PAGE_SIZE);
-  return {left, right};
+  assert(right.fitsPage());
+  return {std::move(left), std::move(right)};
 }
 
-std::vector<BNode> BNode::splitToFitPage() const {
-  if (size() <= BTREE_PAGE_SIZE) {
-    BNode copy = *this;
-    copy.data_.resize(BTREE_PAGE_SIZE);
-    return {copy};
-  }
+// Nodes are moved into the result rather than listed in a braced
+// initializer, which would copy every page. A plain node is at most two
+// pages and splits into three at most; a compressed leaf that compresses
+// poorly may take more.
+std::vector<BNode> BNode::splitToFitPage() const & {
+  if (fitsPage())
+    return BNode(*this).splitToFitPage();
 
-  auto [leftNode, rightNode] = splitHalf();
+  std::vector<BNode> nodes;
+  nodes.reserve(3);
 
-  if (leftNode.size() <= BTREE_PAGE_SIZE) {
-    leftNode.data_.resize(BTREE_PAGE_SIZE);
-    rightNode.data_.resize(BTREE_PAGE_SIZE);
-    return {leftNode, rightNode};
+  auto [leftNode, rightNode] = splitHalf();
+  nodes.push_back(std::move(rightNode));
+  while (!leftNode.fitsPage()) {
+    auto [leftLeftNode, middleNode] = leftNode.splitHalf();
+    nodes.push_back(std::move(middleNode));
+    leftNode = std::move(leftLeftNode);
   }
+  nodes.push_back(std::move(leftNode));
+  std::reverse(nodes.begin(), nodes.end());
+  return nodes;
+}
 
-  auto [leftLeftNode, middleNode] = leftNode.splitHalf();
-
-  rightNode.data_.resize(BTREE_PAGE_SIZE);
-
-  assert(leftLeftNode.size() <= BTREE_PAGE_SIZE);
-  assert(middleNode.size() <= BTREE_PAGE_SIZE);
+std::vector<BNode> BNode::splitToFitPage() && {
+  if (!fitsPage())
+    return static_cast<const BNode &>(*this).splitToFitPage();
 
-  return {leftLeftNode, middleNode, rightNode};
+  std::vector<BNode> nodes;
+  nodes.push_back(std::move(*this));
+  return nodes;
 }
 
 BNode BNode::updateLinks(uint16_t index,
@@ -284,7 +634,7 @@ BNode BNode::updateLinks(uint16_t index,
   BNode newNode(2 * BTREE_PAGE_SIZE);
   uint16_t newNumKeys = getNumOfKeys() + nodes.size() - 1;
 
-  newNode.setHeader(BNODE_INTERNAL, newNumKeys);
+  newNode.setHeader(BNODE_INTERNAL, newNumKeys, getFormat());
 
   newNode.copyRange(*this, 0, 0, index);
 
@@ -293,6 +643,9 @@ BNode BNode::updateLinks(uint16_t index,
 
     newNode.setPtrAndKeyValue(index + i, 0, separatorKey,
                               std::vector<uint8_t>());
+    if (newNode.hasCounts())
+      newNode.setCount(index + i,
+                       static_cast<uint32_t>(nodes[i].subtreeCount()));
   }
 
   newNode.copyRange(*this, index + nodes.size(), index + 1,
@@ -300,35 +653,19 @@ BNode BNode::updateLinks(uint16_t index,
   return newNode;
 }
 
-BNode BNode::updateLink(uint16_t index, BNode &node) const {
-
-  BNode newNode(BTREE_PAGE_SIZE);
-  uint16_t newNumKeys = getNumOfKeys();
-
-  newNode.setHeader(BNODE_INTERNAL, newNumKeys);
-
-  newNode.copyRange(*this, 0, 0, index);
-
-  std::vector<uint8_t> separatorKey = node.getKey(0);
-
-  newNode.setPtrAndKeyValue(index, 0, separatorKey, std::vector<uint8_t>());
-
-  newNode.copyRange(*this, index + 1, index + 1, getNumOfKeys() - index - 1);
-
-  return newNode;
-}
-
 BNode BNode::updateMergedLink(uint16_t index, BNode &node) const {
   BNode newNode(BTREE_PAGE_SIZE);
   uint16_t newNumKeys = getNumOfKeys() - 1;
 
-  newNode.setHeader(BNODE_INTERNAL, newNumKeys);
+  newNode.setHeader(BNODE_INTERNAL, newNumKeys, getFormat());
 
   newNode.copyRange(*this, 0, 0, index);
 
   std::vector<uint8_t> separatorKey = node.getKey(0);
 
   newNode.setPtrAndKeyValue(index, 0, separatorKey, std::vector<uint8_t>());
+  if (newNode.hasCounts())
+    newNode.setCount(index, static_cast<uint32_t>(node.subtreeCount()));
 
   newNode.copyRange(*this, index + 1, index + 2, getNumOfKeys() - index - 2);
 
@@ -336,8 +673,8 @@ BNode BNode::updateMergedLink(uint16_t index, BNode &node) const {
 }
 
 BNode BNode::leafDelete(uint16_t index) const {
-  BNode newNode(BTREE_PAGE_SIZE);
-  newNode.setHeader(BNODE_LEAF, getNumOfKeys() - 1);
+  BNode newNode(data_.size());
+  newNode.setHeader(BNODE_LEAF, getNumOfKeys() - 1, getFormat());
   newNode.copyRange(*this, 0, 0, index);
   newNode.copyRange(*this, index, index + 1, getNumOfKeys() - index - 1);
   return newNode;
@@ -348,7 +685,7 @@ BNode BNode::merge(const BNode &left, const BNode &right) {
   uint16_t rightN = right.getNumOfKeys();
 
   BNode newNode(BTREE_PAGE_SIZE);
-  newNode.setHeader(left.getType(), leftN + rightN);
+  newNode.setHeader(left.getType(), leftN + rightN, left.getFormat());
 
   newNode.copyRange(left, 0, 0, leftN);
   newNode.copyRange(right, leftN, 0, rightN);
@@ -364,137 +701,490 @@ BNode BNode::merge(const BNode &left, const BNode &right) {
 //
 //
 
-BTree::BTree(std::shared_ptr<Pager> p) : pager_(std::move(p)) {
+namespace {
+
+void checkNewTreeOptions(const BTreeOptions &options) {
+  if (options.keyOrder > KEY_ORDER_TUPLE)
+    throw std::invalid_argument("BTree: unknown key order");
+  if (options.keyOrder != KEY_ORDER_BYTEWISE &&
+      (options.format & BNODE_LAYOUT_MASK) == BNODE_FORMAT_INT64)
+    throw std::invalid_argument("BTree: int64 nodes need bytewise order");
+}
+
+} // namespace
+
+// One tree operation as a (possibly nested) pager transaction. Should the
+// operation throw before it is closed, an outermost transaction is aborted
+// and the tree's root put back; inside an outer transaction that is left to
+// whoever owns it (see Database::abortTxn).
+class BTree::TxnScope {
+public:
+  explicit TxnScope(BTree &tree) : tree_(tree), root_(tree.rootPage_) {
+    tree_.pager_->beginTxn();
+  }
+
+  ~TxnScope() {
+    if (closed_ || tree_.pager_->txnDepth() != 1)
+      return;
+    try {
+      tree_.pager_->abortTxn();
+    } catch (...) {
+      // the file is left as of its last commit either way
+    }
+    tree_.rootPage_ = root_;
+  }
+
+  // publishes the tree's root and closes this level
+  void commit() {
+    tree_.publishRoot();
+    tree_.pager_->commitTxn();
+    closed_ = true;
+  }
+
+  // closes this level when the operation changed nothing
+  void finish() {
+    tree_.pager_->commitTxn();
+    closed_ = true;
+  }
+
+private:
+  BTree &tree_;
+  uint32_t root_;
+  bool closed_ = false;
+};
+
+BTree::BTree(std::shared_ptr<Pager> p, BTreeOptions options)
+    : pager_(std::move(p)), options_(options) {
+  if (pager_->metaFlags() & META_FLAG_CATALOG)
+    throw std::invalid_argument("BTree: file holds named trees, use Database");
   rootPage_ = pager_->rootPage();
   if (rootPage_ == 0) {
+    checkNewTreeOptions(options_);
+    pager_->setKeyOrder(options_.keyOrder);
+
     BNode rootNode(BTREE_PAGE_SIZE);
-    rootNode.setHeader(BNODE_LEAF, 0);
-    rootPage_ = pager_->createPage(rootNode.data());
+    rootNode.setHeader(BNODE_LEAF, 0, options_.format);
+    rootPage_ = pager_->createPage(rootNode.release());
   }
+  keyOrder_ = pager_->keyOrder();
+  filterDue_ = true;
+  rebuildFilterIfDue();
+  if (options_.valueCacheBytes > 0)
+    valueCache_ = std::make_unique<ValueCache>(options_.valueCacheBytes);
 }
 
-BTree::~BTree() { pager_->commitTxn(); }
+BTree::BTree(std::shared_ptr<Pager> p, BTreeOptions options, uint32_t root,
+             uint8_t keyOrder, RootFn publish)
+    : pager_(std::move(p)), options_(options), rootPage_(root),
+      keyOrder_(keyOrder), publish_(std::move(publish)) {
+  if (rootPage_ == 0) {
+    checkNewTreeOptions(options_);
+    keyOrder_ = options_.keyOrder;
+
+    TxnScope txn(*this);
+    BNode rootNode(BTREE_PAGE_SIZE);
+    rootNode.setHeader(BNODE_LEAF, 0, options_.format);
+    rootPage_ = pager_->createPage(rootNode.release());
+    txn.commit();
+  }
+  // inside the owner's transaction the first build waits for its commit
+  filterDue_ = true;
+  rebuildFilterIfDue();
+  if (options_.valueCacheBytes > 0)
+    valueCache_ = std::make_unique<ValueCache>(options_.valueCacheBytes);
+}
+
+// a named tree's owner commits for it
+BTree::~BTree() {
+  if (!publish_)
+    pager_->commitTxn();
+}
 
 uint32_t BTree::rootPage() const { return rootPage_; }
 
-BNode BTree::internalNodeInsert(const BNode &parent, uint16_t index,
-                                const std::vector<uint8_t> &key,
-                                const std::vector<uint8_t> &value) {
+uint8_t BTree::keyOrder() const { return keyOrder_; }
+
+void BTree::publishRoot() {
+  if (publish_)
+    publish_(rootPage_);
+  else
+    pager_->setRootPage(rootPage_);
+}
+
+void BTree::abortBatch() {
+  pager_->abortTxn();
+  rootPage_ = pager_->rootPage();
+}
+
+void BTree::rebuildFilter() {
+  if (options_.filterBitsPerKey == 0)
+    return;
+
+  // hashed first, so the filter can be sized for the keys there are
+  std::vector<uint64_t> hashes;
+  scan({}, {},
+       [&hashes](const std::vector<uint8_t> &key,
+                 const std::vector<uint8_t> &) {
+         hashes.push_back(BloomFilter::hash(key.data(), key.size()));
+         return true;
+       });
+
+  // built aside, so lookups only wait for the swap
+  uint64_t capacity = std::max<uint64_t>(2 * hashes.size(), 1024);
+  auto filter =
+      std::make_unique<BloomFilter>(capacity, options_.filterBitsPerKey);
+  for (uint64_t h : hashes)
+    filter->addHash(h);
+  {
+    std::lock_guard<std::mutex> lock(filterMu_);
+    filter_.swap(filter);
+    filterCapacity_ = capacity;
+    filterKeys_ = hashes.size();
+    filterRemoved_ = 0;
+  }
+  filterDue_ = false;
+}
+
+bool BTree::rebuildFilterIfDue() {
+  if (!filterDue_ || pager_->inTxn())
+    return false;
+  rebuildFilter();
+  return true;
+}
+
+void BTree::filterAdd(const std::vector<uint8_t> &key) {
+  // a rebuild left over from an outer transaction already has the key
+  if (options_.filterBitsPerKey == 0 || rebuildFilterIfDue())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(filterMu_);
+    if (!filter_)
+      return;
+    filter_->add(key.data(), key.size());
+    if (++filterKeys_ > filterCapacity_)
+      filterDue_ = true;
+  }
+  rebuildFilterIfDue();
+}
+
+void BTree::filterRemoved() {
+  if (options_.filterBitsPerKey == 0 || rebuildFilterIfDue())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(filterMu_);
+    if (filter_ && ++filterRemoved_ > filterCapacity_ / 2)
+      filterDue_ = true;
+  }
+  rebuildFilterIfDue();
+}
+
+bool BTree::filterPasses(const std::vector<uint8_t> &key) const {
+  if (options_.filterBitsPerKey == 0)
+    return true;
+  std::lock_guard<std::mutex> lock(filterMu_);
+  if (!filter_ || filter_->mayContain(key.data(), key.size()))
+    return true;
+  filterRuledOut_.fetch_add(1, std::memory_order_relaxed);
+  return false;
+}
+
+ValueCache *BTree::readCache() const {
+  return valueCache_ && !pager_->inTxn() ? valueCache_.get() : nullptr;
+}
+
+ValueCache::Stats BTree::valueCacheStats() const {
+  return valueCache_ ? valueCache_->stats() : ValueCache::Stats();
+}
+
+BTree::FilterStats BTree::filterStats() const {
+  FilterStats stats;
+  std::lock_guard<std::mutex> lock(filterMu_);
+  if (!filter_)
+    return stats;
+  stats.memoryBytes = filter_->memoryBytes();
+  stats.keys = filterKeys_;
+  stats.removed = filterRemoved_;
+  stats.ruledOut = filterRuledOut_.load(std::memory_order_relaxed);
+  stats.falsePositives = filterFalsePositives_.load(std::memory_order_relaxed);
+  stats.expectedFalsePositiveRate =
+      filter_->expectedFalsePositiveRate(filterKeys_);
+  return stats;
+}
+
+int BTree::compareKeys(const std::vector<uint8_t> &a,
+                       const std::vector<uint8_t> &b) const {
+  switch (keyOrder_) {
+  case KEY_ORDER_U64:
+    return U64Order::compare(a.data(), a.size(), b.data(), b.size());
+  case KEY_ORDER_REVERSE:
+    return ReverseOrder::compare(a.data(), a.size(), b.data(), b.size());
+  case KEY_ORDER_TUPLE:
+    return TupleOrder::compare(a.data(), a.size(), b.data(), b.size());
+  default:
+    return BytewiseOrder::compare(a.data(), a.size(), b.data(), b.size());
+  }
+}
+
+void BTree::checkKey(const std::vector<uint8_t> &key, const char *op) const {
+  if (keyOrder_ == KEY_ORDER_U64 && key.size() != sizeof(uint64_t))
+    throw std::invalid_argument(std::string(op) +
+                                ": u64 order keys must be 8 bytes");
+}
+
+uint16_t BTree::lookup(const BNode &node,
+                       const std::vector<uint8_t> &key) const {
+  switch (keyOrder_) {
+  case KEY_ORDER_U64:
+    return node.indexLookup<U64Order>(key);
+  case KEY_ORDER_REVERSE:
+    return node.indexLookup<ReverseOrder>(key);
+  case KEY_ORDER_TUPLE:
+    return node.indexLookup<TupleOrder>(key);
+  default:
+    return node.indexLookup<BytewiseOrder>(key);
+  }
+}
+
+std::optional<BNode>
+BTree::internalNodeInsert(const BNode &parent, uint16_t index,
+                          const std::vector<uint8_t> &key,
+                          const UpdateFn &fn) {
   uint32_t childPtr = parent.getPtr(index);
   BNode childNode(pager_->readPage(childPtr));
 
-  BNode updatedChild = recursiveInsert(childNode, key, value);
+  auto updatedChild = recursiveInsert(childNode, key, fn);
+  if (!updatedChild.has_value())
+    return std::nullopt;
 
-  std::vector<BNode> nodes = updatedChild.splitToFitPage();
+  std::vector<BNode> nodes = std::move(*updatedChild).splitToFitPage();
 
+  // the first part goes near the page it replaces, later parts after their
+  // left sibling
   auto newNode = parent.updateLinks(index, nodes);
+  uint32_t near = childPtr;
   for (size_t i = 0; i < nodes.size(); i++) {
-    uint32_t newChildPtr = pager_->createPage(nodes[i].data());
-    newNode.setPtr(index + i, newChildPtr);
+    near = pager_->createPage(nodes[i].release(), near);
+    newNode.setPtr(index + i, near);
   }
   pager_->deletePage(childPtr);
   return newNode;
 }
 
-BNode BTree::recursiveInsert(const BNode &node, const std::vector<uint8_t> &key,
-                             const std::vector<uint8_t> &value) {
-  auto index = node.indexLookup(key);
+std::optional<BNode> BTree::recursiveInsert(const BNode &node,
+                                            const std::vector<uint8_t> &key,
+                                            const UpdateFn &fn) {
+  auto index = lookup(node, key);
 
   switch (node.getType()) {
-  case BNODE_LEAF:
-    if (index < node.getNumOfKeys() &&
-        keyCompare(key, node.getKey(index)) == 0) {
-      return node.leafUpdate(index, key, value);
-    } else {
-      return node.leafInsert(index, key, value);
-    }
+  case BNODE_LEAF: {
+    bool found = index < node.getNumOfKeys() &&
+                 compareKeys(key, node.getKey(index)) == 0;
+    std::optional<std::vector<uint8_t>> current;
+    if (found)
+      current = node.getValue(index);
+    auto value = fn(current ? &*current : nullptr);
+    if (!value.has_value() || value == current)
+      return std::nullopt;
+    if (key.size() + value->size() > MAX_ENTRY_SIZE)
+      throw std::invalid_argument("update: entry too large");
+    if (found)
+      return node.leafUpdate(index, key, *value);
+    return node.leafInsert(index, key, *value);
+  }
   case BNODE_INTERNAL:
-    return internalNodeInsert(node, index, key, value);
+    return internalNodeInsert(node, index, key, fn);
   default:
     node.hexDump();
     assert(false && "bad node");
+    throw std::runtime_error("bad node");
   }
 }
 
 uint32_t BTree::insert(const std::vector<uint8_t> &key,
                        const std::vector<uint8_t> &value) {
-  pager_->beginTxn();
   assert(key.size() != 0);
   assert(key.size() + value.size() <= MAX_ENTRY_SIZE);
 
+  update(key, [&value](const std::vector<uint8_t> *) { return value; });
+  return rootPage_;
+}
+
+bool BTree::update(const std::vector<uint8_t> &key, const UpdateFn &fn) {
+  assert(key.size() != 0);
+  checkKey(key, "update");
+
   BNode rootNode(pager_->readPage(rootPage_));
-  BNode newRoot = recursiveInsert(rootNode, key, value);
+  if (!rootNode.acceptsKey(key))
+    throw std::invalid_argument("update: key doesn't fit the tree's format");
+
+  TxnScope txn(*this);
+  auto newRoot = recursiveInsert(rootNode, key, fn);
+  if (!newRoot.has_value()) {
+    txn.finish();
+    return false;
+  }
+
+  pager_->deletePage(rootPage_);
+  installRoot(std::move(*newRoot));
 
-  std::vector<BNode> nodes = newRoot.splitToFitPage();
+  txn.commit();
+  filterAdd(key);
+  if (valueCache_)
+    valueCache_->erase(key);
+  return true;
+}
+
+bool BTree::putIfAbsent(const std::vector<uint8_t> &key,
+                        const std::vector<uint8_t> &value) {
+  return update(key, [&value](const std::vector<uint8_t> *current)
+                         -> std::optional<std::vector<uint8_t>> {
+    if (current)
+      return std::nullopt;
+    return value;
+  });
+}
+
+bool BTree::compareAndSwap(const std::vector<uint8_t> &key,
+                           const std::vector<uint8_t> &expected,
+                           const std::vector<uint8_t> &desired) {
+  // a swap to the value already there changes nothing, but still succeeds
+  bool matched = false;
+  update(key, [&](const std::vector<uint8_t> *current)
+                  -> std::optional<std::vector<uint8_t>> {
+    matched = current && *current == expected;
+    if (!matched)
+      return std::nullopt;
+    return desired;
+  });
+  return matched;
+}
+
+std::map<std::string, BTree::MergeFn> BTree::builtinMergeOperators() {
+  std::map<std::string, MergeFn> ops;
+  ops["add64"] = [](const std::vector<uint8_t> *current,
+                    const std::vector<uint8_t> &operand) {
+    if (operand.size() != 8 || (current && current->size() != 8))
+      throw std::invalid_argument("add64: values must be 8 bytes");
+    uint64_t sum = LittleEndian::load_u64(operand.data());
+    if (current)
+      sum += LittleEndian::load_u64(current->data());
+    std::vector<uint8_t> out(8);
+    LittleEndian::store_u64(out.data(), sum);
+    return out;
+  };
+  ops["append"] = [](const std::vector<uint8_t> *current,
+                     const std::vector<uint8_t> &operand) {
+    std::vector<uint8_t> out = current ? *current : std::vector<uint8_t>();
+    out.insert(out.end(), operand.begin(), operand.end());
+    return out;
+  };
+  return ops;
+}
+
+void BTree::registerMergeOperator(const std::string &name, MergeFn fn) {
+  mergeOperators_[name] = std::move(fn);
+}
+
+bool BTree::merge(const std::string &name, const std::vector<uint8_t> &key,
+                  const std::vector<uint8_t> &operand) {
+  auto it = mergeOperators_.find(name);
+  if (it == mergeOperators_.end())
+    throw std::invalid_argument("merge: no operator " + name);
+  const MergeFn &op = it->second;
+  return update(key, [&op, &operand](const std::vector<uint8_t> *current) {
+    return std::optional<std::vector<uint8_t>>(op(current, operand));
+  });
+}
+
+void BTree::installRoot(BNode &&root) {
+  std::vector<BNode> nodes = std::move(root).splitToFitPage();
 
   if (nodes.size() == 1) {
-    uint32_t newRootPage = pager_->createPage(nodes[0].data());
-    pager_->deletePage(rootPage_);
-    rootPage_ = newRootPage;
-  } else {
-    BNode newRootNode(BTREE_PAGE_SIZE);
-    newRootNode.setHeader(BNODE_INTERNAL, nodes.size());
+    rootPage_ = pager_->createPage(nodes[0].release(), rootPage_);
+    return;
+  }
 
-    for (size_t i = 0; i < nodes.size(); i++) {
-      uint32_t childPage = pager_->createPage(nodes[i].data());
-      newRootNode.setPtrAndKeyValue(i, childPage, nodes[i].getKey(0),
-                                    std::vector<uint8_t>());
-    }
+  BNode newRootNode(BTREE_PAGE_SIZE);
+  newRootNode.setHeader(BNODE_INTERNAL, nodes.size(), nodes[0].getFormat());
 
-    uint32_t newRootPage = pager_->createPage(newRootNode.data());
-    pager_->deletePage(rootPage_);
-    rootPage_ = newRootPage;
+  uint32_t near = rootPage_;
+  for (size_t i = 0; i < nodes.size(); i++) {
+    std::vector<uint8_t> firstKey = nodes[i].getKey(0);
+    uint64_t count = newRootNode.hasCounts() ? nodes[i].subtreeCount() : 0;
+    near = pager_->createPage(nodes[i].release(), near);
+    newRootNode.setPtrAndKeyValue(i, near, firstKey, std::vector<uint8_t>());
+    if (newRootNode.hasCounts())
+      newRootNode.setCount(i, static_cast<uint32_t>(count));
   }
 
-  pager_->setRootPage(rootPage_);
-  pager_->commitTxn();
-  return rootPage_;
+  rootPage_ = pager_->createPage(newRootNode.release(), rootPage_);
 }
 
 bool BTree::remove(const std::vector<uint8_t> &key) {
   assert(key.size() != 0);
   assert(key.size() <= MAX_ENTRY_SIZE);
+  checkKey(key, "remove");
 
-  pager_->beginTxn();
+  TxnScope txn(*this);
 
   BNode rootNode(pager_->readPage(rootPage_));
   auto newRootOpt = recursiveDelete(rootNode, key);
 
   if (!newRootOpt.has_value()) {
+    txn.finish();
     return false;
   }
 
-  auto newRoot = *newRootOpt;
+  BNode &newRoot = *newRootOpt;
 
   if (newRoot.getNumOfKeys() == 1 && newRoot.getType() == BNODE_INTERNAL) {
     pager_->deletePage(rootPage_);
     rootPage_ = newRoot.getPtr(0);
-  } else {
-    uint32_t newRootPage = pager_->createPage(newRoot.data());
+  } else if (newRoot.fitsPage()) {
+    uint32_t newRootPage = pager_->createPage(newRoot.release(), rootPage_);
     pager_->deletePage(rootPage_);
     rootPage_ = newRootPage;
+  } else {
+    pager_->deletePage(rootPage_);
+    installRoot(std::move(newRoot));
   }
 
-  pager_->setRootPage(rootPage_);
-  pager_->commitTxn();
+  txn.commit();
+  filterRemoved();
+  if (valueCache_)
+    valueCache_->erase(key);
   return true;
 }
 
 std::optional<std::vector<uint8_t>>
 BTree::search(const std::vector<uint8_t> &key) const {
-  return searchRecursive(rootPage_, key);
+  if (!filterPasses(key))
+    return std::nullopt;
+  ValueCache *cache = readCache();
+  uint64_t generation = 0;
+  if (cache) {
+    if (auto value = cache->get(key))
+      return value;
+    generation = cache->generation(key);
+  }
+  auto result = searchRecursive(rootPage_, key);
+  if (options_.filterBitsPerKey && !result.has_value())
+    filterFalsePositives_.fetch_add(1, std::memory_order_relaxed);
+  if (cache && result.has_value())
+    cache->put(key, *result, generation);
+  return result;
 }
 
 std::optional<std::vector<uint8_t>>
 BTree::searchRecursive(uint32_t pagePtr,
                        const std::vector<uint8_t> &key) const {
   BNode node(pager_->readPage(pagePtr));
-  uint16_t index = node.indexLookup(key);
+  uint16_t index = lookup(node, key);
 
   switch (node.getType()) {
   case BNODE_LEAF: {
     if (index < node.getNumOfKeys() &&
-        keyCompare(key, node.getKey(index)) == 0) {
+        compareKeys(key, node.getKey(index)) == 0) {
       return node.getValue(index);
     }
     return std::nullopt;
@@ -511,26 +1201,206 @@ BTree::searchRecursive(uint32_t pagePtr,
   }
 }
 
+uint64_t BTree::subtreeKeys(uint32_t pagePtr) const {
+  BNode node(pager_->readPage(pagePtr));
+  if (node.getType() == BNODE_LEAF || node.hasCounts())
+    return node.subtreeCount();
+  if (node.getType() != BNODE_INTERNAL)
+    throw std::runtime_error("bad node");
+  uint64_t total = 0;
+  for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+    total += subtreeKeys(node.getPtr(i));
+  return total;
+}
+
+uint64_t BTree::childCount(const BNode &node, uint16_t i) const {
+  return node.hasCounts() ? node.getCount(i) : subtreeKeys(node.getPtr(i));
+}
+
+uint64_t BTree::rank(const std::vector<uint8_t> &key) const {
+  // keys under the children left of the path, then those before key in
+  // the leaf the path ends at
+  uint64_t before = 0;
+  BNode node(pager_->readPage(rootPage_));
+  while (node.getType() == BNODE_INTERNAL) {
+    uint16_t index = lookup(node, key);
+    for (uint16_t i = 0; i < index; i++)
+      before += childCount(node, i);
+    node = BNode(pager_->readPage(node.getPtr(index)));
+  }
+  if (node.getType() != BNODE_LEAF)
+    throw std::runtime_error("bad node");
+  return before + lookup(node, key);
+}
+
+uint64_t BTree::count(const std::vector<uint8_t> &lo,
+                      const std::vector<uint8_t> &hi) const {
+  uint64_t upper = hi.empty() ? subtreeKeys(rootPage_) : rank(hi);
+  uint64_t lower = lo.empty() ? 0 : rank(lo);
+  return upper > lower ? upper - lower : 0;
+}
+
+std::optional<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+BTree::at(uint64_t n) const {
+  BNode node(pager_->readPage(rootPage_));
+  while (node.getType() == BNODE_INTERNAL) {
+    uint16_t nkeys = node.getNumOfKeys();
+    uint16_t i = 0;
+    for (; i < nkeys; i++) {
+      uint64_t c = childCount(node, i);
+      if (n < c)
+        break;
+      n -= c;
+    }
+    if (i == nkeys)
+      return std::nullopt;
+    node = BNode(pager_->readPage(node.getPtr(i)));
+  }
+  if (node.getType() != BNODE_LEAF)
+    throw std::runtime_error("bad node");
+  if (n >= node.getNumOfKeys())
+    return std::nullopt;
+  uint16_t index = static_cast<uint16_t>(n);
+  return std::make_pair(node.getKey(index), node.getValue(index));
+}
+
+std::vector<std::optional<std::vector<uint8_t>>>
+BTree::multiSearch(const std::vector<std::vector<uint8_t>> &keys) const {
+  std::vector<std::optional<std::vector<uint8_t>>> results(keys.size());
+  std::vector<uint32_t> pageOf(keys.size(), rootPage_);
+  std::vector<size_t> pending;
+  pending.reserve(keys.size());
+  ValueCache *cache = readCache();
+  // taken before the descent, so fills that raced a commit are dropped
+  std::vector<uint64_t> generations(cache ? keys.size() : 0);
+  size_t passed = 0;
+  for (size_t i = 0; i < keys.size(); i++) {
+    if (!filterPasses(keys[i]))
+      continue;
+    passed++;
+    if (cache)
+      results[i] = cache->get(keys[i]);
+    if (results[i].has_value())
+      continue;
+    if (cache)
+      generations[i] = cache->generation(keys[i]);
+    pending.push_back(i);
+  }
+
+  while (!pending.empty()) {
+    std::unordered_map<uint32_t, std::future<PageBuffer>> reads;
+    for (size_t k : pending) {
+      if (reads.count(pageOf[k]) == 0)
+        reads.emplace(pageOf[k], pager_->readPageAsync(pageOf[k]));
+    }
+    std::unordered_map<uint32_t, BNode> nodes;
+    for (auto &read : reads)
+      nodes.emplace(read.first, BNode(read.second.get()));
+
+    std::vector<size_t> next;
+    for (size_t k : pending) {
+      const BNode &node = nodes.at(pageOf[k]);
+      uint16_t index = lookup(node, keys[k]);
+      if (node.getType() == BNODE_INTERNAL) {
+        pageOf[k] = node.getPtr(index);
+        next.push_back(k);
+      } else if (index < node.getNumOfKeys() &&
+                 compareKeys(keys[k], node.getKey(index)) == 0) {
+        results[k] = node.getValue(index);
+        if (cache)
+          cache->put(keys[k], *results[k], generations[k]);
+      }
+    }
+    pending = std::move(next);
+  }
+
+  if (options_.filterBitsPerKey) {
+    size_t found = std::count_if(results.begin(), results.end(),
+                                 [](const auto &r) { return r.has_value(); });
+    filterFalsePositives_.fetch_add(passed - found,
+                                    std::memory_order_relaxed);
+  }
+  return results;
+}
+
+void BTree::scan(const std::vector<uint8_t> &begin,
+                 const std::vector<uint8_t> &end, const ScanFn &fn) const {
+  if (!begin.empty() && !end.empty() && compareKeys(begin, end) >= 0)
+    return;
+  scanNode(rootPage_, begin, end, fn);
+}
+
+bool BTree::scanNode(uint32_t pagePtr, const std::vector<uint8_t> &begin,
+                     const std::vector<uint8_t> &end,
+                     const ScanFn &fn) const {
+  BNode node(pager_->readPage(pagePtr));
+  uint16_t n = node.getNumOfKeys();
+  uint16_t start = begin.empty() ? 0 : lookup(node, begin);
+
+  switch (node.getType()) {
+  case BNODE_LEAF:
+    for (uint16_t i = start; i < n; i++) {
+      std::vector<uint8_t> key = node.getKey(i);
+      if (!end.empty() && compareKeys(key, end) >= 0)
+        return false;
+      if (!fn(key, node.getValue(i)))
+        return false;
+    }
+    return true;
+
+  case BNODE_INTERNAL: {
+    const uint16_t window = options_.prefetchWindow;
+    for (uint16_t i = start; i < n; i++) {
+      if (i > start && !end.empty() && compareKeys(node.getKey(i), end) >= 0)
+        return false;
+      // hint the next batch of siblings while this child is being read
+      if (window > 0 && (i - start) % window == 0)
+        prefetchChildren(node, i + 1, std::min<uint32_t>(n, i + 1 + window));
+      // only the first child can hold keys before `begin`
+      if (!scanNode(node.getPtr(i), i == start ? begin : std::vector<uint8_t>(),
+                    end, fn))
+        return false;
+    }
+    return true;
+  }
+
+  default:
+    assert(false && "bad node");
+    throw std::runtime_error("bad node");
+  }
+}
+
+void BTree::prefetchChildren(const BNode &node, uint16_t from,
+                             uint16_t to) const {
+  if (from >= to)
+    return;
+  std::vector<uint32_t> pages;
+  pages.reserve(to - from);
+  for (uint16_t i = from; i < to; i++)
+    pages.push_back(node.getPtr(i));
+  pager_->prefetch(std::move(pages));
+}
+
 std::pair<int, std::optional<BNode>>
-BTree::selectSiblingForMerge(BNode parent, uint16_t childIndex,
-                             BNode child) const {
-  if (child.size() > BTREE_PAGE_SIZE / 4) {
+BTree::selectSiblingForMerge(const BNode &parent, uint16_t childIndex,
+                             const BNode &child) const {
+  if (child.getNumOfKeys() > 0 && child.size() > options_.mergeThreshold) {
     return {0, std::nullopt};
   }
 
   if (childIndex > 0) {
     BNode sibling(pager_->readPage(parent.getPtr(childIndex - 1)));
     auto mergedSize = sibling.size() + child.size() - PAGE_HEADER_SIZE;
-    if (mergedSize <= BTREE_PAGE_SIZE) {
-      return {-1, sibling};
+    if (mergedSize <= BTREE_PAGE_USABLE_SIZE) {
+      return {-1, std::move(sibling)};
     }
   }
 
   if (childIndex + 1 < parent.getNumOfKeys()) {
     BNode sibling(pager_->readPage(parent.getPtr(childIndex + 1)));
     auto mergedSize = sibling.size() + child.size() - PAGE_HEADER_SIZE;
-    if (mergedSize <= BTREE_PAGE_SIZE) {
-      return {1, sibling};
+    if (mergedSize <= BTREE_PAGE_USABLE_SIZE) {
+      return {1, std::move(sibling)};
     }
   }
   return {0, std::nullopt};
@@ -547,7 +1417,7 @@ BTree::internalNodeDelete(const BNode &parent, uint16_t index,
     return std::nullopt;
   }
 
-  BNode updatedChild = *updatedChildOpt;
+  BNode updatedChild = std::move(*updatedChildOpt);
 
   auto [mergeDirection, siblingOpt] =
       selectSiblingForMerge(parent, index, updatedChild);
@@ -557,21 +1427,28 @@ BTree::internalNodeDelete(const BNode &parent, uint16_t index,
       assert(parent.getNumOfKeys() == 1 && index == 0);
 
       BNode newNode(BTREE_PAGE_SIZE);
-      newNode.setHeader(BNODE_INTERNAL, 0);
+      newNode.setHeader(BNODE_INTERNAL, 0, parent.getFormat());
       pager_->deletePage(childPtr);
       return newNode;
     }
 
-    auto newChildPtr = pager_->createPage(updatedChild.data());
-    auto newNode = parent.updateLink(index, updatedChild);
-    newNode.setPtr(index, newChildPtr);
+    // A compressed leaf can compress a little worse after losing an entry,
+    // and a longer separator key can overflow an internal node, so the
+    // child is split if need be; the caller splits this node in turn.
+    std::vector<BNode> nodes = std::move(updatedChild).splitToFitPage();
+    auto newNode = parent.updateLinks(index, nodes);
+    uint32_t near = childPtr;
+    for (size_t i = 0; i < nodes.size(); i++) {
+      near = pager_->createPage(nodes[i].release(), near);
+      newNode.setPtr(index + i, near);
+    }
 
     pager_->deletePage(childPtr);
     return newNode;
   }
 
   assert(siblingOpt.has_value());
-  BNode sibling = *siblingOpt;
+  BNode sibling = std::move(*siblingOpt);
 
   uint32_t siblingPtr;
   uint16_t parentIndexToReplace;
@@ -587,8 +1464,9 @@ BTree::internalNodeDelete(const BNode &parent, uint16_t index,
     mergedChild = BNode::merge(sibling, updatedChild);
   }
 
-  auto newChildPtr = pager_->createPage(mergedChild.data());
   auto newNode = parent.updateMergedLink(parentIndexToReplace, mergedChild);
+  auto newChildPtr = pager_->createPage(mergedChild.release(),
+                                        std::min(childPtr, siblingPtr));
   newNode.setPtr(parentIndexToReplace, newChildPtr);
 
   assert(siblingPtr != childPtr);
@@ -600,12 +1478,12 @@ BTree::internalNodeDelete(const BNode &parent, uint16_t index,
 std::optional<BNode>
 BTree::recursiveDelete(const BNode &node,
                        const std::vector<uint8_t> &key) const {
-  auto index = node.indexLookup(key);
+  auto index = lookup(node, key);
 
   switch (node.getType()) {
   case BNODE_LEAF:
     if (index < node.getNumOfKeys() &&
-        keyCompare(key, node.getKey(index)) == 0) {
+        compareKeys(key, node.getKey(index)) == 0) {
       return node.leafDelete(index);
     }
     return std::nullopt;
@@ -613,5 +1491,401 @@ BTree::recursiveDelete(const BNode &node,
     return internalNodeDelete(node, index, key);
   default:
     assert(false && "bad node");
+    throw std::runtime_error("bad node");
+  }
+}
+
+bool BTree::removeRange(const std::vector<uint8_t> &begin,
+                        const std::vector<uint8_t> &end) {
+  assert(begin.size() != 0 && end.size() != 0);
+  checkKey(begin, "removeRange");
+  checkKey(end, "removeRange");
+  if (compareKeys(begin, end) >= 0)
+    return false;
+
+  TxnScope txn(*this);
+
+  BNode rootNode(pager_->readPage(rootPage_));
+  auto newRootOpt = rangeDelete(rootNode, treeHeight(), begin, end, nullptr);
+
+  if (!newRootOpt.has_value()) {
+    txn.finish();
+    return false;
+  }
+
+  BNode &newRoot = *newRootOpt;
+  pager_->deletePage(rootPage_);
+
+  if (newRoot.getNumOfKeys() == 0) {
+    BNode emptyRoot(BTREE_PAGE_SIZE);
+    emptyRoot.setHeader(BNODE_LEAF, 0, newRoot.getFormat());
+    rootPage_ = pager_->createPage(emptyRoot.release(), rootPage_);
+  } else if (newRoot.getType() == BNODE_INTERNAL &&
+             newRoot.getNumOfKeys() == 1) {
+    // the range may have emptied whole levels; drop single-child roots
+    uint32_t ptr = newRoot.getPtr(0);
+    BNode child(pager_->readPage(ptr));
+    while (child.getType() == BNODE_INTERNAL && child.getNumOfKeys() == 1) {
+      pager_->deletePage(ptr);
+      ptr = child.getPtr(0);
+      child = BNode(pager_->readPage(ptr));
+    }
+    rootPage_ = ptr;
+  } else {
+    installRoot(std::move(newRoot));
+  }
+
+  txn.commit();
+  if (valueCache_) {
+    valueCache_->eraseIf([&](const std::vector<uint8_t> &key) {
+      return compareKeys(key, begin) >= 0 && compareKeys(key, end) < 0;
+    });
+  }
+  return true;
+}
+
+uint32_t BTree::compact() {
+  if (publish_ || (pager_->metaFlags() & META_FLAG_CATALOG))
+    throw std::invalid_argument("compact: not available for named trees");
+  if (pager_->inTxn())
+    throw std::runtime_error("compact: inside a transaction");
+  uint32_t before = pager_->nextPageId();
+
+  // Where the file can end: the pages in use now, less the freelist, plus
+  // the list the held pages will need once everything else is packed.
+  // With lowest-first allocation a pass moves the pages above that down;
+  // the copied parents are what the next pass tidies up. Each pass has to
+  // leave fewer pages above the end, so the loop ends.
+  size_t above = std::numeric_limits<size_t>::max();
+  for (;;) {
+    uint32_t height = treeHeight();
+    std::vector<uint32_t> live;
+    collectPages(rootPage_, height, live);
+
+    uint32_t limit = static_cast<uint32_t>(
+        pager_->nextPageId() - 1 - pager_->freePageCount() -
+        pager_->freelistPageCount() +
+        Pager::freelistPagesFor(pager_->heldPageCount()));
+    size_t now = std::count_if(live.begin(), live.end(),
+                               [limit](uint32_t id) { return id > limit; });
+    if (now == 0 || now >= above)
+      break;
+    above = now;
+
+    TxnScope txn(*this);
+    rootPage_ = relocateAbove(rootPage_, height, limit);
+    txn.commit();
+  }
+
+  // each rewrite of the freelist can free the pages of the one before
+  while (pager_->shrinkFile() > 0) {
+  }
+  return before - std::min(before, pager_->nextPageId());
+}
+
+void BTree::collectPages(uint32_t pagePtr, uint32_t height,
+                         std::vector<uint32_t> &out) const {
+  out.push_back(pagePtr);
+  if (height <= 1)
+    return;
+  BNode node(pager_->readPage(pagePtr));
+  for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+    collectPages(node.getPtr(i), height - 1, out);
+}
+
+uint32_t BTree::relocateAbove(uint32_t pagePtr, uint32_t height,
+                              uint32_t limit) {
+  if (height <= 1 && pagePtr <= limit)
+    return pagePtr;
+
+  BNode node(pager_->readPage(pagePtr));
+  bool changed = false;
+  if (height > 1) {
+    for (uint16_t i = 0; i < node.getNumOfKeys(); i++) {
+      uint32_t child = node.getPtr(i);
+      uint32_t moved = relocateAbove(child, height - 1, limit);
+      if (moved != child) {
+        node.setPtr(i, moved);
+        changed = true;
+      }
+    }
+  }
+  if (!changed && pagePtr <= limit)
+    return pagePtr;
+
+  // no locality hint: compaction wants the lowest free page
+  pager_->deletePage(pagePtr);
+  return pager_->createPage(node.release());
+}
+
+void BTree::copyTo(const std::string &path) const {
+  Pager dst(path);
+  if (dst.rootPage() != 0)
+    throw std::invalid_argument("copyTo: destination already has a tree");
+
+  // page ids level by level, top down, each level in key order; internal
+  // nodes are kept since they're rewritten with the new child ids
+  std::vector<std::vector<uint32_t>> levels = {{rootPage_}};
+  std::unordered_map<uint32_t, BNode> internal;
+  for (;;) {
+    std::vector<uint32_t> below;
+    for (uint32_t id : levels.back()) {
+      BNode node(pager_->readPage(id));
+      if (node.getType() != BNODE_INTERNAL)
+        break;
+      for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+        below.push_back(node.getPtr(i));
+      internal.emplace(id, std::move(node));
+    }
+    if (below.empty())
+      break;
+    levels.push_back(std::move(below));
+  }
+
+  // a fresh file hands out ids in order, so writing bottom up lays the
+  // leaves out sequentially; commit every so often to bound memory
+  const size_t batch = 1024;
+  size_t pending = 0;
+  std::unordered_map<uint32_t, uint32_t> newId;
+  dst.beginTxn();
+  for (auto level = levels.rbegin(); level != levels.rend(); ++level) {
+    for (uint32_t id : *level) {
+      auto it = internal.find(id);
+      if (it == internal.end()) {
+        newId[id] = dst.createPage(pager_->readPage(id));
+      } else {
+        BNode &node = it->second;
+        for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+          node.setPtr(i, newId.at(node.getPtr(i)));
+        newId[id] = dst.createPage(node.release());
+      }
+      if (++pending == batch) {
+        dst.commitTxn();
+        dst.beginTxn();
+        pending = 0;
+      }
+    }
+  }
+
+  dst.setKeyOrder(keyOrder_);
+  dst.setRootPage(newId.at(rootPage_));
+  dst.commitTxn();
+}
+
+void BTree::snapshotTo(const std::string &path, bool compact) const {
+  int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+  if (fd == -1)
+    throw std::runtime_error("snapshotTo: cannot create " + path);
+  try {
+    snapshotTo(fd, compact);
+  } catch (...) {
+    ::close(fd);
+    ::unlink(path.c_str());
+    throw;
+  }
+  ::close(fd);
+}
+
+void BTree::snapshotTo(int fd, bool compact) const {
+  if (publish_)
+    throw std::invalid_argument("snapshotTo: not available for named trees");
+  Pager::Snapshot snap = pager_->pinSnapshot();
+  try {
+    if (snap.rootPage == 0)
+      throw std::runtime_error("snapshotTo: no committed tree yet");
+
+    // every reachable page, found level by level; the leaves are only read
+    // when they are copied. Internal nodes are kept for relinking.
+    std::vector<uint32_t> pages;
+    std::unordered_map<uint32_t, BNode> internal;
+    std::vector<uint32_t> level = {snap.rootPage};
+    while (!level.empty()) {
+      pages.insert(pages.end(), level.begin(), level.end());
+      std::vector<uint32_t> below;
+      for (uint32_t id : level) {
+        BNode node(pager_->readCommittedPage(id));
+        if (node.getType() != BNODE_INTERNAL)
+          break;
+        for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+          below.push_back(node.getPtr(i));
+        if (compact)
+          internal.emplace(id, std::move(node));
+      }
+      level = std::move(below);
+    }
+    std::sort(pages.begin(), pages.end());
+
+    auto newId = [&pages](uint32_t id) {
+      auto it = std::lower_bound(pages.begin(), pages.end(), id);
+      return static_cast<uint32_t>(it - pages.begin()) + 1;
+    };
+    pager_->exportSnapshot(
+        fd, snap, pages, compact, [&](uint32_t id, uint8_t *page) {
+          auto it = internal.find(id);
+          if (it == internal.end())
+            return;
+          BNode &node = it->second;
+          for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+            node.setPtr(i, newId(node.getPtr(i)));
+          memcpy(page, node.data().data(), BTREE_PAGE_SIZE);
+        });
+  } catch (...) {
+    pager_->unpinSnapshot();
+    throw;
+  }
+  pager_->unpinSnapshot();
+}
+
+uint32_t BTree::treeHeight() const {
+  uint32_t height = 1;
+  BNode node(pager_->readPage(rootPage_));
+  while (node.getType() == BNODE_INTERNAL && node.getNumOfKeys() > 0) {
+    node = BNode(pager_->readPage(node.getPtr(0)));
+    height++;
+  }
+  return height;
+}
+
+void BTree::freeSubtree(uint32_t pagePtr, uint32_t height) {
+  if (height > 1) {
+    BNode node(pager_->readPage(pagePtr));
+    // the leaves below are freed unread, so only internal levels are hinted
+    if (height > 2 && options_.prefetchWindow > 0)
+      prefetchChildren(node, 0, node.getNumOfKeys());
+    for (uint16_t i = 0; i < node.getNumOfKeys(); i++)
+      freeSubtree(node.getPtr(i), height - 1);
+  }
+  pager_->deletePage(pagePtr);
+}
+
+std::optional<BNode> BTree::rangeDelete(const BNode &node, uint32_t height,
+                                        const std::vector<uint8_t> &begin,
+                                        const std::vector<uint8_t> &end,
+                                        const std::vector<uint8_t> *hi) {
+  uint16_t n = node.getNumOfKeys();
+
+  if (node.getType() == BNODE_LEAF) {
+    uint16_t from = lookup(node, begin);
+    uint16_t to = lookup(node, end);
+    if (to <= from)
+      return std::nullopt;
+
+    BNode newNode(node.data().size());
+    newNode.setHeader(BNODE_LEAF, n - (to - from), node.getFormat());
+    newNode.copyRange(node, 0, 0, from);
+    newNode.copyRange(node, from, to, n - to);
+    return newNode;
+  }
+
+  if (node.getType() != BNODE_INTERNAL) {
+    assert(false && "bad node");
+    throw std::runtime_error("bad node");
   }
+
+  // Children before `first` and after `last` are out of range. Each child's
+  // key is the smallest key below it, so the children in between are covered
+  // whole, and only the two boundary children can be partially covered.
+  uint16_t first = lookup(node, begin);
+  uint16_t last = lookup(node, end);
+
+  struct Child {
+    uint32_t ptr; // 0 once rewritten; the page is created at the end
+    std::vector<uint8_t> key;
+    std::optional<BNode> node;
+    uint64_t count; // keys below, kept for counted nodes only
+  };
+  std::vector<Child> children;
+  bool changed = false;
+  const bool counted = node.hasCounts();
+
+  for (uint16_t i = 0; i < n; i++) {
+    uint32_t ptr = node.getPtr(i);
+    uint64_t count = counted ? node.getCount(i) : 0;
+    if (i < first || i > last) {
+      children.push_back({ptr, node.getKey(i), std::nullopt, count});
+      continue;
+    }
+
+    std::vector<uint8_t> key = node.getKey(i);
+    std::vector<uint8_t> nextKey;
+    const std::vector<uint8_t> *childHi = hi;
+    if (i + 1 < n) {
+      nextKey = node.getKey(i + 1);
+      childHi = &nextKey;
+    }
+
+    if (compareKeys(key, end) >= 0 ||
+        (childHi && compareKeys(*childHi, begin) <= 0)) {
+      children.push_back({ptr, std::move(key), std::nullopt, count});
+      continue;
+    }
+
+    if (compareKeys(key, begin) >= 0 && childHi &&
+        compareKeys(*childHi, end) <= 0) {
+      freeSubtree(ptr, height - 1);
+      changed = true;
+      continue;
+    }
+
+    BNode child(pager_->readPage(ptr));
+    auto updated = rangeDelete(child, height - 1, begin, end, childHi);
+    if (!updated.has_value()) {
+      children.push_back({ptr, std::move(key), std::nullopt, count});
+      continue;
+    }
+
+    changed = true;
+    pager_->deletePage(ptr);
+    if (updated->getNumOfKeys() == 0)
+      continue;
+    for (BNode &part : std::move(*updated).splitToFitPage()) {
+      uint64_t partCount = counted ? part.subtreeCount() : 0;
+      children.push_back({0, part.getKey(0), std::move(part), partCount});
+    }
+  }
+
+  if (!changed)
+    return std::nullopt;
+
+  // Only the rewritten boundary children can have shrunk, so they are the
+  // only ones checked for a merge with their right (or, last, left) sibling.
+  for (size_t i = 0; i < children.size() && children.size() > 1; i++) {
+    if (children[i].ptr != 0 ||
+        children[i].node->size() > options_.mergeThreshold)
+      continue;
+
+    size_t l = i + 1 < children.size() ? i : i - 1;
+    for (size_t j = l; j <= l + 1; j++) {
+      if (!children[j].node.has_value())
+        children[j].node = BNode(pager_->readPage(children[j].ptr));
+    }
+
+    BNode &left = *children[l].node;
+    BNode &right = *children[l + 1].node;
+    if (left.size() + right.size() - PAGE_HEADER_SIZE > BTREE_PAGE_USABLE_SIZE)
+      continue;
+
+    BNode merged = BNode::merge(left, right);
+    for (size_t j = l; j <= l + 1; j++) {
+      if (children[j].ptr != 0)
+        pager_->deletePage(children[j].ptr);
+    }
+    uint64_t mergedCount = children[l].count + children[l + 1].count;
+    children[l] = {0, merged.getKey(0), std::move(merged), mergedCount};
+    children.erase(children.begin() + l + 1);
+  }
+
+  BNode newNode(2 * BTREE_PAGE_SIZE);
+  newNode.setHeader(BNODE_INTERNAL, children.size(), node.getFormat());
+  uint32_t near = node.getPtr(0);
+  for (size_t i = 0; i < children.size(); i++) {
+    Child &c = children[i];
+    if (c.ptr == 0)
+      c.ptr = pager_->createPage(c.node->release(), near);
+    near = c.ptr;
+    newNode.setPtrAndKeyValue(i, c.ptr, c.key, std::vector<uint8_t>());
+    if (counted)
+      newNode.setCount(i, static_cast<uint32_t>(c.count));
+  }
+  return newNode;
 }
@@ -1,61 +1,119 @@
 #pragma once
 
+#include <atomic>
 #include <cstdint>
 #include <cstring>
+#include <functional>
 #include <iostream>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <optional>
+#include <string>
 #include <utility>
 #include <vector>
 
+#include "bloom.h"
 #include "common.h"
 #include "endianness.h"
+#include "page_pool.h"
 #include "pager.h"
+#include "value_cache.h"
 
 // BNode represents a B-tree node stored as a contiguous byte array.
 // Each node can be an internal node or a leaf node.
-// Node layout: [header][pointers][offsets][key-values]
+// Node layout: [header][pointers][counts][offsets][dense keys][key-values]
 
 // HEADER (3 bytes total):
-// - 1 bytes: node type (BNODE_INTERANL=1, BNODE_LEAF=2)
+// - 1 bytes: node type (BNODE_INTERANL=1, BNODE_LEAF=2) in the low bits,
+//   node format (BNODE_FORMAT_*) in the high bits
 // - 2 bytes: number of keys
 
 // POINTERS (4 bytes per key, internal nodes only):
 // - Array of 32-bit integers referencing child pages on disk.
-// - Used only for internal nodes; leaf nodes ignore this.
+// - Used only for internal nodes; leaf nodes ignore this, and
+//   BNODE_FORMAT_COMPACT leaves leave it out.
+
+// COUNTS (4 bytes per key, BNODE_FLAG_COUNTED internal nodes only):
+// - Number of keys in the subtree under each child, so a key's rank or the
+//   n-th key can be found on a single root-to-leaf path.
 
 // OFFSETS (2 bytes per key after the first):
 // - Offset from the start of KV section to each KV pair end.
 // - First KV pair offset is implicitly 0 and not stored.
 // - Last offset helps compute node size.
+// - BNODE_FORMAT_SLOTTED widens every offset into an 8-byte slot:
+//   [offset:2B][key size:2B][first 4 key bytes, zero padded]
+//   so binary search mostly compares against this contiguous array and
+//   only reads a key from the KV section when prefixes tie.
+
+// DENSE KEYS (BNODE_FORMAT_INT64 only, 8 bytes per key):
+// - Every key is an 8-byte big-endian integer. Keys live only here, stored
+//   as little-endian int64 with the sign bit flipped so that signed SIMD
+//   compares give byte order; the KV entries keep a key size of 0.
 
 // KEY-VALUES:
 // - Each KV pair: [key size:2B][value size:2B][key][val]
 // - key size/value size are 16-bit integers representing key/value length.
 // - Keys and values are packed consecutively in memory.
+// - BNODE_FORMAT_COMPACT writes the sizes as varints: leaf entries are
+//   [key size][value size][key][val] and internal entries, whose values
+//   are always empty, [key size][key]. Keys and values under 128 bytes
+//   take one byte per size.
 
 // NODE SIZE:
 // - Total node bytes = HEADER + pointers + offsets + KV data.
 // - Max key/value sizes ensure a single KV fits in a page.
+// - A node must fit in BTREE_PAGE_USABLE_SIZE; the last PAGE_TRAILER_SIZE
+//   bytes of the page hold the checksum written by the Pager.
+// - BNODE_FLAG_COMPRESSED leaves may be up to COMPRESSED_LEAF_MAX_SIZE as
+//   long as they compress into BTREE_PAGE_USABLE_SIZE; release() packs them
+//   and constructing a node from a page unpacks them.
 
 class BNode {
 public:
   BNode();
   explicit BNode(size_t size);
-  explicit BNode(const std::vector<uint8_t> &data);
-  explicit BNode(std::vector<uint8_t> &&data);
+  explicit BNode(const PageBuffer &data);
+  explicit BNode(PageBuffer &&data);
+
+  const PageBuffer &data() const;
 
-  const std::vector<uint8_t> &data() const;
+  // hands the buffer over (e.g. to Pager::createPage), leaving the node
+  // empty; a compressed leaf bigger than a page is handed over packed
+  PageBuffer release();
+
+  // true for leaves of a BNODE_FLAG_COMPRESSED tree
+  bool isCompressed() const {
+    return (data_[0] & BNODE_FLAG_COMPRESSED) && getType() == BNODE_LEAF;
+  }
+  // whether the node can be stored in one page, compressing it if need be
+  bool fitsPage() const;
+  // a stored page holding a packed leaf, and the bytes it takes
+  static bool isPacked(const PageBuffer &page);
+  static size_t packedSize(const PageBuffer &page);
 
   void hexDump() const;
 
   uint16_t getType() const;
   uint16_t getNumOfKeys() const;
-  void setHeader(uint8_t type, uint16_t numOfKeys);
+  uint8_t getFormat() const;
+  void setHeader(uint8_t type, uint16_t numOfKeys,
+                 uint8_t format = BNODE_FORMAT_CLASSIC);
 
   uint32_t getPtr(uint16_t index) const;
   void setPtr(uint16_t index, uint32_t value);
 
+  // true for internal nodes of a BNODE_FLAG_COUNTED tree
+  bool hasCounts() const {
+    return (data_[0] & BNODE_FLAG_COUNTED) && getType() == BNODE_INTERNAL;
+  }
+  uint32_t getCount(uint16_t index) const;
+  void setCount(uint16_t index, uint32_t value);
+  // keys under this node: a leaf's own, or the sum of a counted node's
+  // counts
+  uint64_t subtreeCount() const;
+
   uint16_t getOffset(uint16_t index) const;
   void setOffset(uint16_t index, uint16_t value);
 
@@ -66,6 +124,12 @@ public:
   std::vector<uint8_t> getKey(uint16_t index) const;
   std::vector<uint8_t> getValue(uint16_t index) const;
 
+  // false if the node's format can't store key (int64 nodes need 8 bytes)
+  bool acceptsKey(const std::vector<uint8_t> &key) const;
+
+  // compares the key stored at index with key, without copying it out
+  int compareKeyAt(uint16_t index, const std::vector<uint8_t> &key) const;
+
   void setPtrAndKeyValue(uint16_t index, uint32_t ptr,
                          const std::vector<uint8_t> &key,
                          const std::vector<uint8_t> &value);
@@ -73,6 +137,10 @@ public:
   void copyRange(const BNode &srcNode, uint16_t dstStartIndex,
                  uint16_t srcStartIndex, uint16_t n);
 
+  // position of key under bytewise order, or under Order (one of the
+  // comparators in common.h)
+  uint16_t indexLookup(const std::vector<uint8_t> &key) const;
+  template <typename Order>
   uint16_t indexLookup(const std::vector<uint8_t> &key) const;
 
   BNode leafInsert(uint16_t index, const std::vector<uint8_t> &key,
@@ -83,7 +151,9 @@ public:
 
   std::pair<BNode, BNode> splitHalf() const;
 
-  std::vector<BNode> splitToFitPage() const;
+  std::vector<BNode> splitToFitPage() const &;
+  // same, but reuses this node's buffer when it already fits
+  std::vector<BNode> splitToFitPage() &&;
 
   BNode updateLinks(uint16_t index, const std::vector<BNode> &nodes) const;
 
@@ -91,42 +161,321 @@ public:
 
   static BNode merge(const BNode &left, const BNode &right);
 
-  BNode updateLink(uint16_t index, BNode &node) const;
-
   BNode updateMergedLink(uint16_t index, BNode &node) const;
 
 private:
-  std::vector<uint8_t> data_;
+  template <typename Order>
+  int compareKeyAt(uint16_t index, const std::vector<uint8_t> &key,
+                   uint32_t prefix) const;
+
+  // bytes per entry in the offsets array: a bare offset or a full slot
+  size_t slotStride() const {
+    return (data_[0] & BNODE_LAYOUT_MASK) == BNODE_FORMAT_SLOTTED
+               ? SLOT_SIZE
+               : OFFSET_SIZE;
+  }
+
+  bool isInt64() const {
+    return (data_[0] & BNODE_LAYOUT_MASK) == BNODE_FORMAT_INT64;
+  }
+
+  bool isCompact() const {
+    return (data_[0] & BNODE_LAYOUT_MASK) == BNODE_FORMAT_COMPACT;
+  }
+
+  // bytes per entry in the pointer array
+  size_t ptrStride() const {
+    const uint8_t mask = BNODE_LAYOUT_MASK | BNODE_TYPE_MASK;
+    return (data_[0] & mask) == (BNODE_FORMAT_COMPACT | BNODE_LEAF) ? 0
+                                                                   : PTR_SIZE;
+  }
+
+  // where the key and value of an entry lie, and where the entry ends
+  struct EntryView {
+    const uint8_t *key;
+    size_t keySize;
+    const uint8_t *value;
+    size_t valueSize;
+    const uint8_t *end() const { return value + valueSize; }
+  };
+  EntryView entryAt(uint16_t index) const;
+  // bytes of the header in front of a key and value in this node's layout
+  size_t entryHeaderSize(size_t keySize, size_t valueSize) const;
+
+  // an 8-byte big-endian key as it is kept in the dense array
+  static int64_t encodeInt64Key(const uint8_t *key) {
+    return static_cast<int64_t>(BigEndian::load_u64(key) ^ (1ull << 63));
+  }
+  int64_t denseKeyAt(uint16_t index) const {
+    return static_cast<int64_t>(
+        LittleEndian::load_u64(denseKeysPtr() + INT64_KEY_SIZE * index));
+  }
+  uint64_t decodeInt64Key(uint16_t index) const {
+    return static_cast<uint64_t>(denseKeyAt(index)) ^ (1ull << 63);
+  }
+
+  // bytes taken by the KV entry at index, header included
+  uint16_t entrySize(uint16_t index) const;
+
+  // buffer size for a node built from this one before it is split
+  size_t workSize() const {
+    return isCompressed() ? COMPRESSED_LEAF_MAX_SIZE + BTREE_PAGE_SIZE
+                          : 2 * BTREE_PAGE_SIZE;
+  }
+  // compresses the node into dst; the data size, or 0 if it doesn't fit
+  size_t packInto(uint8_t *dst, size_t capacity) const;
+  PageBuffer pack() const;
+  static PageBuffer unpack(const PageBuffer &page);
+
+  size_t countStride() const { return hasCounts() ? COUNT_SIZE : 0; }
+
+  // byte positions of the counts and offsets arrays and of the KV section
+  size_t countsPos() const {
+    return PAGE_HEADER_SIZE + ptrStride() * getNumOfKeys();
+  }
+  size_t offsetsPos() const {
+    return PAGE_HEADER_SIZE + (ptrStride() + countStride()) * getNumOfKeys();
+  }
+  size_t denseKeysPos() const {
+    return PAGE_HEADER_SIZE +
+           (ptrStride() + countStride() + slotStride()) * getNumOfKeys();
+  }
+  const uint8_t *denseKeysPtr() const { return data_.data() + denseKeysPos(); }
+  uint8_t *denseKeysPtr() { return data_.data() + denseKeysPos(); }
+  size_t kvPos() const {
+    return denseKeysPos() + (isInt64() ? INT64_KEY_SIZE : 0) * getNumOfKeys();
+  }
+
+  PageBuffer data_;
 };
 
+struct BTreeOptions {
+  // node format used when the tree is created, optionally with
+  // BNODE_FLAG_COUNTED and BNODE_FLAG_COMPRESSED; an existing tree keeps
+  // the format its nodes were written with
+  uint8_t format = BNODE_FORMAT_CLASSIC;
+  // KEY_ORDER_* recorded in Meta when the tree is created; an existing tree
+  // keeps its recorded order
+  uint8_t keyOrder = KEY_ORDER_BYTEWISE;
+  // a node that shrinks to this many bytes or fewer on delete is merged with
+  // a sibling; larger nodes never cost a sibling read
+  uint16_t mergeThreshold = BTREE_PAGE_SIZE / 4;
+  // child pages hinted to the kernel ahead of a scan or subtree walk;
+  // 0 turns prefetching off
+  uint16_t prefetchWindow = 16;
+  // Bits per key of an in-memory Bloom filter over the tree's keys, built
+  // by a scan when the tree is opened; search and multiSearch skip the
+  // descent for keys it rules out. 10 bits give about 1% false positives;
+  // 0 turns the filter off.
+  uint16_t filterBitsPerKey = 0;
+  // Bytes of an in-memory key -> value cache in front of search and
+  // multiSearch (see ValueCache). It only ever holds committed values:
+  // lookups inside an open transaction go to the tree, and each write drops
+  // the keys it touches. 0 turns the cache off.
+  size_t valueCacheBytes = 0;
+};
+
+class Database;
+
 class BTree {
 public:
-  explicit BTree(std::shared_ptr<Pager> p);
+  // The tree whose root is in the pager's Meta, created if there is none.
+  // Files holding named trees (see Database) are refused.
+  explicit BTree(std::shared_ptr<Pager> p, BTreeOptions options = {});
   ~BTree();
 
+  BTree(const BTree &) = delete;
+  BTree &operator=(const BTree &) = delete;
+
   uint32_t rootPage() const;
+  uint8_t keyOrder() const;
 
   uint32_t insert(const std::vector<uint8_t> &key,
                   const std::vector<uint8_t> &val);
 
+  // Gets the key's current value, or null when the key is absent, and
+  // returns the value to store, or nullopt to leave the key as it is.
+  using UpdateFn = std::function<std::optional<std::vector<uint8_t>>(
+      const std::vector<uint8_t> *current)>;
+  // Combines a key's current value (null: absent) with an operand.
+  using MergeFn =
+      std::function<std::vector<uint8_t>(const std::vector<uint8_t> *current,
+                                         const std::vector<uint8_t> &operand)>;
+
+  // Read-modify-write in a single descent: fn runs at the leaf, and the
+  // path is only rewritten, in one transaction, when it returns a value
+  // other than the current one. Returns whether the tree changed. fn must
+  // not use the tree.
+  bool update(const std::vector<uint8_t> &key, const UpdateFn &fn);
+  // stores value if the key is absent; false if it was present
+  bool putIfAbsent(const std::vector<uint8_t> &key,
+                   const std::vector<uint8_t> &value);
+  // stores desired if the key's value is expected; false otherwise,
+  // including when the key is absent
+  bool compareAndSwap(const std::vector<uint8_t> &key,
+                      const std::vector<uint8_t> &expected,
+                      const std::vector<uint8_t> &desired);
+
+  // Merge operators by name, for this tree object; they aren't stored in
+  // the file. Built in:
+  // - "add64": adds 8-byte little-endian int64s, an absent key being 0
+  // - "append": appends the operand's bytes
+  void registerMergeOperator(const std::string &name, MergeFn fn);
+  // applies the named operator to key in a single descent, as update;
+  // unknown names throw std::invalid_argument
+  bool merge(const std::string &name, const std::vector<uint8_t> &key,
+             const std::vector<uint8_t> &operand);
+
   std::optional<std::vector<uint8_t>>
   search(const std::vector<uint8_t> &key) const;
 
+  // Looks up many keys at once, one tree level at a time, with the reads of
+  // each level issued together through Pager::readPageAsync.
+  std::vector<std::optional<std::vector<uint8_t>>>
+  multiSearch(const std::vector<std::vector<uint8_t>> &keys) const;
+
   bool remove(const std::vector<uint8_t> &key);
 
-private:
-  BNode internalNodeInsert(const BNode &parent, uint16_t index,
-                           const std::vector<uint8_t> &key,
-                           const std::vector<uint8_t> &value);
+  // Removes every key in [begin, end) under the tree's key order, in one
+  // transaction. Subtrees lying entirely inside the range are freed without
+  // reading their leaves. Returns false when the range held no keys.
+  bool removeRange(const std::vector<uint8_t> &begin,
+                   const std::vector<uint8_t> &end);
+
+  // Online vacuum: moves live pages from the end of the file into free pages
+  // nearer the start, copy-on-write in ordinary transactions, then has the
+  // pager rewrite its freelist and cut the freed tail off the file
+  // (Pager::shrinkFile). Returns how many pages the file shrank by. Not
+  // available for named trees, which share the file with the others.
+  uint32_t compact();
+
+  // Offline compaction: writes a copy of the tree to a new file at path with
+  // the leaves first, in key order, then each internal level, so a scan of
+  // the copy reads the file front to back. The destination must not already
+  // hold a tree.
+  void copyTo(const std::string &path) const;
+
+  // Hot backup: writes the tree as of the last commit to a new database
+  // file that Pager opens as is. Only pages reachable from that commit's
+  // root are read, and they are pinned (Pager::pinSnapshot), so this may
+  // run on another thread while the tree takes writes. Pages go out in
+  // page order in large sequential writes; `compact` renumbers them densely
+  // instead of keeping their ids. The path must not exist yet. Not
+  // available for named trees, whose root isn't the one in Meta.
+  void snapshotTo(const std::string &path, bool compact = false) const;
+  void snapshotTo(int fd, bool compact = false) const;
+
+  // Order statistics under the tree's key order. With BNODE_FLAG_COUNTED
+  // each costs one root-to-leaf path of page reads; other trees have the
+  // subtrees to the left of that path walked to count their keys.
+  //
+  // keys in [lo, hi); an empty lo or hi leaves that side unbounded
+  uint64_t count(const std::vector<uint8_t> &lo,
+                 const std::vector<uint8_t> &hi) const;
+  // number of keys ordered before key
+  uint64_t rank(const std::vector<uint8_t> &key) const;
+  // the n-th entry (from 0) in key order, or nullopt past the end
+  std::optional<std::pair<std::vector<uint8_t>, std::vector<uint8_t>>>
+  at(uint64_t n) const;
+
+  struct FilterStats {
+    size_t memoryBytes = 0; // 0 when the tree has no filter
+    uint64_t keys = 0;      // added since the filter was built
+    uint64_t removed = 0;   // removed since, still set in the filter
+    uint64_t ruledOut = 0;  // lookups answered without a descent
+    uint64_t falsePositives = 0; // lookups let through for absent keys
+    // as predicted from the filter's size and keys
+    double expectedFalsePositiveRate = 0;
+
+    // as seen: of the lookups for absent keys, the share let through
+    double falsePositiveRate() const {
+      uint64_t absent = ruledOut + falsePositives;
+      return absent ? static_cast<double>(falsePositives) / absent : 0.0;
+    }
+  };
+  FilterStats filterStats() const;
+
+  // all zero when the tree has no value cache
+  ValueCache::Stats valueCacheStats() const;
+
+  using ScanFn = std::function<bool(const std::vector<uint8_t> &key,
+                                    const std::vector<uint8_t> &value)>;
+
+  // Calls fn for each key in [begin, end) in the tree's key order until fn
+  // returns false. An empty begin or end leaves that side unbounded.
+  void scan(const std::vector<uint8_t> &begin,
+            const std::vector<uint8_t> &end, const ScanFn &fn) const;
 
-  BNode recursiveInsert(const BNode &node, const std::vector<uint8_t> &key,
-                        const std::vector<uint8_t> &value);
+private:
+  friend class Database;
+  friend class ShardedStore;
+
+  // called with the new root at the end of each write
+  using RootFn = std::function<void(uint32_t root)>;
+
+  // A tree whose root is kept by its owner (a Database): `root` is the
+  // current root, 0 to create an empty tree, and every change to it is
+  // handed to publish within the operation's transaction.
+  BTree(std::shared_ptr<Pager> p, BTreeOptions options, uint32_t root,
+        uint8_t keyOrder, RootFn publish);
+
+  class TxnScope;
+
+  // records rootPage_ where the tree's root is kept
+  void publishRoot();
+  // Aborts the pager's transaction and goes back to the root in Meta, for
+  // an owner that ran several operations in one transaction of its own.
+  void abortBatch();
+
+  // Builds the filter afresh from the tree's keys and swaps it in. Keys
+  // only ever get added to a filter, so it stays correct through removes
+  // and aborts; it is due for a rebuild once it holds more keys than it was
+  // sized for, or once half of those are removed ones. Keys dropped by
+  // removeRange stay set until the next rebuild.
+  void rebuildFilter();
+  // Rebuilds a due filter unless a transaction is open: one built inside
+  // it could miss keys an abort brings back. A write that commits the
+  // outermost level, or the owner's commitTxn, catches up. True if it
+  // rebuilt.
+  bool rebuildFilterIfDue();
+  void filterAdd(const std::vector<uint8_t> &key);
+  void filterRemoved();
+  // false if the filter rules the key out
+  bool filterPasses(const std::vector<uint8_t> &key) const;
+
+  // the value cache, when there is one and no transaction is open
+  ValueCache *readCache() const;
+
+  // indexLookup under the tree's key order
+  uint16_t lookup(const BNode &node, const std::vector<uint8_t> &key) const;
+  // key comparison under the tree's key order
+  int compareKeys(const std::vector<uint8_t> &a,
+                  const std::vector<uint8_t> &b) const;
+  // throws unless the tree's key order can store key: KEY_ORDER_U64 only
+  // orders 8-byte keys consistently
+  void checkKey(const std::vector<uint8_t> &key, const char *op) const;
+
+  // writes a new root, splitting it and adding a level when it overflows
+  void installRoot(BNode &&root);
+
+  // Both return the node with fn's value stored under key, or nullopt
+  // when fn leaves the value as it is, in which case nothing was written.
+  std::optional<BNode> internalNodeInsert(const BNode &parent,
+                                          uint16_t index,
+                                          const std::vector<uint8_t> &key,
+                                          const UpdateFn &fn);
+  std::optional<BNode> recursiveInsert(const BNode &node,
+                                       const std::vector<uint8_t> &key,
+                                       const UpdateFn &fn);
+
+  static std::map<std::string, MergeFn> builtinMergeOperators();
 
   std::optional<std::vector<uint8_t>>
   searchRecursive(uint32_t pagePtr, const std::vector<uint8_t> &key) const;
 
   std::pair<int, std::optional<BNode>>
-  selectSiblingForMerge(BNode parent, uint16_t childIndex, BNode child) const;
+  selectSiblingForMerge(const BNode &parent, uint16_t childIndex,
+                        const BNode &child) const;
 
   std::optional<BNode>
   internalNodeDelete(const BNode &parent, uint16_t index,
@@ -135,6 +484,55 @@ private:
   std::optional<BNode> recursiveDelete(const BNode &node,
                                        const std::vector<uint8_t> &key) const;
 
+  // false once the scan is over (end reached or fn said stop)
+  bool scanNode(uint32_t pagePtr, const std::vector<uint8_t> &begin,
+                const std::vector<uint8_t> &end, const ScanFn &fn) const;
+  // prefetches the pages of node's children [from, to)
+  void prefetchChildren(const BNode &node, uint16_t from, uint16_t to) const;
+
+  // keys under child i of internal node `node`
+  uint64_t childCount(const BNode &node, uint16_t i) const;
+  uint64_t subtreeKeys(uint32_t pagePtr) const;
+
+  // levels from the root down to the leaves, 1 for a lone root leaf
+  uint32_t treeHeight() const;
+  // ids of every page in the subtree at pagePtr; leaves aren't read
+  void collectPages(uint32_t pagePtr, uint32_t height,
+                    std::vector<uint32_t> &out) const;
+  // copies every page above `limit` in the subtree, and the path down to
+  // it, to new pages; returns the subtree's (possibly new) page
+  uint32_t relocateAbove(uint32_t pagePtr, uint32_t height, uint32_t limit);
+  // frees the subtree at pagePtr; leaves (height 1) are never read
+  void freeSubtree(uint32_t pagePtr, uint32_t height);
+  // node with the keys in [begin, end) removed, or nullopt when none were
+  // present. `hi` bounds the keys under node from above (null: unbounded).
+  // The result may be empty or larger than a page.
+  std::optional<BNode> rangeDelete(const BNode &node, uint32_t height,
+                                   const std::vector<uint8_t> &begin,
+                                   const std::vector<uint8_t> &end,
+                                   const std::vector<uint8_t> *hi);
+
   std::shared_ptr<Pager> pager_;
+  BTreeOptions options_;
   uint32_t rootPage_;
+
+  uint8_t keyOrder_;
+  RootFn publish_; // null: the root lives in Meta
+
+  // null when the tree has no filter, or before its first build. Lookups
+  // on other threads test it while the writer adds to it or swaps in a
+  // rebuilt one, so filterMu_ guards it and its counts.
+  std::unique_ptr<BloomFilter> filter_;
+  mutable std::mutex filterMu_;
+  uint64_t filterCapacity_ = 0;
+  uint64_t filterKeys_ = 0;
+  uint64_t filterRemoved_ = 0;
+  bool filterDue_ = false; // only touched by the writer
+  mutable std::atomic<uint64_t> filterRuledOut_{0};
+  mutable std::atomic<uint64_t> filterFalsePositives_{0};
+
+  // null when the tree has no value cache
+  std::unique_ptr<ValueCache> valueCache_;
+
+  std::map<std::string, MergeFn> mergeOperators_ = builtinMergeOperators();
 };
@@ -0,0 +1,66 @@
+#include "checksum.h"
+
+#include <array>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define DBITE_HAVE_SSE42_CRC 1
+#endif
+
+namespace {
+
+constexpr uint32_t CRC32C_POLY = 0x82F63B78; // reflected Castagnoli
+
+std::array<uint32_t, 256> makeTable() {
+  std::array<uint32_t, 256> table{};
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int j = 0; j < 8; j++)
+      crc = (crc >> 1) ^ ((crc & 1) ? CRC32C_POLY : 0);
+    table[i] = crc;
+  }
+  return table;
+}
+
+uint32_t crc32cSoftware(const uint8_t *data, size_t len) {
+  static const std::array<uint32_t, 256> table = makeTable();
+  uint32_t crc = ~0u;
+  for (size_t i = 0; i < len; i++)
+    crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+#ifdef DBITE_HAVE_SSE42_CRC
+__attribute__((target("sse4.2"))) uint32_t crc32cHardware(const uint8_t *data,
+                                                          size_t len) {
+  uint64_t crc = ~0u;
+  size_t i = 0;
+  for (; i + 8 <= len; i += 8) {
+    uint64_t word;
+    memcpy(&word, data + i, sizeof(word));
+    crc = _mm_crc32_u64(crc, word);
+  }
+  uint32_t crc32 = static_cast<uint32_t>(crc);
+  for (; i < len; i++)
+    crc32 = _mm_crc32_u8(crc32, data[i]);
+  return ~crc32;
+}
+#endif
+
+using Crc32cFn = uint32_t (*)(const uint8_t *, size_t);
+
+Crc32cFn selectCrc32c() {
+#ifdef DBITE_HAVE_SSE42_CRC
+  if (__builtin_cpu_supports("sse4.2"))
+    return crc32cHardware;
+#endif
+  return crc32cSoftware;
+}
+
+} // namespace
+
+uint32_t crc32c(const uint8_t *data, size_t len) {
+  static const Crc32cFn impl = selectCrc32c();
+  return impl(data, len);
+}
@@ -0,0 +1,8 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli) over a byte range. Uses the SSE4.2 crc32 instruction
+// when the CPU has it and falls back to a table-driven version otherwise.
+uint32_t crc32c(const uint8_t *data, size_t len);
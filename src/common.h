@@ -9,14 +9,36 @@
 static constexpr uint8_t BNODE_INTERNAL = 1;
 static constexpr uint8_t BNODE_LEAF = 2;
 
+// The node type byte keeps the type in its low bits; the high bits are the
+// node format, which tells how the rest of the page is laid out.
+static constexpr uint8_t BNODE_TYPE_MASK = 0x0F;
+static constexpr uint8_t BNODE_LAYOUT_MASK = 0x30;
+static constexpr uint8_t BNODE_FORMAT_CLASSIC = 0x00;
+static constexpr uint8_t BNODE_FORMAT_SLOTTED = 0x10;
+static constexpr uint8_t BNODE_FORMAT_INT64 = 0x20;
+static constexpr uint8_t BNODE_FORMAT_COMPACT = 0x30;
+// a flag that goes with any layout: internal nodes also keep the number of
+// keys under each child, for order-statistic queries
+static constexpr uint8_t BNODE_FLAG_COUNTED = 0x40;
+// another: leaves may grow past a page and are stored LZ-compressed
+static constexpr uint8_t BNODE_FLAG_COMPRESSED = 0x80;
+
 static constexpr size_t BTREE_PAGE_SIZE = 4 * 1024;
 
+// Every page on disk ends with a CRC32C of the bytes before it, so nodes
+// only get to use the space in front of the trailer.
+static constexpr size_t PAGE_TRAILER_SIZE = 4;
+static constexpr size_t BTREE_PAGE_USABLE_SIZE =
+    BTREE_PAGE_SIZE - PAGE_TRAILER_SIZE;
+
 static constexpr size_t NODE_TYPE_SIZE = 1;
 static constexpr size_t HEADER_KEY_COUNT_SIZE = 2;
 static constexpr size_t PAGE_HEADER_SIZE =
     NODE_TYPE_SIZE + HEADER_KEY_COUNT_SIZE;
 
 static constexpr size_t PTR_SIZE = 4;
+// subtree key count per child in BNODE_FLAG_COUNTED internal nodes
+static constexpr size_t COUNT_SIZE = 4;
 static constexpr size_t OFFSET_SIZE = 2;
 
 static constexpr size_t KEY_SIZE_FIELD_SIZE = 2;
@@ -24,25 +46,171 @@ static constexpr size_t VALUE_SIZE_FIELD_SIZE = 2;
 static constexpr size_t ENTRY_HEADER_SIZE =
     KEY_SIZE_FIELD_SIZE + VALUE_SIZE_FIELD_SIZE;
 
-static constexpr size_t MAX_ENTRY_SIZE = BTREE_PAGE_SIZE - PAGE_HEADER_SIZE -
-                                         PTR_SIZE - OFFSET_SIZE -
-                                         ENTRY_HEADER_SIZE - 10;
+// slotted nodes widen each offset into [offset:2B][key size:2B][key prefix:4B]
+static constexpr size_t KEY_PREFIX_SIZE = 4;
+static constexpr size_t SLOT_SIZE =
+    OFFSET_SIZE + KEY_SIZE_FIELD_SIZE + KEY_PREFIX_SIZE;
+
+// BNODE_FORMAT_INT64 nodes only hold 8-byte keys (big-endian integers)
+static constexpr size_t INT64_KEY_SIZE = 8;
+
+// A BNODE_FLAG_COMPRESSED leaf bigger than a page is stored as
+// [type byte][BNODE_PACKED_MARKER:2B][node size:2B][data size:2B][data],
+// the marker taking the place of the key count. Leaves are cut off at
+// COMPRESSED_LEAF_MAX_SIZE bytes whatever they compress to.
+static constexpr uint16_t BNODE_PACKED_MARKER = 0xFFFF;
+static constexpr size_t PACKED_HEADER_SIZE = 7;
+static constexpr size_t COMPRESSED_LEAF_MAX_SIZE = 4 * BTREE_PAGE_SIZE;
 
-static constexpr uint64_t META_MAGIC =
+static constexpr size_t MAX_ENTRY_SIZE =
+    BTREE_PAGE_USABLE_SIZE - PAGE_HEADER_SIZE - PTR_SIZE - SLOT_SIZE -
+    ENTRY_HEADER_SIZE - 4;
+
+// "DBITE" and a three-digit format version. Version 002 put a checksum
+// trailer on every page and made the freelist two levels; files of any
+// other version are refused rather than misread.
+static constexpr uint64_t META_MAGIC_PREFIX =
     (uint64_t('D') << 56) | (uint64_t('B') << 48) | (uint64_t('I') << 40) |
-    (uint64_t('T') << 32) | (uint64_t('E') << 24) | (uint64_t('0') << 16) |
-    (uint64_t('0') << 8) | (uint64_t('1'));
+    (uint64_t('T') << 32) | (uint64_t('E') << 24);
+static constexpr uint64_t META_MAGIC = META_MAGIC_PREFIX |
+                                       (uint64_t('0') << 16) |
+                                       (uint64_t('0') << 8) | (uint64_t('2'));
 
-inline int keyCompare(const std::vector<uint8_t> &a,
-                      const std::vector<uint8_t> &b) {
-  size_t n = std::min(a.size(), b.size());
-  int cmp = memcmp(a.data(), b.data(), n);
+// first bytes of a pager's hot-page manifest, path + ".hot"
+static constexpr uint64_t HOT_MANIFEST_MAGIC =
+    (uint64_t('D') << 56) | (uint64_t('B') << 48) | (uint64_t('I') << 40) |
+    (uint64_t('T') << 32) | (uint64_t('E') << 24) | (uint64_t('H') << 16) |
+    (uint64_t('O') << 8) | (uint64_t('T'));
+
+// Meta::flags: the root in Meta is a Database catalog of named trees rather
+// than a tree of its own
+static constexpr uint32_t META_FLAG_CATALOG = 1;
+
+// PagerOptions::storage: where a pager keeps its pages
+static constexpr uint8_t STORAGE_DEFAULT = 0; // see Pager::setDefaultStorage
+static constexpr uint8_t STORAGE_FILE = 1;
+static constexpr uint8_t STORAGE_MEMORY = 2;
+
+// Freelist pages are [next page:4B][count:4B][count page ids:4B each].
+// Meta::freelist_head is a chain of directory pages, linked by next, whose
+// ids are leaf pages; a leaf (next 0) lists free page ids.
+static constexpr size_t FREELIST_HEADER_SIZE = 8;
+static constexpr size_t FREELIST_IDS_PER_PAGE =
+    (BTREE_PAGE_USABLE_SIZE - FREELIST_HEADER_SIZE) / sizeof(uint32_t);
+
+// pages per write (and per read, where the source is contiguous) when a
+// snapshot is streamed to another file
+static constexpr size_t SNAPSHOT_BATCH_PAGES = 256;
+
+inline int keyCompare(const uint8_t *a, size_t aSize, const uint8_t *b,
+                      size_t bSize) {
+  size_t n = std::min(aSize, bSize);
+  int cmp = n ? memcmp(a, b, n) : 0;
   if (cmp != 0) {
     return cmp;
-  } else if (a.size() < b.size()) {
+  } else if (aSize < bSize) {
     return -1;
-  } else if (a.size() > b.size()) {
+  } else if (aSize > bSize) {
     return 1;
   }
   return 0;
 }
+
+// First KEY_PREFIX_SIZE bytes of a key, zero padded, as a big-endian number,
+// so comparing two prefixes orders like comparing the bytes.
+inline uint32_t keyPrefix(const uint8_t *key, size_t size) {
+  uint8_t buf[KEY_PREFIX_SIZE] = {0, 0, 0, 0};
+  memcpy(buf, key, std::min(size, KEY_PREFIX_SIZE));
+  return (uint32_t(buf[0]) << 24) | (uint32_t(buf[1]) << 16) |
+         (uint32_t(buf[2]) << 8) | uint32_t(buf[3]);
+}
+
+inline int keyCompare(const std::vector<uint8_t> &a,
+                      const std::vector<uint8_t> &b) {
+  return keyCompare(a.data(), a.size(), b.data(), b.size());
+}
+
+// Key orders a tree can be created with; the id is recorded in Meta.
+static constexpr uint8_t KEY_ORDER_BYTEWISE = 0;
+static constexpr uint8_t KEY_ORDER_U64 = 1;
+static constexpr uint8_t KEY_ORDER_REVERSE = 2;
+static constexpr uint8_t KEY_ORDER_TUPLE = 3;
+
+// Comparators are stateless types so BNode::indexLookup can be instantiated
+// once per order with the compare inlined into the search loop.
+
+// memcmp order, shorter key first on a tie
+struct BytewiseOrder {
+  static constexpr uint8_t id = KEY_ORDER_BYTEWISE;
+  static int compare(const uint8_t *a, size_t aSize, const uint8_t *b,
+                     size_t bSize) {
+    return keyCompare(a, aSize, b, bSize);
+  }
+};
+
+// 8-byte keys holding a uint64_t in host byte order. A tree with this order
+// refuses to store keys of any other size, since mixing sizes would leave
+// no consistent order; such keys fall back to bytewise order only as probes
+// (they match nothing).
+struct U64Order {
+  static constexpr uint8_t id = KEY_ORDER_U64;
+  static int compare(const uint8_t *a, size_t aSize, const uint8_t *b,
+                     size_t bSize) {
+    if (aSize != sizeof(uint64_t) || bSize != sizeof(uint64_t))
+      return keyCompare(a, aSize, b, bSize);
+    uint64_t x, y;
+    memcpy(&x, a, sizeof(x));
+    memcpy(&y, b, sizeof(y));
+    return (x > y) - (x < y);
+  }
+};
+
+// bytewise order, descending
+struct ReverseOrder {
+  static constexpr uint8_t id = KEY_ORDER_REVERSE;
+  static int compare(const uint8_t *a, size_t aSize, const uint8_t *b,
+                     size_t bSize) {
+    return keyCompare(b, bSize, a, aSize);
+  }
+};
+
+// Keys are tuples encoded as consecutive [size:2B little-endian][bytes]
+// components. Tuples compare component by component (each bytewise), and a
+// tuple sorts before any longer tuple it is a prefix of. A truncated
+// trailing component is compared as raw bytes. Keys whose components all
+// compare equal but whose bytes differ (possible only with truncated
+// components) are ordered bytewise, so only identical keys are equal.
+struct TupleOrder {
+  static constexpr uint8_t id = KEY_ORDER_TUPLE;
+  static int compare(const uint8_t *a, size_t aSize, const uint8_t *b,
+                     size_t bSize) {
+    size_t i = 0, j = 0;
+    while (i < aSize && j < bSize) {
+      const uint8_t *ca, *cb;
+      size_t al, bl;
+      next(a, aSize, i, ca, al);
+      next(b, bSize, j, cb, bl);
+      int cmp = keyCompare(ca, al, cb, bl);
+      if (cmp != 0)
+        return cmp;
+    }
+    if (int rest = (i < aSize) - (j < bSize))
+      return rest;
+    return keyCompare(a, aSize, b, bSize);
+  }
+
+private:
+  static void next(const uint8_t *key, size_t size, size_t &pos,
+                   const uint8_t *&comp, size_t &compSize) {
+    if (pos + 2 > size) {
+      comp = key + pos;
+      compSize = size - pos;
+      pos = size;
+      return;
+    }
+    size_t len = size_t(key[pos]) | (size_t(key[pos + 1]) << 8);
+    comp = key + pos + 2;
+    compSize = std::min(len, size - pos - 2);
+    pos += 2 + compSize;
+  }
+};
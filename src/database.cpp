@@ -0,0 +1,152 @@
+#include "database.h"
+
+#include <stdexcept>
+
+namespace {
+
+constexpr size_t CATALOG_ENTRY_SIZE = 5;
+
+} // namespace
+
+Database::Database(const std::string &path, PagerOptions options)
+    : pager_(std::make_shared<Pager>(path, options)) {
+  uint32_t root = pager_->rootPage();
+  if (root != 0 && !(pager_->metaFlags() & META_FLAG_CATALOG))
+    throw std::invalid_argument("Database: file holds a single tree");
+
+  // a new file gets its catalog and the flag in one transaction
+  if (root == 0) {
+    pager_->beginTxn();
+    pager_->setMetaFlags(pager_->metaFlags() | META_FLAG_CATALOG);
+  }
+  Pager *pager = pager_.get();
+  catalog_.reset(new BTree(pager_, BTreeOptions(), root, KEY_ORDER_BYTEWISE,
+                           [pager](uint32_t r) { pager->setRootPage(r); }));
+  if (root == 0)
+    pager_->commitTxn();
+}
+
+Database::~Database() {
+  if (pager_->inTxn()) {
+    try {
+      pager_->abortTxn();
+    } catch (...) {
+      // the file is left as of its last commit either way
+    }
+  }
+}
+
+std::vector<uint8_t> Database::catalogKey(const std::string &name) {
+  if (name.empty() || name.size() + CATALOG_ENTRY_SIZE > MAX_ENTRY_SIZE)
+    throw std::invalid_argument("Database: bad tree name");
+  return std::vector<uint8_t>(name.begin(), name.end());
+}
+
+std::vector<uint8_t> Database::encodeEntry(uint32_t root, uint8_t keyOrder) {
+  std::vector<uint8_t> value(CATALOG_ENTRY_SIZE);
+  LittleEndian::store_u32(value.data(), root);
+  value[4] = keyOrder;
+  return value;
+}
+
+std::pair<uint32_t, uint8_t>
+Database::decodeEntry(const std::vector<uint8_t> &value) {
+  if (value.size() != CATALOG_ENTRY_SIZE)
+    throw std::runtime_error("Database: corrupt catalog entry");
+  return {LittleEndian::load_u32(value.data()), value[4]};
+}
+
+BTree &Database::open(const std::string &name, BTreeOptions options) {
+  auto it = trees_.find(name);
+  if (it != trees_.end())
+    return *it->second;
+
+  std::vector<uint8_t> key = catalogKey(name);
+  uint32_t root = 0;
+  uint8_t keyOrder = options.keyOrder;
+  if (auto entry = catalog_->search(key))
+    std::tie(root, keyOrder) = decodeEntry(*entry);
+
+  BTree *catalog = catalog_.get();
+  auto publish = [catalog, key, keyOrder](uint32_t r) {
+    catalog->insert(key, encodeEntry(r, keyOrder));
+  };
+  std::unique_ptr<BTree> tree(
+      new BTree(pager_, options, root, keyOrder, std::move(publish)));
+  return *trees_.emplace(name, std::move(tree)).first->second;
+}
+
+bool Database::contains(const std::string &name) const {
+  return catalog_->search(catalogKey(name)).has_value();
+}
+
+std::vector<std::string> Database::names() const {
+  std::vector<std::string> out;
+  catalog_->scan({}, {},
+                 [&out](const std::vector<uint8_t> &key,
+                        const std::vector<uint8_t> &) {
+                   out.emplace_back(key.begin(), key.end());
+                   return true;
+                 });
+  return out;
+}
+
+bool Database::drop(const std::string &name) {
+  if (!contains(name))
+    return false;
+
+  BTree &tree = open(name);
+  pager_->beginTxn();
+  try {
+    tree.freeSubtree(tree.rootPage_, tree.treeHeight());
+    catalog_->remove(catalogKey(name));
+    pager_->commitTxn();
+  } catch (...) {
+    // like a failed tree operation: on its own the drop is rolled back,
+    // inside the caller's transaction its level is left open for them
+    if (pager_->txnDepth() == 1)
+      abortTxn();
+    throw;
+  }
+  trees_.erase(name);
+  return true;
+}
+
+void Database::beginTxn() {
+  if (pager_->inTxn())
+    throw std::runtime_error("Database: a transaction is already open");
+  pager_->beginTxn();
+}
+
+void Database::commitTxn() {
+  // an operation that threw leaves its level of the transaction open
+  if (!pager_->inTxn() || pager_->txnDepth() != 1)
+    throw std::runtime_error("Database: no transaction to commit, or an "
+                             "operation in it failed");
+  pager_->commitTxn();
+  // filters that grew past their size in the transaction
+  for (auto &entry : trees_)
+    entry.second->rebuildFilterIfDue();
+}
+
+void Database::abortTxn() {
+  pager_->abortTxn();
+  reloadRoots();
+}
+
+void Database::reloadRoots() {
+  catalog_->rootPage_ = pager_->rootPage();
+  for (auto it = trees_.begin(); it != trees_.end();) {
+    auto entry = catalog_->search(catalogKey(it->first));
+    if (entry.has_value()) {
+      it->second->rootPage_ = decodeEntry(*entry).first;
+      // a tree first opened in the transaction has no filter yet; others
+      // keep theirs, due or not, until a commit
+      if (!it->second->filter_)
+        it->second->rebuildFilterIfDue();
+      ++it;
+    } else {
+      it = trees_.erase(it);
+    }
+  }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "btree.h"
+#include "pager.h"
+
+// A file holding any number of named trees. Their roots are kept in a
+// catalog tree, rooted in Meta (which is flagged META_FLAG_CATALOG), under
+// each tree's name as [root page:4B][key order:1B].
+//
+// Each operation on a tree commits on its own, catalog update included,
+// with one meta write and fsync. Between beginTxn and commitTxn operations
+// on any of the trees go into a single transaction instead, committed with
+// one meta write and fsync, or not at all.
+class Database {
+public:
+  explicit Database(const std::string &path, PagerOptions options = {});
+  // a transaction left open is aborted
+  ~Database();
+
+  Database(const Database &) = delete;
+  Database &operator=(const Database &) = delete;
+
+  // The tree called name, created with `options` if the catalog doesn't
+  // list it. The tree, and with it its root, stays cached until the
+  // Database goes away or the tree is dropped, so every call returns the
+  // same object; options only apply the first time.
+  BTree &open(const std::string &name, BTreeOptions options = {});
+
+  bool contains(const std::string &name) const;
+  std::vector<std::string> names() const;
+
+  // Frees the tree's pages and takes it off the catalog. References
+  // returned by open() for it become invalid. A drop that throws inside a
+  // transaction leaves it to be aborted, as any other operation does.
+  bool drop(const std::string &name);
+
+  // If an operation throws inside a transaction, the transaction has to be
+  // aborted; commitTxn refuses it. Aborting puts every open tree back to
+  // its last committed root and closes trees created in the transaction.
+  void beginTxn();
+  void commitTxn();
+  void abortTxn();
+
+  Pager &pager() { return *pager_; }
+
+  static std::vector<uint8_t> encodeEntry(uint32_t root, uint8_t keyOrder);
+  // root page and key order of a catalog entry
+  static std::pair<uint32_t, uint8_t>
+  decodeEntry(const std::vector<uint8_t> &value);
+
+private:
+  static std::vector<uint8_t> catalogKey(const std::string &name);
+
+  // rereads every cached root after an abort
+  void reloadRoots();
+
+  std::shared_ptr<Pager> pager_;
+  std::unique_ptr<BTree> catalog_;
+  std::map<std::string, std::unique_ptr<BTree>> trees_;
+};
@@ -1,89 +1,140 @@
 #pragma once
 
 #include <cassert>
+#include <cstddef>
 #include <cstdint>
+#include <cstring>
 #include <vector>
 
-class LittleEndian {
-public:
-  static uint16_t read_u16(const std::vector<uint8_t> &buf, size_t pos) {
-    assert(pos + 2 <= buf.size());
-    return (uint16_t(buf[pos])) | (uint16_t(buf[pos + 1]) << 8);
-  }
+// Fixed-width integer codecs. The pointer-based load/store functions compile
+// to a single (unaligned) load or store, plus a bswap when the host byte
+// order differs from the encoding. The vector overloads are kept for callers
+// that want the bounds assert; they take any contiguous byte container.
 
-  static void write_u16(std::vector<uint8_t> &buf, size_t pos, uint16_t v) {
-    assert(pos + 2 <= buf.size());
-    buf[pos] = uint8_t(v & 0xFF);
-    buf[pos + 1] = uint8_t((v >> 8) & 0xFF);
+static constexpr bool HOST_IS_LITTLE_ENDIAN =
+    __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__;
+
+namespace endian_detail {
+
+template <typename T> inline T bswap(T v) {
+  if constexpr (sizeof(T) == 2)
+    return __builtin_bswap16(v);
+  else if constexpr (sizeof(T) == 4)
+    return __builtin_bswap32(v);
+  else
+    return __builtin_bswap64(v);
+}
+
+template <typename T, bool Little> inline T load(const uint8_t *p) {
+  T v;
+  memcpy(&v, p, sizeof(T));
+  if constexpr (Little != HOST_IS_LITTLE_ENDIAN)
+    v = bswap(v);
+  return v;
+}
+
+template <typename T, bool Little> inline void store(uint8_t *p, T v) {
+  if constexpr (Little != HOST_IS_LITTLE_ENDIAN)
+    v = bswap(v);
+  memcpy(p, &v, sizeof(T));
+}
+
+// When the encoding matches the host the whole array is one memcpy;
+// otherwise it's a loop the compiler vectorizes into byte shuffles.
+template <typename T, bool Little>
+inline void loadArray(const uint8_t *src, T *dst, size_t n) {
+  if constexpr (Little == HOST_IS_LITTLE_ENDIAN) {
+    memcpy(dst, src, n * sizeof(T));
+  } else {
+    for (size_t i = 0; i < n; i++)
+      dst[i] = load<T, Little>(src + i * sizeof(T));
   }
+}
 
-  static uint32_t read_u32(const std::vector<uint8_t> &buf, size_t pos) {
-    assert(pos + 4 <= buf.size());
-    uint32_t v = 0;
-    for (int i = 0; i < 4; ++i)
-      v |= uint32_t(buf[pos + i]) << (8 * i);
-    return v;
+template <typename T, bool Little>
+inline void storeArray(uint8_t *dst, const T *src, size_t n) {
+  if constexpr (Little == HOST_IS_LITTLE_ENDIAN) {
+    memcpy(dst, src, n * sizeof(T));
+  } else {
+    for (size_t i = 0; i < n; i++)
+      store<T, Little>(dst + i * sizeof(T), src[i]);
   }
+}
 
-  static void write_u32(std::vector<uint8_t> &buf, size_t pos, uint32_t v) {
-    assert(pos + 4 <= buf.size());
-    for (int i = 0; i < 4; ++i)
-      buf[pos + i] = uint8_t((v >> (8 * i)) & 0xFF);
+} // namespace endian_detail
+
+template <bool Little> class EndianCodec {
+public:
+  static uint16_t load_u16(const uint8_t *p) {
+    return endian_detail::load<uint16_t, Little>(p);
+  }
+  static uint32_t load_u32(const uint8_t *p) {
+    return endian_detail::load<uint32_t, Little>(p);
+  }
+  static uint64_t load_u64(const uint8_t *p) {
+    return endian_detail::load<uint64_t, Little>(p);
   }
 
-  static uint64_t read_u64(const std::vector<uint8_t> &buf, size_t pos) {
-    assert(pos + 8 <= buf.size());
-    uint64_t v = 0;
-    for (int i = 0; i < 8; ++i)
-      v |= uint64_t(buf[pos + i]) << (8 * i);
-    return v;
+  static void store_u16(uint8_t *p, uint16_t v) {
+    endian_detail::store<uint16_t, Little>(p, v);
+  }
+  static void store_u32(uint8_t *p, uint32_t v) {
+    endian_detail::store<uint32_t, Little>(p, v);
+  }
+  static void store_u64(uint8_t *p, uint64_t v) {
+    endian_detail::store<uint64_t, Little>(p, v);
   }
 
-  static void write_u64(std::vector<uint8_t> &buf, size_t pos, uint64_t v) {
-    assert(pos + 8 <= buf.size());
-    for (int i = 0; i < 8; ++i)
-      buf[pos + i] = uint8_t((v >> (8 * i)) & 0xFF);
+  // bulk variants: decode/encode n consecutive values
+  static void load_u16_array(const uint8_t *src, uint16_t *dst, size_t n) {
+    endian_detail::loadArray<uint16_t, Little>(src, dst, n);
+  }
+  static void load_u32_array(const uint8_t *src, uint32_t *dst, size_t n) {
+    endian_detail::loadArray<uint32_t, Little>(src, dst, n);
+  }
+  static void store_u16_array(uint8_t *dst, const uint16_t *src, size_t n) {
+    endian_detail::storeArray<uint16_t, Little>(dst, src, n);
+  }
+  static void store_u32_array(uint8_t *dst, const uint32_t *src, size_t n) {
+    endian_detail::storeArray<uint32_t, Little>(dst, src, n);
   }
-};
 
-class BigEndian {
-public:
-  static uint16_t read_u16(const std::vector<uint8_t> &buf, size_t pos) {
+  template <typename Buf>
+  static uint16_t read_u16(const Buf &buf, size_t pos) {
     assert(pos + 2 <= buf.size());
-    return (uint16_t(buf[pos]) << 8) | uint16_t(buf[pos + 1]);
+    return load_u16(buf.data() + pos);
   }
 
-  static void write_u16(std::vector<uint8_t> &buf, size_t pos, uint16_t v) {
+  template <typename Buf>
+  static void write_u16(Buf &buf, size_t pos, uint16_t v) {
     assert(pos + 2 <= buf.size());
-    buf[pos] = uint8_t((v >> 8) & 0xFF);
-    buf[pos + 1] = uint8_t(v & 0xFF);
+    store_u16(buf.data() + pos, v);
   }
 
-  static uint32_t read_u32(const std::vector<uint8_t> &buf, size_t pos) {
+  template <typename Buf>
+  static uint32_t read_u32(const Buf &buf, size_t pos) {
     assert(pos + 4 <= buf.size());
-    uint32_t v = 0;
-    for (int i = 0; i < 4; ++i)
-      v |= uint32_t(buf[pos + i]) << (8 * (3 - i));
-    return v;
+    return load_u32(buf.data() + pos);
   }
 
-  static void write_u32(std::vector<uint8_t> &buf, size_t pos, uint32_t v) {
+  template <typename Buf>
+  static void write_u32(Buf &buf, size_t pos, uint32_t v) {
     assert(pos + 4 <= buf.size());
-    for (int i = 0; i < 4; ++i)
-      buf[pos + i] = uint8_t((v >> (8 * (3 - i))) & 0xFF);
+    store_u32(buf.data() + pos, v);
   }
 
-  static uint64_t read_u64(const std::vector<uint8_t> &buf, size_t pos) {
+  template <typename Buf>
+  static uint64_t read_u64(const Buf &buf, size_t pos) {
     assert(pos + 8 <= buf.size());
-    uint64_t v = 0;
-    for (int i = 0; i < 8; ++i)
-      v |= uint64_t(buf[pos + i]) << (8 * (7 - i));
-    return v;
+    return load_u64(buf.data() + pos);
   }
 
-  static void write_u64(std::vector<uint8_t> &buf, size_t pos, uint64_t v) {
+  template <typename Buf>
+  static void write_u64(Buf &buf, size_t pos, uint64_t v) {
     assert(pos + 8 <= buf.size());
-    for (int i = 0; i < 8; ++i)
-      buf[pos + i] = uint8_t((v >> (8 * (7 - i))) & 0xFF);
+    store_u64(buf.data() + pos, v);
   }
 };
+
+using LittleEndian = EndianCodec<true>;
+using BigEndian = EndianCodec<false>;
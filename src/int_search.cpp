@@ -0,0 +1,79 @@
+#include "int_search.h"
+
+#include "endianness.h"
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define DBITE_HAVE_X86_SIMD 1
+#endif
+
+namespace {
+
+// ranges at most this long are finished with a linear compare-and-count
+constexpr size_t LINEAR_WINDOW = 16;
+
+inline int64_t keyAt(const uint8_t *keys, size_t i) {
+  return static_cast<int64_t>(LittleEndian::load_u64(keys + 8 * i));
+}
+
+size_t countLessScalar(const uint8_t *keys, size_t n, int64_t target) {
+  size_t count = 0;
+  for (size_t i = 0; i < n; i++)
+    count += keyAt(keys, i) < target;
+  return count;
+}
+
+#ifdef DBITE_HAVE_X86_SIMD
+__attribute__((target("avx2"))) size_t
+countLessAvx2(const uint8_t *keys, size_t n, int64_t target) {
+  const __m256i t = _mm256_set1_epi64x(target);
+  size_t count = 0, i = 0;
+  for (; i + 4 <= n; i += 4) {
+    __m256i v =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys + 8 * i));
+    __m256i lt = _mm256_cmpgt_epi64(t, v);
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(lt)));
+  }
+  return count + countLessScalar(keys + 8 * i, n - i, target);
+}
+
+__attribute__((target("sse4.2"))) size_t
+countLessSse42(const uint8_t *keys, size_t n, int64_t target) {
+  const __m128i t = _mm_set1_epi64x(target);
+  size_t count = 0, i = 0;
+  for (; i + 2 <= n; i += 2) {
+    __m128i v =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys + 8 * i));
+    __m128i lt = _mm_cmpgt_epi64(t, v);
+    count += __builtin_popcount(_mm_movemask_pd(_mm_castsi128_pd(lt)));
+  }
+  return count + countLessScalar(keys + 8 * i, n - i, target);
+}
+#endif
+
+using CountLessFn = size_t (*)(const uint8_t *, size_t, int64_t);
+
+CountLessFn selectCountLess() {
+#ifdef DBITE_HAVE_X86_SIMD
+  if (__builtin_cpu_supports("avx2"))
+    return countLessAvx2;
+  if (__builtin_cpu_supports("sse4.2"))
+    return countLessSse42;
+#endif
+  return countLessScalar;
+}
+
+} // namespace
+
+size_t int64LowerBound(const uint8_t *keys, size_t n, int64_t target) {
+  static const CountLessFn countLess = selectCountLess();
+
+  // the answer stays within [base, base + len]
+  size_t base = 0, len = n;
+  while (len > LINEAR_WINDOW) {
+    size_t half = len / 2;
+    base = keyAt(keys, base + half) < target ? base + half : base;
+    len -= half;
+  }
+  return base + countLess(keys + 8 * base, len, target);
+}
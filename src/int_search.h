@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// Lower bound over a dense, ascending array of n little-endian int64 values:
+// returns how many of them are less than target. A branchless binary search
+// narrows the range to a few cache lines, which are then counted with AVX2
+// or SSE4.2 compares when the CPU has them.
+size_t int64LowerBound(const uint8_t *keys, size_t n, int64_t target);
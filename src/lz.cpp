@@ -0,0 +1,218 @@
+#include "lz.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+
+#include "endianness.h"
+
+namespace {
+
+constexpr size_t MIN_MATCH = 4;
+constexpr size_t HASH_BITS = 12;
+constexpr size_t MAX_OFFSET = 0xFFFF;
+constexpr size_t NIBBLE_MAX = 15;
+
+struct Counters {
+  std::atomic<uint64_t> compressed{0};
+  std::atomic<uint64_t> compressedIn{0};
+  std::atomic<uint64_t> compressedOut{0};
+  std::atomic<uint64_t> compressNs{0};
+  std::atomic<uint64_t> decompressed{0};
+  std::atomic<uint64_t> decompressedOut{0};
+  std::atomic<uint64_t> decompressNs{0};
+};
+
+Counters &counters() {
+  static Counters c;
+  return c;
+}
+
+uint64_t elapsedNs(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+inline uint32_t load32(const uint8_t *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint32_t hash4(uint32_t seq) {
+  return (seq * 2654435761u) >> (32 - HASH_BITS);
+}
+
+// appends the continuation bytes of a length whose nibble overflowed
+inline void putLength(uint8_t *dst, size_t &op, size_t len) {
+  for (; len >= 255; len -= 255)
+    dst[op++] = 255;
+  dst[op++] = static_cast<uint8_t>(len);
+}
+
+inline bool readLength(const uint8_t *src, size_t srcLen, size_t &ip,
+                       size_t &len) {
+  uint8_t b;
+  do {
+    if (ip >= srcLen)
+      return false;
+    b = src[ip++];
+    len += b;
+  } while (b == 255);
+  return true;
+}
+
+// One sequence: literals [lit, lit + litLen), then, when matchLen > 0, a
+// copy of matchLen bytes from offset back. False if dst would overflow.
+bool putSequence(uint8_t *dst, size_t &op, size_t capacity,
+                 const uint8_t *lit, size_t litLen, size_t offset,
+                 size_t matchLen) {
+  size_t worst = 1 + litLen + litLen / 255 + 1;
+  if (matchLen > 0)
+    worst += 2 + matchLen / 255 + 1;
+  if (op + worst > capacity)
+    return false;
+
+  size_t litNibble = litLen < NIBBLE_MAX ? litLen : NIBBLE_MAX;
+  size_t matchCode = matchLen > 0 ? matchLen - MIN_MATCH : 0;
+  size_t matchNibble = matchCode < NIBBLE_MAX ? matchCode : NIBBLE_MAX;
+  dst[op++] = static_cast<uint8_t>(litNibble << 4 | matchNibble);
+  if (litNibble == NIBBLE_MAX)
+    putLength(dst, op, litLen - NIBBLE_MAX);
+  memcpy(dst + op, lit, litLen);
+  op += litLen;
+  if (matchLen == 0)
+    return true;
+
+  LittleEndian::store_u16(dst + op, static_cast<uint16_t>(offset));
+  op += 2;
+  if (matchNibble == NIBBLE_MAX)
+    putLength(dst, op, matchCode - NIBBLE_MAX);
+  return true;
+}
+
+} // namespace
+
+size_t lzCompress(const uint8_t *src, size_t n, uint8_t *dst,
+                  size_t dstCapacity) {
+  if (n > LZ_MAX_BLOCK_SIZE)
+    return 0;
+  auto start = std::chrono::steady_clock::now();
+
+  // positions fit 16 bits in a block; a stale or empty slot is caught by
+  // comparing the bytes
+  uint16_t table[size_t(1) << HASH_BITS] = {};
+  size_t ip = 0, anchor = 0, op = 0;
+  bool fits = true;
+  while (fits && ip + MIN_MATCH <= n) {
+    uint32_t seq = load32(src + ip);
+    uint32_t h = hash4(seq);
+    size_t ref = table[h];
+    table[h] = static_cast<uint16_t>(ip);
+    if (ref >= ip || ip - ref > MAX_OFFSET || load32(src + ref) != seq) {
+      ip++;
+      continue;
+    }
+
+    size_t len = MIN_MATCH;
+    while (ip + len < n && src[ref + len] == src[ip + len])
+      len++;
+    fits = putSequence(dst, op, dstCapacity, src + anchor, ip - anchor,
+                       ip - ref, len);
+    ip += len;
+    anchor = ip;
+    // the match's last position seeds the search that follows it
+    if (ip + MIN_MATCH - 1 <= n)
+      table[hash4(load32(src + ip - 1))] = static_cast<uint16_t>(ip - 1);
+  }
+  fits = fits &&
+         putSequence(dst, op, dstCapacity, src + anchor, n - anchor, 0, 0);
+  if (!fits)
+    op = 0;
+
+  // blocks that don't fit still cost their time
+  Counters &c = counters();
+  c.compressNs.fetch_add(elapsedNs(start), std::memory_order_relaxed);
+  if (op > 0) {
+    c.compressed.fetch_add(1, std::memory_order_relaxed);
+    c.compressedIn.fetch_add(n, std::memory_order_relaxed);
+    c.compressedOut.fetch_add(op, std::memory_order_relaxed);
+  }
+  return op;
+}
+
+bool lzDecompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t n) {
+  auto start = std::chrono::steady_clock::now();
+  size_t ip = 0, op = 0;
+  for (;;) {
+    if (ip >= srcLen)
+      return false;
+    uint8_t token = src[ip++];
+
+    size_t litLen = token >> 4;
+    if (litLen == NIBBLE_MAX && !readLength(src, srcLen, ip, litLen))
+      return false;
+    if (litLen > srcLen - ip || litLen > n - op)
+      return false;
+    memcpy(dst + op, src + ip, litLen);
+    ip += litLen;
+    op += litLen;
+    if (ip == srcLen)
+      break;
+
+    if (srcLen - ip < 2)
+      return false;
+    size_t offset = LittleEndian::load_u16(src + ip);
+    ip += 2;
+    size_t matchLen = token & NIBBLE_MAX;
+    if (matchLen == NIBBLE_MAX && !readLength(src, srcLen, ip, matchLen))
+      return false;
+    matchLen += MIN_MATCH;
+    if (offset == 0 || offset > op || matchLen > n - op)
+      return false;
+
+    // an overlapping copy repeats the last `offset` bytes, so it goes
+    // byte by byte
+    const uint8_t *from = dst + op - offset;
+    if (offset >= matchLen) {
+      memcpy(dst + op, from, matchLen);
+    } else {
+      for (size_t i = 0; i < matchLen; i++)
+        dst[op + i] = from[i];
+    }
+    op += matchLen;
+  }
+  if (op != n)
+    return false;
+
+  Counters &c = counters();
+  c.decompressed.fetch_add(1, std::memory_order_relaxed);
+  c.decompressedOut.fetch_add(n, std::memory_order_relaxed);
+  c.decompressNs.fetch_add(elapsedNs(start), std::memory_order_relaxed);
+  return true;
+}
+
+LzStats lzStats() {
+  const Counters &c = counters();
+  LzStats s;
+  s.compressed = c.compressed.load(std::memory_order_relaxed);
+  s.compressedIn = c.compressedIn.load(std::memory_order_relaxed);
+  s.compressedOut = c.compressedOut.load(std::memory_order_relaxed);
+  s.compressNs = c.compressNs.load(std::memory_order_relaxed);
+  s.decompressed = c.decompressed.load(std::memory_order_relaxed);
+  s.decompressedOut = c.decompressedOut.load(std::memory_order_relaxed);
+  s.decompressNs = c.decompressNs.load(std::memory_order_relaxed);
+  return s;
+}
+
+void lzResetStats() {
+  Counters &c = counters();
+  c.compressed = 0;
+  c.compressedIn = 0;
+  c.compressedOut = 0;
+  c.compressNs = 0;
+  c.decompressed = 0;
+  c.decompressedOut = 0;
+  c.decompressNs = 0;
+}
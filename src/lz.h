@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+
+// A small LZ77 block codec in the manner of LZ4: a stream of sequences,
+// each a run of literals followed by a copy of earlier output. Compression
+// is one greedy pass with a hash table of 4-byte prefixes, which suits the
+// repetitive keys and values of a leaf; decompression is a tight copy loop.
+// Blocks are limited to 64 KiB, so every match offset fits 16 bits.
+//
+// Sequence: [token][literal length ext][literals][offset:2B LE][match ext]
+// - token: literal length in the high nibble, match length - 4 in the low
+//   nibble; a nibble of 15 continues in bytes of 255 ended by one below it
+// - the last sequence carries literals only
+
+static constexpr size_t LZ_MAX_BLOCK_SIZE = 64 * 1024;
+
+// Compresses n bytes of src into at most dstCapacity bytes of dst. Returns
+// the compressed size, or 0 when it doesn't fit.
+size_t lzCompress(const uint8_t *src, size_t n, uint8_t *dst,
+                  size_t dstCapacity);
+
+// Decompresses a block into exactly n bytes of dst; false if the block is
+// malformed or doesn't decode to n bytes.
+bool lzDecompress(const uint8_t *src, size_t srcLen, uint8_t *dst, size_t n);
+
+// Process-wide codec counters.
+struct LzStats {
+  uint64_t compressed = 0; // blocks
+  uint64_t compressedIn = 0;
+  uint64_t compressedOut = 0;
+  uint64_t compressNs = 0;
+  uint64_t decompressed = 0; // blocks
+  uint64_t decompressedOut = 0;
+  uint64_t decompressNs = 0;
+
+  double ratio() const {
+    return compressedOut ? static_cast<double>(compressedIn) / compressedOut
+                         : 0.0;
+  }
+};
+
+LzStats lzStats();
+void lzResetStats();
@@ -0,0 +1,87 @@
+#include "page_cache.h"
+
+PageCache::PageCache(size_t capacity)
+    : capacity_(capacity), generations_(GENERATION_SLOTS, 0) {}
+
+std::optional<PageBuffer> PageCache::get(uint32_t pageId) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(pageId);
+  if (it == index_.end()) {
+    stats_.misses++;
+    return std::nullopt;
+  }
+  stats_.hits++;
+  lru_.splice(lru_.begin(), lru_, it->second);
+  return it->second->second;
+}
+
+uint64_t PageCache::generation(uint32_t pageId) const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return generations_[pageId & (GENERATION_SLOTS - 1)];
+}
+
+void PageCache::put(uint32_t pageId, const PageBuffer &page) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  generationOf(pageId)++;
+  insertLocked(pageId, page);
+}
+
+bool PageCache::fill(uint32_t pageId, const PageBuffer &page,
+                     uint64_t generation) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (generationOf(pageId) != generation || index_.count(pageId) != 0)
+    return false;
+  insertLocked(pageId, page);
+  return true;
+}
+
+void PageCache::insertLocked(uint32_t pageId, const PageBuffer &page) {
+  if (capacity_ == 0)
+    return;
+  auto it = index_.find(pageId);
+  if (it != index_.end()) {
+    it->second->second = page;
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return;
+  }
+
+  if (lru_.size() >= capacity_) {
+    // reuse the evicted entry's buffer for the new page
+    auto last = std::prev(lru_.end());
+    index_.erase(last->first);
+    last->first = pageId;
+    last->second = page;
+    lru_.splice(lru_.begin(), lru_, last);
+  } else {
+    lru_.emplace_front(pageId, page);
+  }
+  index_[pageId] = lru_.begin();
+}
+
+void PageCache::erase(uint32_t pageId) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  generationOf(pageId)++;
+  auto it = index_.find(pageId);
+  if (it == index_.end())
+    return;
+  lru_.erase(it->second);
+  index_.erase(it);
+}
+
+void PageCache::clear() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (uint64_t &g : generations_)
+    g++;
+  lru_.clear();
+  index_.clear();
+}
+
+size_t PageCache::size() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return lru_.size();
+}
+
+PageCache::Stats PageCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "page_pool.h"
+
+// A fixed-capacity LRU cache of clean pages, used by the Pager in place of
+// the kernel's page cache when the file is opened with O_DIRECT. Memory use
+// is capped at `capacity` pages. Safe to use from the I/O threads.
+//
+// Pages read from the file race with the writer: a read may finish after
+// the page was rewritten, and its bytes are stale by then. So writes go in
+// with put, which bumps the page's generation, and reads with fill, which
+// only inserts a page that is absent and whose generation hasn't moved
+// since the read began.
+class PageCache {
+public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+  };
+
+  explicit PageCache(size_t capacity);
+
+  // a copy of the cached page, refreshed as most recently used
+  std::optional<PageBuffer> get(uint32_t pageId);
+  // the page's current generation, taken before reading it from the file
+  uint64_t generation(uint32_t pageId) const;
+  // inserts or replaces a page just written, evicting the least recently
+  // used one
+  void put(uint32_t pageId, const PageBuffer &page);
+  // inserts a page read at `generation` unless it is cached already or has
+  // been written or erased since; false if it was dropped
+  bool fill(uint32_t pageId, const PageBuffer &page, uint64_t generation);
+  void erase(uint32_t pageId);
+  void clear();
+
+  size_t size() const;
+  size_t capacity() const { return capacity_; }
+  Stats stats() const;
+
+private:
+  using Entry = std::pair<uint32_t, PageBuffer>;
+
+  // Generations are kept per slot of a fixed table rather than per page,
+  // so pages sharing a slot may drop each other's fills; that only costs
+  // a cache miss.
+  static constexpr size_t GENERATION_SLOTS = 4096;
+
+  uint64_t &generationOf(uint32_t pageId) {
+    return generations_[pageId & (GENERATION_SLOTS - 1)];
+  }
+  void insertLocked(uint32_t pageId, const PageBuffer &page);
+
+  size_t capacity_;
+  mutable std::mutex mutex_;
+  std::list<Entry> lru_; // front is most recently used
+  std::unordered_map<uint32_t, std::list<Entry>::iterator> index_;
+  std::vector<uint64_t> generations_;
+  Stats stats_;
+};
@@ -0,0 +1,166 @@
+#include "page_pool.h"
+
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <utility>
+
+#include "common.h"
+
+namespace {
+
+// set once the thread's pool is gone, so buffers freed during thread or
+// program teardown go straight back to the system
+thread_local bool poolDestroyed = false;
+
+void *allocatePages(size_t bytes) {
+  return ::operator new(bytes, std::align_val_t(BTREE_PAGE_SIZE));
+}
+
+void freePages(void *p) {
+  ::operator delete(p, std::align_val_t(BTREE_PAGE_SIZE));
+}
+
+} // namespace
+
+PagePool &PagePool::local() {
+  thread_local PagePool pool;
+  return pool;
+}
+
+int PagePool::sizeClass(size_t bytes) {
+  if (bytes == BTREE_PAGE_SIZE)
+    return 0;
+  if (bytes == 2 * BTREE_PAGE_SIZE)
+    return 1;
+  return -1;
+}
+
+void *PagePool::acquire(size_t bytes) {
+  stats_.acquired++;
+  int c = sizeClass(bytes);
+  if (c >= 0 && !free_[c].empty()) {
+    void *p = free_[c].back();
+    free_[c].pop_back();
+    stats_.retained--;
+    return p;
+  }
+  stats_.allocated++;
+  return allocatePages(bytes);
+}
+
+void *PagePool::allocateBuffer(size_t bytes) {
+  if (poolDestroyed)
+    return allocatePages(bytes);
+  return local().acquire(bytes);
+}
+
+void PagePool::freeBuffer(void *p, size_t bytes) {
+  if (poolDestroyed)
+    freePages(p);
+  else
+    local().release(p, bytes);
+}
+
+void PagePool::release(void *p, size_t bytes) {
+  stats_.released++;
+  int c = sizeClass(bytes);
+  if (c < 0 || free_[c].size() >= RETAIN_PER_CLASS) {
+    freePages(p);
+    return;
+  }
+  free_[c].push_back(p);
+  stats_.retained++;
+}
+
+PagePool::Stats PagePool::stats() const { return stats_; }
+
+void PagePool::resetStats() {
+  size_t retained = stats_.retained;
+  stats_ = Stats();
+  stats_.retained = retained;
+}
+
+PagePool::~PagePool() {
+  for (auto &list : free_)
+    for (void *p : list)
+      freePages(p);
+  poolDestroyed = true;
+}
+
+PageBuffer::PageBuffer(const PageBuffer &other) {
+  reserve(other.size_, false);
+  if (other.size_ > 0)
+    memcpy(data_, other.data_, other.size_);
+  size_ = other.size_;
+}
+
+PageBuffer::PageBuffer(PageBuffer &&other) noexcept
+    : data_(std::exchange(other.data_, nullptr)),
+      size_(std::exchange(other.size_, 0)),
+      capacity_(std::exchange(other.capacity_, 0)) {}
+
+PageBuffer &PageBuffer::operator=(const PageBuffer &other) {
+  if (this != &other) {
+    reserve(other.size_, false);
+    if (other.size_ > 0)
+      memcpy(data_, other.data_, other.size_);
+    size_ = other.size_;
+  }
+  return *this;
+}
+
+PageBuffer &PageBuffer::operator=(PageBuffer &&other) noexcept {
+  if (this != &other) {
+    std::swap(data_, other.data_);
+    std::swap(size_, other.size_);
+    std::swap(capacity_, other.capacity_);
+  }
+  return *this;
+}
+
+PageBuffer::~PageBuffer() {
+  if (data_ != nullptr)
+    PagePool::freeBuffer(data_, capacity_);
+}
+
+uint8_t &PageBuffer::at(size_t i) {
+  if (i >= size_)
+    throw std::out_of_range("PageBuffer::at");
+  return data_[i];
+}
+
+const uint8_t &PageBuffer::at(size_t i) const {
+  if (i >= size_)
+    throw std::out_of_range("PageBuffer::at");
+  return data_[i];
+}
+
+void PageBuffer::resize(size_t size) {
+  reserve(size, true);
+  if (size > size_)
+    memset(data_ + size_, 0, size - size_);
+  size_ = size;
+}
+
+void PageBuffer::assign(size_t size, uint8_t fill) {
+  reserve(size, false);
+  if (size > 0)
+    memset(data_, fill, size);
+  size_ = size;
+}
+
+// grows the allocation to at least `capacity` bytes, copying the current
+// contents over when `keep` is set
+void PageBuffer::reserve(size_t capacity, bool keep) {
+  if (capacity <= capacity_)
+    return;
+  uint8_t *fresh = static_cast<uint8_t *>(PagePool::allocateBuffer(capacity));
+  if (data_ != nullptr) {
+    if (keep && size_ > 0)
+      memcpy(fresh, data_, size_);
+    PagePool::freeBuffer(data_, capacity_);
+  }
+  data_ = fresh;
+  capacity_ = capacity;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Every node and page buffer is one or two pages long and most of them live
+// for a single insert or delete. PagePool keeps the freed ones on a per-thread
+// free list so the write path reuses them instead of going to malloc. Buffers
+// are aligned to BTREE_PAGE_SIZE.
+//
+// A buffer goes back to the pool of the thread that frees it, which need not
+// be the one that allocated it: pages read on I/O threads are mostly freed
+// by the caller. Each list is therefore capped where buffers are released,
+// and anything over the cap goes back to the system.
+class PagePool {
+public:
+  struct Stats {
+    uint64_t acquired = 0;   // buffers handed out
+    uint64_t allocated = 0;  // of those, fresh allocations from the system
+    uint64_t released = 0;   // buffers given back
+    size_t retained = 0;     // currently kept on the free lists
+  };
+
+  static constexpr size_t NUM_CLASSES = 2; // 1 and 2 pages
+  // buffers kept per size class
+  static constexpr size_t RETAIN_PER_CLASS = 64;
+
+  // the calling thread's pool
+  static PagePool &local();
+
+  // what PageBuffer calls; safe to use while the thread is exiting
+  static void *allocateBuffer(size_t bytes);
+  static void freeBuffer(void *p, size_t bytes);
+
+  void *acquire(size_t bytes);
+  void release(void *p, size_t bytes);
+
+  Stats stats() const;
+  void resetStats();
+
+  ~PagePool();
+
+private:
+  static int sizeClass(size_t bytes);
+
+  std::vector<void *> free_[NUM_CLASSES];
+  Stats stats_;
+};
+
+// An owned, page-aligned byte buffer drawn from the calling thread's
+// PagePool. It offers the slice of std::vector the node and pager code uses;
+// fills and copies are single memset/memcpy calls.
+class PageBuffer {
+public:
+  PageBuffer() = default;
+  explicit PageBuffer(size_t size, uint8_t fill = 0) { assign(size, fill); }
+
+  PageBuffer(const PageBuffer &other);
+  PageBuffer(PageBuffer &&other) noexcept;
+  PageBuffer &operator=(const PageBuffer &other);
+  PageBuffer &operator=(PageBuffer &&other) noexcept;
+  ~PageBuffer();
+
+  uint8_t *data() { return data_; }
+  const uint8_t *data() const { return data_; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  uint8_t &operator[](size_t i) { return data_[i]; }
+  const uint8_t &operator[](size_t i) const { return data_[i]; }
+  uint8_t &at(size_t i);
+  const uint8_t &at(size_t i) const;
+
+  uint8_t *begin() { return data_; }
+  uint8_t *end() { return data_ + size_; }
+  const uint8_t *begin() const { return data_; }
+  const uint8_t *end() const { return data_ + size_; }
+
+  // keeps the first min(size, size()) bytes; new bytes are zero
+  void resize(size_t size);
+  void assign(size_t size, uint8_t fill);
+
+private:
+  void reserve(size_t capacity, bool keep);
+
+  uint8_t *data_ = nullptr;
+  size_t size_ = 0;
+  size_t capacity_ = 0;
+};
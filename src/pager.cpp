@@ -1,85 +1,336 @@
 #include "pager.h"
 
-Pager::Pager(const std::string &path) : fd_(-1), path_(path) {
-  open_or_create_file();
+#include <atomic>
+#include <cstdio>
+
+namespace {
+
+std::atomic<uint8_t> defaultStorageKind{STORAGE_FILE};
+
+uint8_t resolveStorage(uint8_t storage) {
+  return storage == STORAGE_DEFAULT ? defaultStorageKind.load() : storage;
+}
+
+void pwriteAll(int fd, const uint8_t *buf, size_t bytes, off_t offset) {
+  size_t written = 0;
+  while (written < bytes) {
+    ssize_t r = ::pwrite(fd, buf + written, bytes - written,
+                         offset + static_cast<off_t>(written));
+    if (r < 0)
+      throw std::runtime_error("pwrite failed");
+    written += static_cast<size_t>(r);
+  }
+}
+
+} // namespace
+
+Pager::Pager(const std::string &path, PagerOptions options)
+    : path_(path), options_(options) {
+  options_.storage = resolveStorage(options_.storage);
+  if (options_.cachePages > 0)
+    cache_ = std::make_unique<PageCache>(options_.cachePages);
+  open_storage();
   load_meta();
+  load_freelist();
+  if (options_.hotManifestLeaves > 0 && options_.storage == STORAGE_FILE &&
+      !options_.readOnly) {
+    warm_up();
+    track_reads_ = true;
+  }
 }
 
 Pager::~Pager() {
-  if (fd_ >= 0)
-    ::close(fd_);
+  reader_.reset(); // let pending reads finish before the storage goes away
+  try {
+    writeHotManifest();
+  } catch (...) {
+    // only a hint for the next open
+  }
 }
 
-void Pager::open_or_create_file() {
-  fd_ = ::open(path_.c_str(), O_RDWR | O_CREAT, 0644);
-  assert(fd_ != -1);
+void Pager::setDefaultStorage(uint8_t storage) {
+  if (storage != STORAGE_FILE && storage != STORAGE_MEMORY)
+    throw std::invalid_argument("setDefaultStorage: unknown storage");
+  defaultStorageKind = storage;
+}
 
+uint8_t Pager::defaultStorage() { return defaultStorageKind; }
+
+bool Pager::exists(const std::string &path, const PagerOptions &options) {
+  if (resolveStorage(options.storage) == STORAGE_MEMORY)
+    return MemoryBackend::exists(path);
   struct stat st;
-  assert(fstat(fd_, &st) == 0);
+  return stat(path.c_str(), &st) == 0;
+}
 
-  off_t minSize = static_cast<off_t>(BTREE_PAGE_SIZE * 2);
+void Pager::open_storage() {
+  switch (options_.storage) {
+  case STORAGE_FILE:
+    storage_ = std::make_shared<FileBackend>(path_, options_.directIO,
+                                             options_.readOnly);
+    break;
+  case STORAGE_MEMORY:
+    if (options_.readOnly && !MemoryBackend::exists(path_))
+      throw std::runtime_error("Pager: no such memory file: " + path_);
+    storage_ = MemoryBackend::open(path_, options_.hugePages);
+    break;
+  default:
+    throw std::invalid_argument("Pager: unknown storage");
+  }
 
-  if (st.st_size < minSize) {
-    assert(ftruncate(fd_, minSize) == 0);
+  uint64_t minSize = BTREE_PAGE_SIZE * 2;
+  if (storage_->size() < minSize) {
+    if (options_.readOnly)
+      throw std::runtime_error("Pager: too short for a database: " + path_);
+    storage_->resize(minSize);
   }
 }
 
 void Pager::load_meta() {
-  Meta m;
-  memset(&m, 0, sizeof(m));
+  // read through an aligned buffer, as O_DIRECT requires
+  PageBuffer page(BTREE_PAGE_SIZE);
+  storage_->read(page.data(), BTREE_PAGE_SIZE, page_offset(0));
 
-  pread_full(reinterpret_cast<uint8_t *>(&m), BTREE_PAGE_SIZE, page_offset(0));
-
-  if (m.magic != META_MAGIC) {
+  Meta m;
+  memcpy(&m, page.data(), sizeof(m));
+
+  // Only a new file, whose meta page is still all zeros, gets a fresh
+  // meta; anything else has to be a valid meta page, and is never
+  // overwritten here. The magic is checked first, so a file of another
+  // format version isn't reported as corrupt.
+  bool blank = std::all_of(page.begin(), page.end(),
+                           [](uint8_t b) { return b == 0; });
+  if (!blank && m.magic >> 24 == META_MAGIC_PREFIX >> 24 &&
+      m.magic != META_MAGIC) {
+    std::string version = {char(m.magic >> 16), char(m.magic >> 8),
+                           char(m.magic)};
+    throw FormatError("Pager: " + path_ + " has file format version " +
+                      version + ", which this build doesn't support");
+  }
+  if (!blank && m.magic != META_MAGIC)
+    throw FormatError("Pager: no dbite meta page in " + path_);
+  if (!blank && !verify_page(page.data()))
+    throw ChecksumError(0);
+
+  if (blank && options_.readOnly)
+    throw std::runtime_error("Pager: no dbite meta page in " + path_);
+  if (blank) {
     m.magic = META_MAGIC;
     m.txn_id = 1;
     m.root_page = 0;
     m.next_page_id = 1;
     m.freelist_head = 0;
+    m.key_order = KEY_ORDER_BYTEWISE;
+    m.flags = 0;
     write_meta_to_page(m);
-    sync_fd();
+    storage_->sync();
   }
 
   meta_ = m;
 
   if (meta_.next_page_id < 1)
     meta_.next_page_id = 1;
+
+  std::lock_guard<std::mutex> lock(snapshot_mu_);
+  committed_ = meta_;
 }
 
-std::vector<uint8_t> Pager::readPage(uint32_t pageId) const {
+PageBuffer Pager::readPage(uint32_t pageId) const {
   auto it = dirty_pages_.find(pageId);
   if (it != dirty_pages_.end())
     return it->second;
 
-  std::vector<uint8_t> buf(BTREE_PAGE_SIZE);
-  off_t off = page_offset(pageId);
+  PageBuffer page = read_clean_page(pageId);
+  note_read(pageId, page);
+  return page;
+}
 
-  struct stat st;
-  if (fstat(fd_, &st) != 0)
-    throw std::runtime_error("fstat failed");
+PageBuffer Pager::read_clean_page(uint32_t pageId) const {
+  if (cache_) {
+    if (auto cached = cache_->get(pageId))
+      return std::move(*cached);
+  }
+  // a page rewritten while this read was in flight isn't cached stale
+  uint64_t generation = cache_ ? cache_->generation(pageId) : 0;
+  PageBuffer page = read_page_from_file(pageId);
+  if (cache_)
+    cache_->fill(pageId, page, generation);
+  return page;
+}
+
+PageBuffer Pager::read_page_from_file(uint32_t pageId) const {
+  PageBuffer buf(BTREE_PAGE_SIZE);
+  uint64_t off = page_offset(pageId);
 
-  if (off + static_cast<off_t>(BTREE_PAGE_SIZE) > st.st_size)
+  if (off + BTREE_PAGE_SIZE > storage_->size())
     throw std::runtime_error("readPage: page beyond file size");
 
-  pread_full(buf.data(), BTREE_PAGE_SIZE, off);
+  storage_->read(buf.data(), BTREE_PAGE_SIZE, off);
+  if (!verify_page(buf.data()))
+    throw ChecksumError(pageId);
   return buf;
 }
 
-uint32_t Pager::createPage(const std::vector<uint8_t> &data) {
-  uint32_t newId;
-  auto maybe = alloc_from_freelist();
-  if (maybe.has_value()) {
-    newId = maybe.value();
-  } else {
-    newId = meta_.next_page_id++;
+std::future<PageBuffer> Pager::readPageAsync(uint32_t pageId) const {
+  auto promise = std::make_shared<std::promise<PageBuffer>>();
+  std::future<PageBuffer> result = promise->get_future();
+  readPageAsync(pageId, [promise](PageBuffer page, std::exception_ptr error) {
+    if (error)
+      promise->set_exception(error);
+    else
+      promise->set_value(std::move(page));
+  });
+  return result;
+}
+
+void Pager::readPageAsync(uint32_t pageId, ReadCallback done) const {
+  auto it = dirty_pages_.find(pageId);
+  if (it != dirty_pages_.end()) {
+    done(it->second, nullptr);
+    return;
   }
 
-  assert(data.size() == BTREE_PAGE_SIZE);
+  reader().submit([this, pageId, done = std::move(done)] {
+    PageBuffer page;
+    std::exception_ptr error;
+    try {
+      page = read_clean_page(pageId);
+      note_read(pageId, page);
+    } catch (...) {
+      error = std::current_exception();
+    }
+    done(std::move(page), error);
+  });
+}
+
+void Pager::note_read(uint32_t pageId, const PageBuffer &page) const {
+  if (!track_reads_)
+    return;
+  std::lock_guard<std::mutex> lock(hot_mu_);
+  PageReads &r = hot_reads_[pageId];
+  r.reads++;
+  r.internal = (page[0] & BNODE_TYPE_MASK) == BNODE_INTERNAL;
+}
+
+std::vector<uint32_t> Pager::hotPages() const {
+  std::vector<uint32_t> pages;
+  std::vector<std::pair<uint64_t, uint32_t>> leaves;
+  {
+    std::lock_guard<std::mutex> lock(hot_mu_);
+    for (const auto &[id, r] : hot_reads_) {
+      if (r.internal)
+        pages.push_back(id);
+      else
+        leaves.push_back({r.reads, id});
+    }
+  }
+  size_t keep = std::min(leaves.size(), options_.hotManifestLeaves);
+  std::partial_sort(leaves.begin(), leaves.begin() + keep, leaves.end(),
+                    [](const auto &a, const auto &b) { return a > b; });
+  for (size_t i = 0; i < keep; i++)
+    pages.push_back(leaves[i].second);
+  std::sort(pages.begin(), pages.end());
+  return pages;
+}
+
+// [magic 8][count 4][page ids, 4 each][crc32c of what precedes 4], written
+// beside the file and renamed over the old one, so a crash leaves either
+void Pager::writeHotManifest() {
+  if (!track_reads_)
+    return;
+  std::vector<uint32_t> pages = hotPages();
+  std::vector<uint8_t> buf(12 + 4 * pages.size() + 4);
+  uint32_t count = static_cast<uint32_t>(pages.size());
+  memcpy(buf.data(), &HOT_MANIFEST_MAGIC, 8);
+  memcpy(buf.data() + 8, &count, 4);
+  if (count > 0)
+    memcpy(buf.data() + 12, pages.data(), 4 * pages.size());
+  uint32_t crc = crc32c(buf.data(), buf.size() - 4);
+  memcpy(buf.data() + buf.size() - 4, &crc, 4);
+
+  std::string tmp = manifest_path() + ".tmp";
+  int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd == -1)
+    throw std::runtime_error("open failed: " + tmp);
+  try {
+    pwriteAll(fd, buf.data(), buf.size(), 0);
+  } catch (...) {
+    ::close(fd);
+    std::remove(tmp.c_str());
+    throw;
+  }
+  ::close(fd);
+  if (std::rename(tmp.c_str(), manifest_path().c_str()) != 0)
+    throw std::runtime_error("rename failed: " + tmp);
+  commits_since_manifest_ = 0;
+}
+
+void Pager::warm_up() {
+  int fd = ::open(manifest_path().c_str(), O_RDONLY);
+  if (fd == -1)
+    return;
+  std::vector<uint8_t> buf;
+  uint8_t chunk[4096];
+  ssize_t r;
+  while ((r = ::read(fd, chunk, sizeof(chunk))) > 0)
+    buf.insert(buf.end(), chunk, chunk + r);
+  ::close(fd);
+
+  // a torn or foreign manifest is ignored; it only costs the warm-up
+  uint64_t magic;
+  uint32_t count, crc;
+  if (r < 0 || buf.size() < 16)
+    return;
+  memcpy(&magic, buf.data(), 8);
+  memcpy(&count, buf.data() + 8, 4);
+  memcpy(&crc, buf.data() + buf.size() - 4, 4);
+  if (magic != HOT_MANIFEST_MAGIC || buf.size() != 16 + 4 * uint64_t(count) ||
+      crc != crc32c(buf.data(), buf.size() - 4))
+    return;
 
-  std::vector<uint8_t> page(BTREE_PAGE_SIZE, 0);
-  std::copy(data.data(), data.data() + BTREE_PAGE_SIZE, page.data());
+  std::vector<uint32_t> pages(count);
+  if (count > 0)
+    memcpy(pages.data(), buf.data() + 12, 4 * size_t(count));
+  // the file may have changed since: skip what is past its end or free
+  pages.erase(std::remove_if(pages.begin(), pages.end(),
+                             [this](uint32_t id) {
+                               return id == 0 || id >= meta_.next_page_id ||
+                                      free_pages_.count(id) != 0;
+                             }),
+              pages.end());
+  std::sort(pages.begin(), pages.end());
+  pages.erase(std::unique(pages.begin(), pages.end()), pages.end());
+  warm_up_pages_ = pages;
+  prefetch(std::move(pages));
+}
 
-  dirty_pages_[newId] = std::move(page);
+AsyncReader &Pager::reader() const {
+  std::call_once(reader_once_, [this] {
+    reader_ = std::make_unique<AsyncReader>(options_.ioThreads);
+  });
+  return *reader_;
+}
+
+PageCache::Stats Pager::cacheStats() const {
+  return cache_ ? cache_->stats() : PageCache::Stats();
+}
+
+uint32_t Pager::next_free_page_id(uint32_t nearPage) {
+  auto maybe = alloc_from_freelist(nearPage);
+  if (maybe.has_value())
+    return maybe.value();
+  return meta_.next_page_id++;
+}
+
+uint32_t Pager::createPage(const PageBuffer &data, uint32_t nearPage) {
+  return createPage(PageBuffer(data), nearPage);
+}
+
+uint32_t Pager::createPage(PageBuffer &&data, uint32_t nearPage) {
+  assert(data.size() == BTREE_PAGE_SIZE);
+
+  uint32_t newId = next_free_page_id(nearPage);
+  dirty_pages_[newId] = std::move(data);
 
   return newId;
 }
@@ -89,196 +340,679 @@ bool Pager::deletePage(uint32_t pageId) {
 
   to_free_.push_back(pageId);
   dirty_pages_.erase(pageId);
+  if (cache_)
+    cache_->erase(pageId);
 
   return true;
 }
 
-void Pager::ensure_file_size_for_page(uint32_t pageId) {
-  off_t required = page_offset(pageId + 1);
+void Pager::prefetch(std::vector<uint32_t> pageIds) const {
+  pageIds.erase(std::remove_if(pageIds.begin(), pageIds.end(),
+                               [this](uint32_t id) {
+                                 return dirty_pages_.count(id) != 0;
+                               }),
+                pageIds.end());
+  std::sort(pageIds.begin(), pageIds.end());
+
+  // the kernel caches nothing for an O_DIRECT file; warm our own cache
+  if (options_.directIO) {
+    if (!cache_)
+      return;
+    for (uint32_t id : pageIds) {
+      reader().submit([this, id] {
+        try {
+          read_clean_page(id);
+        } catch (...) {
+          // a failed prefetch shows up again on the real read
+        }
+      });
+    }
+    return;
+  }
 
-  struct stat st;
-  if (fstat(fd_, &st) != 0)
-    throw std::runtime_error("fstat failed in ensure_file_size");
+  advise_runs(pageIds);
+}
 
-  if (st.st_size < required) {
-    if (ftruncate(fd_, required) != 0)
-      throw std::runtime_error("ftruncate failed to extend file");
+void Pager::advise_runs(const std::vector<uint32_t> &pageIds) const {
+  size_t i = 0;
+  while (i < pageIds.size()) {
+    size_t j = i + 1;
+    while (j < pageIds.size() && pageIds[j] <= pageIds[j - 1] + 1)
+      j++;
+    uint64_t len =
+        page_offset(pageIds[j - 1] + 1) - page_offset(pageIds[i]);
+    storage_->willNeed(page_offset(pageIds[i]), len);
+    i = j;
   }
 }
 
-void Pager::beginTxn() {
-  if (!dirty_pages_.empty() || !to_free_.empty()) {
-    commitTxn();
+Pager::Snapshot Pager::pinSnapshot() {
+  std::lock_guard<std::mutex> lock(snapshot_mu_);
+  pins_++;
+  return {committed_.txn_id, committed_.root_page, committed_.next_page_id,
+          static_cast<uint8_t>(committed_.key_order), committed_.flags};
+}
+
+void Pager::unpinSnapshot() {
+  std::lock_guard<std::mutex> lock(snapshot_mu_);
+  assert(pins_ > 0);
+  pins_--;
+}
+
+PageBuffer Pager::readCommittedPage(uint32_t pageId) const {
+  return read_clean_page(pageId);
+}
+
+void Pager::exportSnapshot(
+    int fd, const Snapshot &snap, const std::vector<uint32_t> &pages,
+    bool compact,
+    const std::function<void(uint32_t, uint8_t *)> &relink) const {
+  assert(std::is_sorted(pages.begin(), pages.end()));
+
+  // where each page of the copy comes from: a page of this file, or (src 0)
+  // one of the copy's freelist pages
+  struct Out {
+    uint32_t dst;
+    uint32_t src;
+  };
+  std::vector<Out> out;
+  std::unordered_map<uint32_t, FreelistPage> lists;
+
+  Meta m;
+  memset(&m, 0, sizeof(m));
+  m.magic = META_MAGIC;
+  m.txn_id = snap.txnId;
+  m.key_order = snap.keyOrder;
+  m.flags = snap.flags;
+
+  if (compact) {
+    for (size_t i = 0; i < pages.size(); i++)
+      out.push_back({static_cast<uint32_t>(i + 1), pages[i]});
+    auto root = std::lower_bound(pages.begin(), pages.end(), snap.rootPage);
+    assert(root != pages.end() && *root == snap.rootPage);
+    m.root_page = static_cast<uint32_t>(root - pages.begin()) + 1;
+    m.next_page_id = static_cast<uint32_t>(pages.size()) + 1;
+  } else {
+    std::vector<uint32_t> unused;
+    auto it = pages.begin();
+    for (uint32_t id = 1; id < snap.nextPageId; id++) {
+      if (it != pages.end() && *it == id) {
+        out.push_back({id, id});
+        ++it;
+      } else {
+        unused.push_back(id);
+      }
+    }
+
+    // the lowest unused ids hold the freelist of the rest
+    size_t chain = 0;
+    while (freelistPagesFor(unused.size() - chain) > chain)
+      chain++;
+    std::vector<uint32_t> chainPages(unused.begin(), unused.begin() + chain);
+    std::vector<uint32_t> listed(unused.begin() + chain, unused.end());
+    for (auto &[id, fp] : lay_out_freelist(chainPages, listed)) {
+      lists[id] = std::move(fp);
+      out.push_back({id, 0});
+    }
+    std::sort(out.begin(), out.end(),
+              [](const Out &a, const Out &b) { return a.dst < b.dst; });
+
+    m.root_page = snap.rootPage;
+    m.next_page_id = snap.nextPageId;
+    m.freelist_head = chain > 0 ? unused[0] : 0;
   }
-  in_txn_ = true;
+
+  PageBuffer batch(SNAPSHOT_BATCH_PAGES * BTREE_PAGE_SIZE);
+  size_t i = 0;
+  while (i < out.size()) {
+    // a run of consecutive pages of the copy, written with one pwrite
+    size_t j = i + 1;
+    while (j < out.size() && j - i < SNAPSHOT_BATCH_PAGES &&
+           out[j].dst == out[j - 1].dst + 1)
+      j++;
+
+    if (!options_.directIO) {
+      std::vector<uint32_t> srcs;
+      for (size_t k = i; k < j; k++)
+        if (out[k].src != 0)
+          srcs.push_back(out[k].src);
+      advise_runs(srcs);
+    }
+
+    size_t k = i;
+    while (k < j) {
+      uint8_t *page = batch.data() + (k - i) * BTREE_PAGE_SIZE;
+      if (out[k].src == 0) {
+        memset(page, 0, BTREE_PAGE_SIZE);
+        format_freelist_page(page, lists.at(out[k].dst));
+        seal_page(page);
+        k++;
+        continue;
+      }
+
+      // adjacent source pages are read together straight into the batch
+      size_t l = k + 1;
+      while (l < j && out[l].src == out[l - 1].src + 1)
+        l++;
+      storage_->read(page, (l - k) * BTREE_PAGE_SIZE, page_offset(out[k].src));
+      for (size_t n = k; n < l; n++) {
+        uint8_t *p = batch.data() + (n - i) * BTREE_PAGE_SIZE;
+        if (!verify_page(p))
+          throw ChecksumError(out[n].src);
+        if (compact && relink) {
+          relink(out[n].src, p);
+          seal_page(p);
+        }
+      }
+      k = l;
+    }
+
+    pwriteAll(fd, batch.data(), (j - i) * BTREE_PAGE_SIZE,
+              page_offset(out[i].dst));
+    i = j;
+  }
+
+  if (ftruncate(fd, page_offset(std::max<uint32_t>(m.next_page_id, 2))) != 0)
+    throw std::runtime_error("snapshot: ftruncate failed");
+
+  // the meta page goes last, once everything it points at is in place
+  PageBuffer meta(BTREE_PAGE_SIZE, 0);
+  memcpy(meta.data(), &m, sizeof(m));
+  seal_page(meta.data());
+  pwriteAll(fd, meta.data(), BTREE_PAGE_SIZE, page_offset(0));
+  if (fsync(fd) != 0)
+    throw std::runtime_error("snapshot: fsync failed");
+}
+
+void Pager::ensure_file_size_for_page(uint32_t pageId) {
+  uint64_t required = page_offset(pageId + 1);
+  if (storage_->size() < required)
+    storage_->resize(required);
+}
+
+void Pager::beginTxn() {
+  if (options_.readOnly)
+    throw std::runtime_error("Pager: opened read-only");
+  if (txn_depth_++ == 0)
+    in_txn_ = true;
 }
 
 void Pager::commitTxn() {
   if (!in_txn_)
     return;
+  if (txn_depth_ > 1) {
+    txn_depth_--;
+    return;
+  }
+  txn_depth_ = 0;
+
+  if (dirty_pages_.empty() && to_free_.empty() &&
+      meta_.root_page == committed_.root_page &&
+      meta_.key_order == committed_.key_order &&
+      meta_.flags == committed_.flags) {
+    in_txn_ = false;
+    return;
+  }
 
   write_dirty_pages();
 
-  for (uint32_t pageId : to_free_) {
-    push_to_freelist(pageId);
-  }
+  // Held until the new meta is published, so a snapshot is either pinned
+  // before this commit (and its pages freed here are held) or sees the
+  // new meta.
+  std::lock_guard<std::mutex> lock(snapshot_mu_);
 
   Meta newmeta = meta_;
   newmeta.txn_id += 1;
 
-  newmeta.next_page_id = std::max(newmeta.next_page_id, meta_.next_page_id);
-
+  // A pinned snapshot may still read the tree pages freed here, so while
+  // one is pinned they are listed but held back from reuse.
+  write_freelist(newmeta, pins_ > 0);
   write_meta_to_page(newmeta);
 
-  sync_fd();
+  storage_->sync();
 
   meta_ = newmeta;
+  committed_ = newmeta;
+
+  if (track_reads_) {
+    // freed pages will hold something else once reused
+    {
+      std::lock_guard<std::mutex> hot(hot_mu_);
+      for (uint32_t id : to_free_)
+        hot_reads_.erase(id);
+    }
+    if (++commits_since_manifest_ >= options_.hotManifestInterval) {
+      try {
+        writeHotManifest();
+      } catch (...) {
+        // the commit itself has succeeded
+      }
+    }
+  }
 
   dirty_pages_.clear();
   to_free_.clear();
   in_txn_ = false;
 }
 
-std::optional<uint32_t> Pager::alloc_from_freelist() {
-  uint32_t head = meta_.freelist_head;
-  if (head == 0)
-    return std::nullopt;
-
-  while (head != 0) {
-    std::vector<uint8_t> page = readPage(head);
+void Pager::abortTxn() {
+  dirty_pages_.clear();
+  to_free_.clear();
+  in_txn_ = false;
+  txn_depth_ = 0;
+  load_meta();
+  load_freelist();
+  // held pages are on the on-disk list but stay out of use until a commit
+  // releases them
+  std::lock_guard<std::mutex> lock(snapshot_mu_);
+  for (uint32_t id : held_)
+    free_pages_.erase(id);
+}
 
-    uint32_t next, count;
+void Pager::load_freelist() {
+  std::vector<uint32_t> dir;
+  std::vector<FreeLeaf> leaves;
+
+  // the ids on one freelist page
+  auto readList = [this](uint32_t pageId, uint32_t &next) {
+    if (pageId >= meta_.next_page_id)
+      throw std::runtime_error("corrupt freelist chain");
+    // not a node, so kept out of the hot-page counts
+    PageBuffer page = read_clean_page(pageId);
+    uint32_t count;
     memcpy(&next, page.data() + 0, sizeof(uint32_t));
     memcpy(&count, page.data() + 4, sizeof(uint32_t));
+    if (count > FREELIST_IDS_PER_PAGE)
+      throw std::runtime_error("corrupt freelist page");
+    std::vector<uint32_t> ids(count);
+    if (count > 0)
+      memcpy(ids.data(), page.data() + FREELIST_HEADER_SIZE,
+             count * sizeof(uint32_t));
+    return ids;
+  };
 
-    if (count > 0) {
-      const size_t entry_offset = 8;
-      size_t index_pos = entry_offset + (count - 1) * sizeof(uint32_t);
-      uint32_t id;
-      memcpy(&id, page.data() + index_pos, sizeof(uint32_t));
-
-      count--;
-
-      memcpy(page.data() + 4, &count, sizeof(uint32_t));
-      pwrite_full(page.data(), BTREE_PAGE_SIZE, page_offset(head));
+  uint32_t head = meta_.freelist_head;
+  while (head != 0) {
+    // a chain longer than the file has a cycle in it
+    if (dir.size() >= meta_.next_page_id)
+      throw std::runtime_error("corrupt freelist chain");
+    uint32_t next, leafNext;
+    for (uint32_t leaf : readList(head, next))
+      leaves.push_back({leaf, readList(leaf, leafNext)});
+    dir.push_back(head);
+    head = next;
+  }
+  set_freelist(std::move(dir), std::move(leaves));
+}
 
-      return id;
+void Pager::set_freelist(std::vector<uint32_t> dir,
+                         std::vector<FreeLeaf> leaves) {
+  free_pages_.clear();
+  listed_.clear();
+  for (uint32_t slot = 0; slot < leaves.size(); slot++) {
+    for (uint32_t id : leaves[slot].ids) {
+      listed_[id] = slot;
+      free_pages_.insert(id);
     }
-
-    head = next;
   }
+  freelist_pages_ = dir.size() + leaves.size();
+  fill_slot_ = leaves.empty() ? 0 : static_cast<uint32_t>(leaves.size() - 1);
+  free_leaves_ = std::move(leaves);
+  freelist_dir_ = std::move(dir);
+  spare_slots_.clear();
+  dirty_leaves_.clear();
+}
 
-  return std::nullopt;
+size_t Pager::freelistPagesFor(size_t ids) {
+  size_t leaves = (ids + FREELIST_IDS_PER_PAGE - 1) / FREELIST_IDS_PER_PAGE;
+  return leaves + (leaves + FREELIST_IDS_PER_PAGE - 1) / FREELIST_IDS_PER_PAGE;
 }
 
-void Pager::push_to_freelist(uint32_t pageId) {
-  const size_t per_page = (BTREE_PAGE_SIZE - 8) / sizeof(uint32_t);
+size_t Pager::heldPageCount() const {
+  std::lock_guard<std::mutex> lock(snapshot_mu_);
+  return held_.size();
+}
 
-  uint32_t head = meta_.freelist_head;
+std::optional<uint32_t> Pager::alloc_from_freelist(uint32_t nearPage) {
+  if (free_pages_.empty())
+    return std::nullopt;
+  auto it = free_pages_.begin();
+  if (nearPage != 0) {
+    // the closest free id on either side of the hint, ties going forward
+    // since scans and readahead run towards higher offsets
+    auto after = free_pages_.lower_bound(nearPage);
+    if (after == free_pages_.end()) {
+      it = std::prev(after);
+    } else if (after != free_pages_.begin()) {
+      auto before = std::prev(after);
+      it = nearPage - *before < *after - nearPage ? before : after;
+    } else {
+      it = after;
+    }
+  }
+  uint32_t id = *it;
+  free_pages_.erase(it);
+  unlist(id);
+  return id;
+}
 
-  if (head == 0) {
-    uint32_t new_head = meta_.next_page_id++;
+void Pager::unlist(uint32_t id) {
+  auto it = listed_.find(id);
+  assert(it != listed_.end());
+  uint32_t slot = it->second;
+  listed_.erase(it);
+  std::vector<uint32_t> &ids = free_leaves_[slot].ids;
+  *std::find(ids.begin(), ids.end(), id) = ids.back();
+  ids.pop_back();
+  dirty_leaves_.insert(slot);
+}
 
+void Pager::write_freelist(Meta &m, bool hold) {
+  // Held pages were listed when they were freed; once nothing is pinned
+  // they only have to become reusable.
+  if (!hold) {
+    free_pages_.insert(held_.begin(), held_.end());
+    held_.clear();
+  }
+  if (to_free_.empty() && dirty_leaves_.empty())
+    return;
+
+  // The directory and every leaf that changes move to new pages, so their
+  // old pages go on the list too, free once the new meta is in place.
+  std::vector<uint32_t> moved = freelist_dir_;
+  for (uint32_t slot : dirty_leaves_) {
+    FreeLeaf &leaf = free_leaves_[slot];
+    if (leaf.page != 0)
+      moved.push_back(leaf.page);
+    leaf.page = 0;
+  }
+  auto list = [this](uint32_t id, uint32_t slot) {
+    free_leaves_[slot].ids.push_back(id);
+    listed_[id] = slot;
+  };
+  for (uint32_t id : to_free_)
+    list(id, leaf_with_room(moved));
+  // leaf_with_room may move another leaf, adding to `moved`
+  for (size_t i = 0; i < moved.size(); i++)
+    list(moved[i], leaf_with_room(moved));
+
+  // allocations may have emptied a leaf
+  for (auto it = dirty_leaves_.begin(); it != dirty_leaves_.end();) {
+    if (free_leaves_[*it].ids.empty()) {
+      spare_slots_.push_back(*it);
+      it = dirty_leaves_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+  size_t leaves = 0;
+  for (uint32_t slot = 0; slot < free_leaves_.size(); slot++)
+    leaves += free_leaves_[slot].page != 0 || dirty_leaves_.count(slot) != 0;
+  size_t dirPages =
+      (leaves + FREELIST_IDS_PER_PAGE - 1) / FREELIST_IDS_PER_PAGE;
+
+  // New homes have to be pages the committed file doesn't reference: ids
+  // the changed leaves list that were free before this commit (without
+  // emptying a leaf, which would change the count), else past the end.
+  std::vector<uint32_t> homes;
+  size_t needed = dirty_leaves_.size() + dirPages;
+  for (uint32_t slot : dirty_leaves_) {
+    std::vector<uint32_t> &ids = free_leaves_[slot].ids;
+    for (size_t i = 0; i < ids.size() && ids.size() > 1;) {
+      if (homes.size() == needed)
+        break;
+      if (free_pages_.erase(ids[i]) == 0) {
+        i++;
+        continue;
+      }
+      homes.push_back(ids[i]);
+      listed_.erase(ids[i]);
+      ids[i] = ids.back();
+      ids.pop_back();
+    }
+  }
+  while (homes.size() < needed)
+    homes.push_back(m.next_page_id++);
+
+  auto home = homes.begin();
+  std::vector<uint32_t> leafPages;
+  for (uint32_t slot = 0; slot < free_leaves_.size(); slot++) {
+    FreeLeaf &leaf = free_leaves_[slot];
+    if (dirty_leaves_.count(slot) != 0) {
+      leaf.page = *home++;
+      write_freelist_page(leaf.page, {0, leaf.ids});
+    }
+    if (leaf.page != 0)
+      leafPages.push_back(leaf.page);
+  }
+  freelist_dir_.assign(home, homes.end());
+  for (size_t i = 0; i < freelist_dir_.size(); i++) {
     FreelistPage fp;
-    fp.next = 0;
-    fp.ids.push_back(pageId);
+    fp.next = i + 1 < freelist_dir_.size() ? freelist_dir_[i + 1] : 0;
+    auto first = leafPages.begin() + i * FREELIST_IDS_PER_PAGE;
+    fp.ids.assign(first, first + std::min<size_t>(FREELIST_IDS_PER_PAGE,
+                                                  leafPages.end() - first));
+    write_freelist_page(freelist_dir_[i], fp);
+  }
+  m.freelist_head = freelist_dir_.empty() ? 0 : freelist_dir_[0];
+  freelist_pages_ = freelist_dir_.size() + leafPages.size();
+
+  free_pages_.insert(moved.begin(), moved.end());
+  if (hold)
+    held_.insert(to_free_.begin(), to_free_.end());
+  else
+    free_pages_.insert(to_free_.begin(), to_free_.end());
+  dirty_leaves_.clear();
+}
 
-    write_freelist_page(new_head, fp);
-    meta_.freelist_head = new_head;
-    return;
+uint32_t Pager::leaf_with_room(std::vector<uint32_t> &moved) {
+  auto hasRoom = [this](uint32_t slot) {
+    return slot < free_leaves_.size() &&
+           free_leaves_[slot].ids.size() < FREELIST_IDS_PER_PAGE;
+  };
+  if (dirty_leaves_.count(fill_slot_) != 0 && hasRoom(fill_slot_))
+    return fill_slot_;
+  // a leaf that is being rewritten anyway
+  for (uint32_t slot : dirty_leaves_) {
+    if (hasRoom(slot))
+      return fill_slot_ = slot;
   }
+  // the leaf filled last, which moves now
+  if (hasRoom(fill_slot_) && free_leaves_[fill_slot_].page != 0) {
+    moved.push_back(free_leaves_[fill_slot_].page);
+    free_leaves_[fill_slot_].page = 0;
+    dirty_leaves_.insert(fill_slot_);
+    return fill_slot_;
+  }
+  if (spare_slots_.empty()) {
+    fill_slot_ = static_cast<uint32_t>(free_leaves_.size());
+    free_leaves_.emplace_back();
+  } else {
+    fill_slot_ = spare_slots_.back();
+    spare_slots_.pop_back();
+  }
+  dirty_leaves_.insert(fill_slot_);
+  return fill_slot_;
+}
 
-  std::vector<uint8_t> page = readPage(head);
-  uint32_t next, count;
-  memcpy(&next, page.data() + 0, sizeof(uint32_t));
-  memcpy(&count, page.data() + 4, sizeof(uint32_t));
+uint32_t Pager::shrinkFile() {
+  if (in_txn_)
+    throw std::runtime_error("shrinkFile: inside a transaction");
+  if (options_.readOnly)
+    throw std::runtime_error("Pager: opened read-only");
+  uint32_t before = meta_.next_page_id;
+
+  std::lock_guard<std::mutex> lock(snapshot_mu_);
+  Meta m = meta_;
+  m.txn_id += 1;
+
+  // The new list goes into the lowest pages that are free now; the pages
+  // of the committed one are free once the new meta is in place. Held
+  // pages stay listed, and stay where they are.
+  std::set<uint32_t> remaining = free_pages_;
+  remaining.insert(freelist_dir_.begin(), freelist_dir_.end());
+  for (const FreeLeaf &leaf : free_leaves_) {
+    if (leaf.page != 0)
+      remaining.insert(leaf.page);
+  }
 
-  if (count < per_page) {
-    // Append to existing head
-    size_t entry_offset = 8 + count * sizeof(uint32_t);
-    memcpy(page.data() + entry_offset, &pageId, sizeof(uint32_t));
+  std::vector<uint32_t> chain;
+  auto candidate = free_pages_.begin();
+  uint32_t fresh = m.next_page_id;
+  while (freelistPagesFor(remaining.size() + held_.size()) > chain.size()) {
+    uint32_t id = candidate != free_pages_.end() ? *candidate++ : fresh++;
+    remaining.erase(id);
+    chain.push_back(id);
+  }
+  m.next_page_id = std::max(m.next_page_id, fresh);
 
-    count++;
-    memcpy(page.data() + 4, &count, sizeof(uint32_t));
+  // free pages at the end of the file are dropped from the list
+  auto trim = [&] {
+    while (m.next_page_id > 1 && remaining.count(m.next_page_id - 1) != 0) {
+      remaining.erase(m.next_page_id - 1);
+      m.next_page_id--;
+    }
+  };
+  trim();
+  // That can leave more list pages than needed: hand the spare ones back,
+  // highest first, while what is left still holds the list. One at the
+  // end is trimmed straight away instead of being listed.
+  while (!chain.empty()) {
+    bool atEnd = chain.back() == m.next_page_id - 1;
+    size_t ids = remaining.size() + held_.size() + (atEnd ? 0 : 1);
+    if (freelistPagesFor(ids) > chain.size() - 1)
+      break;
+    remaining.insert(chain.back());
+    chain.pop_back();
+    trim();
+  }
 
-    pwrite_full(page.data(), BTREE_PAGE_SIZE, page_offset(head));
-    return;
+  std::vector<uint32_t> listed(remaining.begin(), remaining.end());
+  listed.insert(listed.end(), held_.begin(), held_.end());
+  std::sort(listed.begin(), listed.end());
+
+  // the directory comes first, its last page the first with no next
+  std::vector<uint32_t> dir;
+  std::vector<FreeLeaf> leaves;
+  bool inDir = true;
+  for (auto &[pageId, fp] : lay_out_freelist(chain, listed)) {
+    write_freelist_page(pageId, fp);
+    if (inDir)
+      dir.push_back(pageId);
+    else
+      leaves.push_back({pageId, std::move(fp.ids)});
+    inDir = inDir && fp.next != 0;
   }
+  m.freelist_head = chain.empty() ? 0 : chain[0];
+  write_meta_to_page(m);
+  storage_->sync();
 
-  uint32_t new_head = meta_.next_page_id++;
+  meta_ = m;
+  committed_ = m;
+  set_freelist(std::move(dir), std::move(leaves));
+  for (uint32_t id : held_)
+    free_pages_.erase(id);
+  shrink_file();
 
-  FreelistPage fp;
-  fp.next = head;
-  fp.ids.push_back(pageId);
+  return before - std::min(before, meta_.next_page_id);
+}
 
-  write_freelist_page(new_head, fp);
-  meta_.freelist_head = new_head;
+std::vector<std::pair<uint32_t, FreelistPage>>
+Pager::lay_out_freelist(const std::vector<uint32_t> &chain,
+                        const std::vector<uint32_t> &listed) {
+  const size_t cap = FREELIST_IDS_PER_PAGE;
+  size_t leaves = (listed.size() + cap - 1) / cap;
+  size_t dirs = (leaves + cap - 1) / cap;
+  // spare pages become empty leaves, which may need another directory page
+  while (chain.size() - dirs > dirs * cap)
+    dirs++;
+  assert(chain.size() >= dirs + leaves);
+
+  std::vector<std::pair<uint32_t, FreelistPage>> pages;
+  for (size_t i = 0; i < dirs; i++) {
+    FreelistPage fp;
+    fp.next = i + 1 < dirs ? chain[i + 1] : 0;
+    size_t first = dirs + i * cap;
+    fp.ids.assign(chain.begin() + first,
+                  chain.begin() + std::min(chain.size(), first + cap));
+    pages.push_back({chain[i], std::move(fp)});
+  }
+  for (size_t i = dirs; i < chain.size(); i++) {
+    FreelistPage fp{0, {}};
+    size_t first = std::min(listed.size(), (i - dirs) * cap);
+    fp.ids.assign(listed.begin() + first,
+                  listed.begin() + std::min(listed.size(), first + cap));
+    pages.push_back({chain[i], std::move(fp)});
+  }
+  return pages;
+}
+
+void Pager::shrink_file() {
+  uint64_t want = page_offset(std::max<uint32_t>(meta_.next_page_id, 2));
+  uint64_t size = storage_->size();
+  if (size <= want)
+    return;
+
+  storage_->resize(want);
+  if (cache_) {
+    uint32_t end = static_cast<uint32_t>(size / BTREE_PAGE_SIZE);
+    for (uint32_t id = meta_.next_page_id; id < end; id++)
+      cache_->erase(id);
+  }
 }
 
 void Pager::write_freelist_page(uint32_t pageId, const FreelistPage &fp) {
-  std::vector<uint8_t> page(BTREE_PAGE_SIZE, 0);
+  PageBuffer page(BTREE_PAGE_SIZE, 0);
+  format_freelist_page(page.data(), fp);
+  write_page(pageId, page);
+}
 
+void Pager::format_freelist_page(uint8_t *page, const FreelistPage &fp) {
   uint32_t next = fp.next;
   uint32_t count = fp.ids.size();
 
-  memcpy(page.data() + 0, &next, sizeof(uint32_t));
-  memcpy(page.data() + 4, &count, sizeof(uint32_t));
+  memcpy(page + 0, &next, sizeof(uint32_t));
+  memcpy(page + 4, &count, sizeof(uint32_t));
 
-  const size_t entry_offset = 8;
+  const size_t entry_offset = FREELIST_HEADER_SIZE;
   for (uint32_t i = 0; i < count; ++i) {
-    memcpy(page.data() + entry_offset + i * sizeof(uint32_t), &fp.ids[i],
+    memcpy(page + entry_offset + i * sizeof(uint32_t), &fp.ids[i],
            sizeof(uint32_t));
   }
-
-  ensure_file_size_for_page(pageId);
-  pwrite_full(page.data(), BTREE_PAGE_SIZE, page_offset(pageId));
 }
 
 void Pager::write_meta_to_page(const Meta &m) {
-  std::vector<uint8_t> page(BTREE_PAGE_SIZE, 0);
+  PageBuffer page(BTREE_PAGE_SIZE, 0);
   std::memcpy(page.data(), &m, sizeof(Meta));
-  ensure_file_size_for_page(0);
-  pwrite_full(page.data(), BTREE_PAGE_SIZE, page_offset(0));
+  write_page(0, page);
 }
 
 void Pager::write_dirty_pages() {
   for (auto &kv : dirty_pages_) {
     uint32_t pid = kv.first;
-    const std::vector<uint8_t> &buf = kv.second;
+    PageBuffer &buf = kv.second;
     if (buf.size() != BTREE_PAGE_SIZE)
       throw std::runtime_error("internal: dirty page size mismatch");
-    ensure_file_size_for_page(pid);
-    pwrite_full(buf.data(), BTREE_PAGE_SIZE, page_offset(pid));
+    write_page(pid, buf);
   }
 }
 
-void Pager::sync_fd() {
-  if (fd_ >= 0) {
-    if (fsync(fd_) != 0)
-      throw std::runtime_error("fsync failed");
-  }
+void Pager::write_page(uint32_t pageId, PageBuffer &page) {
+  seal_page(page.data());
+  ensure_file_size_for_page(pageId);
+  storage_->write(page.data(), BTREE_PAGE_SIZE, page_offset(pageId));
+  // the meta page is only ever read by load_meta, so it isn't cached
+  if (cache_ && pageId != 0)
+    cache_->put(pageId, page);
 }
 
-void Pager::pread_full(uint8_t *buf, size_t bytes, off_t offset) const {
-  size_t got = 0;
-  while (got < bytes) {
-    ssize_t r =
-        ::pread(fd_, buf + got, bytes - got, offset + static_cast<off_t>(got));
-    if (r < 0)
-      throw std::runtime_error("pread failed");
-    if (r == 0)
-      throw std::runtime_error("pread EOF");
-    got += static_cast<size_t>(r);
-  }
+void Pager::seal_page(uint8_t *page) {
+  uint32_t crc = crc32c(page, BTREE_PAGE_USABLE_SIZE);
+  memcpy(page + BTREE_PAGE_USABLE_SIZE, &crc, sizeof(uint32_t));
 }
 
-void Pager::pwrite_full(const uint8_t *buf, size_t bytes, off_t offset) {
-  size_t written = 0;
-  while (written < bytes) {
-    ssize_t r = ::pwrite(fd_, buf + written, bytes - written,
-                         offset + static_cast<off_t>(written));
-    if (r < 0)
-      throw std::runtime_error("pwrite failed");
-    written += static_cast<size_t>(r);
-  }
+bool Pager::verify_page(const uint8_t *page) {
+  uint32_t stored;
+  memcpy(&stored, page + BTREE_PAGE_USABLE_SIZE, sizeof(uint32_t));
+  return stored == crc32c(page, BTREE_PAGE_USABLE_SIZE);
 }
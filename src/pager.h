@@ -2,10 +2,17 @@
 
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #include <cstdint>
 #include <cstring>
+#include <exception>
 #include <fcntl.h>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <set>
 #include <stdexcept>
 #include <string>
 #include <sys/stat.h>
@@ -14,7 +21,34 @@
 #include <unordered_map>
 #include <vector>
 
+#include "async_reader.h"
+#include "checksum.h"
 #include "common.h"
+#include "page_cache.h"
+#include "page_pool.h"
+#include "storage.h"
+
+// Thrown when a page read from disk doesn't match the checksum in its
+// trailer (bit rot, torn write, or a file that isn't ours).
+class ChecksumError : public std::runtime_error {
+public:
+  explicit ChecksumError(uint32_t pageId)
+      : std::runtime_error("checksum mismatch on page " +
+                           std::to_string(pageId)),
+        pageId_(pageId) {}
+
+  uint32_t pageId() const { return pageId_; }
+
+private:
+  uint32_t pageId_;
+};
+
+// Thrown when a file's meta page isn't one this version of the pager
+// reads: another file format version, or not a dbite file at all.
+class FormatError : public std::runtime_error {
+public:
+  explicit FormatError(const std::string &what) : std::runtime_error(what) {}
+};
 
 struct Meta {
   uint64_t magic;
@@ -22,8 +56,11 @@ struct Meta {
   uint32_t root_page;
   uint32_t next_page_id;
   uint32_t freelist_head;
-  // 2 * 8 + 3 * 4 = 28
-  uint8_t reserved[BTREE_PAGE_SIZE - 28];
+  uint32_t key_order; // KEY_ORDER_*, 0 (bytewise) in older files
+  uint32_t flags;     // META_FLAG_*, 0 in older files
+  // 2 * 8 + 5 * 4 = 36
+  // the last PAGE_TRAILER_SIZE bytes of reserved hold the page checksum
+  uint8_t reserved[BTREE_PAGE_SIZE - 36];
 };
 
 struct FreelistPage {
@@ -31,20 +68,128 @@ struct FreelistPage {
   std::vector<uint32_t> ids;
 };
 
+struct PagerOptions {
+  // open the file with O_DIRECT: reads and writes bypass the kernel page
+  // cache, so pages are cached only by the pager's own cache below
+  bool directIO = false;
+  // clean pages kept in the pager's LRU cache; 0 turns it off
+  size_t cachePages = 0;
+  // bounds how many readPageAsync calls are in flight at once
+  size_t ioThreads = 8;
+  // STORAGE_FILE keeps the pages in the file at path. STORAGE_MEMORY keeps
+  // them in the memory file of that name (see MemoryBackend), with the
+  // same transactions but no durability and no I/O; directIO is ignored.
+  uint8_t storage = STORAGE_DEFAULT;
+  // memory storage: map it from huge pages where the system has them
+  bool hugePages = false;
+  // Hot-page manifest, off when 0. The pager counts the reads of each page
+  // and keeps the ids of the internal nodes read plus this many of the most
+  // read leaves in a sidecar file, path + ".hot", rewritten every
+  // hotManifestInterval commits and when the pager closes. On open the
+  // pages it lists are prefetched in page order, so a restarted process
+  // doesn't pay a cold read on each of them. File storage only.
+  size_t hotManifestLeaves = 0;
+  uint32_t hotManifestInterval = 64;
+  // Open an existing database without ever writing to it: the file is
+  // neither created nor resized, a missing or blank meta page is an error
+  // rather than a new database, no manifest is kept, and beginTxn throws.
+  bool readOnly = false;
+};
+
 class Pager {
 public:
-  explicit Pager(const std::string &path);
+  explicit Pager(const std::string &path, PagerOptions options = {});
   ~Pager();
 
-  std::vector<uint8_t> readPage(uint32_t pageId) const;
+  // What STORAGE_DEFAULT means for pagers opened from now on: STORAGE_FILE
+  // unless changed, e.g. by a test run that sets it from its environment.
+  static void setDefaultStorage(uint8_t storage);
+  static uint8_t defaultStorage();
+  // whether a pager opened with options would find existing pages at path
+  static bool exists(const std::string &path, const PagerOptions &options);
+
+  // Reads a B-tree node. With a hot-page manifest kept, the read counts
+  // toward it, by the node type in the page's first byte.
+  PageBuffer readPage(uint32_t pageId) const;
+
+  // Reads a page on the pager's I/O threads. Dirty pages complete right
+  // away from memory; the rest are read and verified in the background, so
+  // a caller can keep many reads outstanding. Errors (e.g. ChecksumError)
+  // surface through the future or the callback's exception_ptr; callbacks
+  // run on an I/O thread and must not throw. The pages must not be changed
+  // by a write transaction while reads are pending.
+  using ReadCallback =
+      std::function<void(PageBuffer page, std::exception_ptr error)>;
+  std::future<PageBuffer> readPageAsync(uint32_t pageId) const;
+  void readPageAsync(uint32_t pageId, ReadCallback done) const;
 
-  uint32_t createPage(const std::vector<uint8_t> &data);
+  // New pages reuse a free page when there is one: the lowest free id, or
+  // with a nearPage hint (e.g. the parent or left sibling) the free id
+  // closest to it, so related pages stay close together in the file.
+  uint32_t createPage(const PageBuffer &data, uint32_t nearPage = 0);
+  // takes the buffer over as the page's dirty copy instead of copying it
+  uint32_t createPage(PageBuffer &&data, uint32_t nearPage = 0);
 
   bool deletePage(uint32_t pageId);
 
-  void beginTxn();  // optional: resets the transaction workspace
-  void commitTxn(); // write dirty pages, freelist, meta, then fsync
-  void abortTxn();  // drop in-memory dirty buffers and pending frees
+  // Asks the kernel to start reading these pages in the background
+  // (posix_fadvise WILLNEED) so later readPage calls hit the page cache.
+  // Dirty pages are skipped and runs of adjacent ids go out as one hint.
+  void prefetch(std::vector<uint32_t> pageIds) const;
+
+  // The last committed state of the file, as pinned by pinSnapshot.
+  struct Snapshot {
+    uint64_t txnId;
+    uint32_t rootPage;
+    uint32_t nextPageId;
+    uint8_t keyOrder;
+    uint32_t flags;
+  };
+
+  // Pins the last committed state: pages freed by later commits are held
+  // back from reuse (and from truncation) until every pin is released, so
+  // another thread can keep reading the snapshot's pages with
+  // readCommittedPage while write transactions go on. Held pages become
+  // free at the first commit after the last unpin.
+  Snapshot pinSnapshot();
+  void unpinSnapshot();
+
+  // reads a committed page, bypassing the transaction's dirty pages; safe
+  // to call from any thread
+  PageBuffer readCommittedPage(uint32_t pageId) const;
+
+  // Writes a standalone database file holding the snapshot to fd: `pages`
+  // are the ids reachable from snap.rootPage, in ascending order. Pages are
+  // streamed in page order, in large sequential writes, and the meta page
+  // goes last, followed by an fsync. Without `compact` every page keeps its
+  // id and the unreachable ones go on the copy's freelist; with it the
+  // pages are renumbered 1..n in the same order (pages[i] becomes page
+  // i + 1), and relink(id, page) is called on each one before it is
+  // written, to redirect its child pointers; the page is resealed after.
+  void exportSnapshot(
+      int fd, const Snapshot &snap, const std::vector<uint32_t> &pages,
+      bool compact,
+      const std::function<void(uint32_t, uint8_t *)> &relink) const;
+
+  // Transactions nest: an inner commitTxn only closes its level, and the
+  // outermost one writes the dirty pages, the freelist leaves it changed
+  // and meta, then fsyncs. A transaction that changed nothing writes
+  // nothing. abortTxn drops the dirty buffers and pending frees of the
+  // whole transaction, whatever the nesting.
+  void beginTxn();
+  void commitTxn();
+  void abortTxn();
+  inline bool inTxn() const { return in_txn_; }
+  inline size_t txnDepth() const { return txn_depth_; }
+
+  // Commits a freelist rewritten from scratch into the lowest free pages
+  // and cuts the free pages at the end off the file; returns how many
+  // pages it dropped. This costs O(free pages), so commits leave the tail
+  // alone and compaction calls it once it has moved the live pages down.
+  // Not allowed inside a transaction.
+  uint32_t shrinkFile();
+  // pages a freelist listing `ids` page ids takes up
+  static size_t freelistPagesFor(size_t ids);
 
   inline uint64_t currentTxnId() const { return meta_.txn_id; }
 
@@ -52,34 +197,136 @@ public:
   inline void setRootPage(uint32_t newRoot) { meta_.root_page = newRoot; }
 
   inline uint32_t nextPageId() const { return meta_.next_page_id; }
+  // bytes the file (or memory file) takes up
+  inline uint64_t fileSize() const { return storage_->size(); }
+  inline size_t freePageCount() const { return free_pages_.size(); }
+  inline size_t freelistPageCount() const { return freelist_pages_; }
+  // pages freed while a snapshot was pinned, listed but not yet reusable
+  size_t heldPageCount() const;
+
+  // The hot-page manifest as it would be written now: the internal nodes
+  // read since the pager opened and the most read leaves, ascending.
+  std::vector<uint32_t> hotPages() const;
+  // writes hotPages() to the manifest; does nothing when it is off
+  void writeHotManifest();
+  // the pages the manifest listed at open, which were prefetched
+  inline const std::vector<uint32_t> &warmUpPages() const {
+    return warm_up_pages_;
+  }
+
+  inline const PagerOptions &options() const { return options_; }
+  PageCache::Stats cacheStats() const;
+
+  inline uint8_t keyOrder() const { return meta_.key_order; }
+  inline void setKeyOrder(uint8_t order) { meta_.key_order = order; }
+
+  inline uint32_t metaFlags() const { return meta_.flags; }
+  inline void setMetaFlags(uint32_t flags) { meta_.flags = flags; }
 
 private:
-  int fd_;
+  // shared with every pager that has the same memory file open
+  std::shared_ptr<StorageBackend> storage_;
   std::string path_;
   Meta meta_;
 
+  PagerOptions options_;
+  std::unique_ptr<PageCache> cache_; // null when cachePages is 0
+  mutable std::once_flag reader_once_;
+  mutable std::unique_ptr<AsyncReader> reader_; // started on first async read
+
+  // reads per page for the hot-page manifest, once the pager is open
+  struct PageReads {
+    uint64_t reads = 0;
+    bool internal = false;
+  };
+  bool track_reads_ = false;
+  mutable std::mutex hot_mu_;
+  mutable std::unordered_map<uint32_t, PageReads> hot_reads_;
+  uint32_t commits_since_manifest_ = 0;
+  std::vector<uint32_t> warm_up_pages_;
+
   bool in_txn_ = false;
-  std::unordered_map<uint32_t, std::vector<uint8_t>> dirty_pages_;
+  size_t txn_depth_ = 0;
+  std::unordered_map<uint32_t, PageBuffer> dirty_pages_;
   std::vector<uint32_t> to_free_;
 
-  void open_or_create_file();
+  // One leaf of the freelist. `page` is 0 while the leaf has changed and
+  // is waiting for the commit to write it somewhere new.
+  struct FreeLeaf {
+    uint32_t page = 0;
+    std::vector<uint32_t> ids;
+  };
+
+  std::set<uint32_t> free_pages_; // free and safe to reuse now
+  // the freelist as committed plus this transaction's changes: leaves by
+  // slot, the slot listing each id, and the directory pages
+  std::vector<FreeLeaf> free_leaves_;
+  std::vector<uint32_t> spare_slots_;
+  std::unordered_map<uint32_t, uint32_t> listed_;
+  std::vector<uint32_t> freelist_dir_;
+  std::set<uint32_t> dirty_leaves_; // slots this transaction took ids from
+  uint32_t fill_slot_ = 0;          // where the last listed id went
+  size_t freelist_pages_ = 0;
+
+  // guards the snapshot state below, which other threads pin and read
+  mutable std::mutex snapshot_mu_;
+  Meta committed_;          // meta_ as of the last commit
+  size_t pins_ = 0;         // snapshots pinned right now
+  std::set<uint32_t> held_; // freed while pinned; listed on disk, not reused
+
+  void open_storage();
+
+  inline std::string manifest_path() const { return path_ + ".hot"; }
+  void note_read(uint32_t pageId, const PageBuffer &page) const;
+  // prefetches the pages of a valid manifest, if there is one
+  void warm_up();
+
+  // readPage minus the dirty-page lookup; safe to call from any thread
+  PageBuffer read_clean_page(uint32_t pageId) const;
+  PageBuffer read_page_from_file(uint32_t pageId) const;
+  AsyncReader &reader() const;
 
   void load_meta();
   void write_meta_to_page(const Meta &m);
 
   void ensure_file_size_for_page(uint32_t pageId);
 
-  inline off_t page_offset(uint32_t pageId) const {
-    return static_cast<off_t>(pageId) * BTREE_PAGE_SIZE;
+  inline uint64_t page_offset(uint32_t pageId) const {
+    return static_cast<uint64_t>(pageId) * BTREE_PAGE_SIZE;
   }
 
-  std::optional<uint32_t> alloc_from_freelist();
-  void push_to_freelist(uint32_t pageId);
+  // seals the page and writes it out, keeping the cache in step
+  void write_page(uint32_t pageId, PageBuffer &page);
+
+  // compute / check the CRC32C trailer of a BTREE_PAGE_SIZE buffer
+  static void seal_page(uint8_t *page);
+  static bool verify_page(const uint8_t *page);
+
+  uint32_t next_free_page_id(uint32_t nearPage);
+  // Free pages live in memory, ordered by id so the one nearest a hint (or
+  // the lowest, without one) is a tree lookup away. On disk each commit
+  // moves only the leaves it changed to pages that were free before it,
+  // then writes a new directory, so a crash before the meta write leaves
+  // the old list intact and a commit costs what it changed, not the size
+  // of the list.
+  void load_freelist();
+  void set_freelist(std::vector<uint32_t> dir, std::vector<FreeLeaf> leaves);
+  std::optional<uint32_t> alloc_from_freelist(uint32_t nearPage);
+  void unlist(uint32_t id);
+  void write_freelist(Meta &m, bool hold);
+  uint32_t leaf_with_room(std::vector<uint32_t> &moved);
   void write_freelist_page(uint32_t pageId, const FreelistPage &fp);
+  static void format_freelist_page(uint8_t *page, const FreelistPage &fp);
+  // Lays `listed` out over `chain`: directory pages first, then leaves, as
+  // many ids per leaf as fit. chain must hold at least
+  // freelistPagesFor(listed.size()) pages.
+  static std::vector<std::pair<uint32_t, FreelistPage>>
+  lay_out_freelist(const std::vector<uint32_t> &chain,
+                   const std::vector<uint32_t> &listed);
+  void shrink_file();
 
   void write_dirty_pages();
-  void sync_fd();
 
-  void pread_full(uint8_t *buf, size_t bytes, off_t offset) const;
-  void pwrite_full(const uint8_t *buf, size_t bytes, off_t offset);
+  // StorageBackend::willNeed over each run of adjacent ids in sorted pageIds
+  void advise_runs(const std::vector<uint32_t> &pageIds) const;
 };
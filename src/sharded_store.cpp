@@ -0,0 +1,205 @@
+#include "sharded_store.h"
+
+#include <algorithm>
+#include <exception>
+#include <stdexcept>
+
+namespace {
+
+constexpr uint64_t FNV_OFFSET = 0xCBF29CE484222325ull;
+constexpr uint64_t FNV_PRIME = 0x100000001B3ull;
+
+// Routing hash: FNV-1a with a splitmix64 finalizer. Which shard holds a
+// key depends on it, so it is part of the file layout and must never
+// change.
+uint64_t routeHash(const std::vector<uint8_t> &key) {
+  uint64_t h = FNV_OFFSET;
+  for (uint8_t b : key)
+    h = (h ^ b) * FNV_PRIME;
+  h ^= h >> 30;
+  h *= 0xBF58476D1CE4E5B9ull;
+  h ^= h >> 27;
+  h *= 0x94D049BB133111EBull;
+  h ^= h >> 31;
+  return h;
+}
+
+std::string shardPath(const std::string &path, size_t i) {
+  return path + "." + std::to_string(i);
+}
+
+// waits for every future, then rethrows the first error among them
+template <typename T>
+std::vector<T> collect(std::vector<std::future<T>> &futures) {
+  std::vector<T> results;
+  std::exception_ptr error;
+  for (auto &f : futures) {
+    try {
+      results.push_back(f.get());
+    } catch (...) {
+      if (!error)
+        error = std::current_exception();
+    }
+  }
+  if (error)
+    std::rethrow_exception(error);
+  return results;
+}
+
+} // namespace
+
+ShardedStore::ShardedStore(const std::string &path, size_t shards,
+                           ShardedStoreOptions options)
+    : splitKeys_(std::move(options.splitKeys)) {
+  if (shards == 0)
+    throw std::invalid_argument("ShardedStore: no shards");
+  if (!splitKeys_.empty()) {
+    if (splitKeys_.size() != shards - 1)
+      throw std::invalid_argument("ShardedStore: need shards - 1 split keys");
+    for (size_t i = 1; i < splitKeys_.size(); i++) {
+      if (keyCompare(splitKeys_[i - 1], splitKeys_[i]) >= 0)
+        throw std::invalid_argument("ShardedStore: split keys out of order");
+    }
+  }
+
+  // a store opened with another shard count would route keys elsewhere
+  size_t existing = 0;
+  for (size_t i = 0; i < shards; i++)
+    existing += Pager::exists(shardPath(path, i), options.pager);
+  if ((existing != 0 && existing != shards) ||
+      Pager::exists(shardPath(path, shards), options.pager))
+    throw std::invalid_argument("ShardedStore: files don't match the shard "
+                                "count");
+
+  shards_.resize(shards);
+  for (size_t i = 0; i < shards; i++) {
+    Shard &s = shards_[i];
+    s.pager = std::make_shared<Pager>(shardPath(path, i), options.pager);
+    s.tree = std::make_unique<BTree>(s.pager, options.tree);
+    s.worker = std::make_unique<Worker>();
+  }
+}
+
+// the workers finish what was queued before the trees close
+ShardedStore::~ShardedStore() {
+  for (Shard &s : shards_)
+    s.worker.reset();
+}
+
+size_t ShardedStore::shardOf(const std::vector<uint8_t> &key) const {
+  if (splitKeys_.empty())
+    return routeHash(key) % shards_.size();
+  auto it = std::upper_bound(
+      splitKeys_.begin(), splitKeys_.end(), key,
+      [](const std::vector<uint8_t> &a, const std::vector<uint8_t> &b) {
+        return keyCompare(a, b) < 0;
+      });
+  return it - splitKeys_.begin();
+}
+
+std::vector<std::vector<size_t>> ShardedStore::groupByShard(
+    const std::vector<std::vector<uint8_t>> &keys) const {
+  std::vector<std::vector<size_t>> groups(shards_.size());
+  for (size_t i = 0; i < keys.size(); i++)
+    groups[shardOf(keys[i])].push_back(i);
+  return groups;
+}
+
+void ShardedStore::insert(const std::vector<uint8_t> &key,
+                          const std::vector<uint8_t> &value) {
+  runOn(shardOf(key), [&](BTree &tree) { tree.insert(key, value); }).get();
+}
+
+bool ShardedStore::remove(const std::vector<uint8_t> &key) {
+  return runOn(shardOf(key), [&](BTree &tree) { return tree.remove(key); })
+      .get();
+}
+
+std::optional<std::vector<uint8_t>>
+ShardedStore::search(const std::vector<uint8_t> &key) const {
+  return runOn(shardOf(key), [&](BTree &tree) { return tree.search(key); })
+      .get();
+}
+
+void ShardedStore::insertBatch(const std::vector<Entry> &entries) {
+  std::vector<std::vector<size_t>> groups(shards_.size());
+  for (size_t i = 0; i < entries.size(); i++)
+    groups[shardOf(entries[i].first)].push_back(i);
+
+  std::vector<std::future<bool>> done;
+  for (size_t s = 0; s < shards_.size(); s++) {
+    if (groups[s].empty())
+      continue;
+    const std::vector<size_t> &group = groups[s];
+    done.push_back(runOn(s, [&entries, &group](BTree &tree) {
+      tree.pager_->beginTxn();
+      try {
+        for (size_t i : group)
+          tree.insert(entries[i].first, entries[i].second);
+        tree.pager_->commitTxn();
+        tree.rebuildFilterIfDue();
+      } catch (...) {
+        tree.abortBatch();
+        throw;
+      }
+      return true;
+    }));
+  }
+  collect(done);
+}
+
+size_t
+ShardedStore::removeBatch(const std::vector<std::vector<uint8_t>> &keys) {
+  std::vector<std::vector<size_t>> groups = groupByShard(keys);
+
+  std::vector<std::future<size_t>> done;
+  for (size_t s = 0; s < shards_.size(); s++) {
+    if (groups[s].empty())
+      continue;
+    const std::vector<size_t> &group = groups[s];
+    done.push_back(runOn(s, [&keys, &group](BTree &tree) {
+      size_t removed = 0;
+      tree.pager_->beginTxn();
+      try {
+        for (size_t i : group)
+          removed += tree.remove(keys[i]);
+        tree.pager_->commitTxn();
+        tree.rebuildFilterIfDue();
+      } catch (...) {
+        tree.abortBatch();
+        throw;
+      }
+      return removed;
+    }));
+  }
+  size_t removed = 0;
+  for (size_t n : collect(done))
+    removed += n;
+  return removed;
+}
+
+std::vector<std::optional<std::vector<uint8_t>>>
+ShardedStore::multiSearch(const std::vector<std::vector<uint8_t>> &keys) const {
+  std::vector<std::vector<size_t>> groups = groupByShard(keys);
+  std::vector<std::optional<std::vector<uint8_t>>> results(keys.size());
+
+  std::vector<std::future<bool>> done;
+  for (size_t s = 0; s < shards_.size(); s++) {
+    if (groups[s].empty())
+      continue;
+    const std::vector<size_t> &group = groups[s];
+    done.push_back(runOn(s, [&keys, &group, &results](BTree &tree) {
+      std::vector<std::vector<uint8_t>> mine;
+      mine.reserve(group.size());
+      for (size_t i : group)
+        mine.push_back(keys[i]);
+      auto found = tree.multiSearch(mine);
+      // each worker writes only its own keys' slots
+      for (size_t j = 0; j < group.size(); j++)
+        results[group[j]] = std::move(found[j]);
+      return true;
+    }));
+  }
+  collect(done);
+  return results;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "btree.h"
+#include "pager.h"
+#include "worker.h"
+
+struct ShardedStoreOptions {
+  // applied to every shard's pager and tree
+  PagerOptions pager;
+  BTreeOptions tree;
+  // Range routing: shard i holds the keys from splitKeys[i - 1] (bytewise,
+  // inclusive) up to splitKeys[i]; there must be one fewer than there are
+  // shards, in ascending order. Empty: keys are routed by hash.
+  std::vector<std::vector<uint8_t>> splitKeys;
+};
+
+// Keys spread over N trees, each in its own file (path.0 .. path.N-1) with
+// its own pager, so writes to different shards don't queue behind one
+// dirty-page map and one fsync. Each shard is driven by a worker thread
+// that runs all of its operations in submission order; calls block until
+// their shard's work is done.
+//
+// Batches are split by shard and applied by the workers in parallel, each
+// shard's part in one transaction with one fsync. A batch is atomic per
+// shard only: if one shard fails the others may still have committed.
+// The shard count and routing are not recorded, so a store has to be
+// opened the way it was created. Hash routing uses its own fixed hash for
+// that reason; it must not follow changes to any other hash in the tree.
+class ShardedStore {
+public:
+  using Entry = std::pair<std::vector<uint8_t>, std::vector<uint8_t>>;
+
+  ShardedStore(const std::string &path, size_t shards,
+               ShardedStoreOptions options = {});
+  ~ShardedStore();
+
+  ShardedStore(const ShardedStore &) = delete;
+  ShardedStore &operator=(const ShardedStore &) = delete;
+
+  size_t shardCount() const { return shards_.size(); }
+  size_t shardOf(const std::vector<uint8_t> &key) const;
+
+  void insert(const std::vector<uint8_t> &key,
+              const std::vector<uint8_t> &value);
+  bool remove(const std::vector<uint8_t> &key);
+  std::optional<std::vector<uint8_t>>
+  search(const std::vector<uint8_t> &key) const;
+
+  void insertBatch(const std::vector<Entry> &entries);
+  // returns how many of the keys were there
+  size_t removeBatch(const std::vector<std::vector<uint8_t>> &keys);
+  // results in the order of keys; each shard looks up its share with
+  // BTree::multiSearch
+  std::vector<std::optional<std::vector<uint8_t>>>
+  multiSearch(const std::vector<std::vector<uint8_t>> &keys) const;
+
+private:
+  struct Shard {
+    std::shared_ptr<Pager> pager;
+    std::unique_ptr<BTree> tree;
+    // declared last so it is joined before the tree goes away
+    std::unique_ptr<Worker> worker;
+  };
+
+  // runs fn(tree) on the shard's worker
+  template <typename Fn>
+  auto runOn(size_t shard, Fn fn) const
+      -> std::future<decltype(fn(std::declval<BTree &>()))> {
+    BTree *tree = shards_[shard].tree.get();
+    return shards_[shard].worker->run(
+        [fn = std::move(fn), tree] { return fn(*tree); });
+  }
+
+  // indexes of keys grouped by shard
+  std::vector<std::vector<size_t>>
+  groupByShard(const std::vector<std::vector<uint8_t>> &keys) const;
+
+  std::vector<std::vector<uint8_t>> splitKeys_;
+  std::vector<Shard> shards_;
+};
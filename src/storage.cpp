@@ -0,0 +1,213 @@
+#include "storage.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <mutex>
+#include <new>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+FileBackend::FileBackend(const std::string &path, bool directIO,
+                         bool readOnly)
+    : readOnly_(readOnly) {
+  int flags = readOnly ? O_RDONLY : O_RDWR | O_CREAT;
+  if (directIO)
+    flags |= O_DIRECT;
+  fd_ = ::open(path.c_str(), flags, 0644);
+  if (fd_ == -1 && directIO && errno == EINVAL)
+    throw std::runtime_error("O_DIRECT not supported for " + path);
+  if (fd_ == -1)
+    throw std::runtime_error("open failed: " + path);
+}
+
+FileBackend::~FileBackend() { ::close(fd_); }
+
+void FileBackend::read(uint8_t *buf, size_t bytes, uint64_t offset) const {
+  size_t got = 0;
+  while (got < bytes) {
+    ssize_t r = ::pread(fd_, buf + got, bytes - got,
+                        static_cast<off_t>(offset + got));
+    if (r < 0)
+      throw std::runtime_error("pread failed");
+    if (r == 0)
+      throw std::runtime_error("pread EOF");
+    got += static_cast<size_t>(r);
+  }
+}
+
+void FileBackend::checkWritable() const {
+  if (readOnly_)
+    throw std::runtime_error("write to a file opened read-only");
+}
+
+void FileBackend::write(const uint8_t *buf, size_t bytes, uint64_t offset) {
+  checkWritable();
+  size_t written = 0;
+  while (written < bytes) {
+    ssize_t r = ::pwrite(fd_, buf + written, bytes - written,
+                         static_cast<off_t>(offset + written));
+    if (r < 0)
+      throw std::runtime_error("pwrite failed");
+    written += static_cast<size_t>(r);
+  }
+}
+
+uint64_t FileBackend::size() const {
+  struct stat st;
+  if (fstat(fd_, &st) != 0)
+    throw std::runtime_error("fstat failed");
+  return static_cast<uint64_t>(st.st_size);
+}
+
+void FileBackend::resize(uint64_t size) {
+  checkWritable();
+  if (ftruncate(fd_, static_cast<off_t>(size)) != 0)
+    throw std::runtime_error("ftruncate failed");
+}
+
+void FileBackend::sync() {
+  checkWritable();
+  if (fsync(fd_) != 0)
+    throw std::runtime_error("fsync failed");
+}
+
+void FileBackend::willNeed(uint64_t offset, uint64_t bytes) const {
+  // only a hint; failures are harmless
+  (void)posix_fadvise(fd_, static_cast<off_t>(offset),
+                      static_cast<off_t>(bytes), POSIX_FADV_WILLNEED);
+}
+
+namespace {
+
+std::mutex &registryMutex() {
+  static std::mutex m;
+  return m;
+}
+
+std::map<std::string, std::shared_ptr<MemoryBackend>> &registry() {
+  static std::map<std::string, std::shared_ptr<MemoryBackend>> files;
+  return files;
+}
+
+} // namespace
+
+MemoryBackend::MemoryBackend(bool hugePages) : hugePages_(hugePages) {}
+
+MemoryBackend::~MemoryBackend() {
+  for (uint8_t *chunk : chunks_)
+    munmap(chunk, CHUNK_SIZE);
+}
+
+std::shared_ptr<MemoryBackend> MemoryBackend::open(const std::string &path,
+                                                   bool hugePages) {
+  std::lock_guard<std::mutex> lock(registryMutex());
+  auto &file = registry()[path];
+  if (!file)
+    file = std::make_shared<MemoryBackend>(hugePages);
+  return file;
+}
+
+bool MemoryBackend::exists(const std::string &path) {
+  std::lock_guard<std::mutex> lock(registryMutex());
+  return registry().count(path) != 0;
+}
+
+bool MemoryBackend::remove(const std::string &path) {
+  std::lock_guard<std::mutex> lock(registryMutex());
+  return registry().erase(path) != 0;
+}
+
+void MemoryBackend::read(uint8_t *buf, size_t bytes, uint64_t offset) const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  if (offset + bytes > size_)
+    throw std::runtime_error("memory read past the end");
+  while (bytes > 0) {
+    size_t within = offset % CHUNK_SIZE;
+    size_t n = std::min(bytes, CHUNK_SIZE - within);
+    memcpy(buf, chunks_[offset / CHUNK_SIZE] + within, n);
+    buf += n;
+    offset += n;
+    bytes -= n;
+  }
+}
+
+void MemoryBackend::write(const uint8_t *buf, size_t bytes, uint64_t offset) {
+  auto copy = [&] {
+    while (bytes > 0) {
+      size_t within = offset % CHUNK_SIZE;
+      size_t n = std::min(bytes, CHUNK_SIZE - within);
+      memcpy(chunks_[offset / CHUNK_SIZE] + within, buf, n);
+      buf += n;
+      offset += n;
+      bytes -= n;
+    }
+  };
+
+  // readers only wait while the chunk table grows
+  {
+    std::shared_lock<std::shared_mutex> lock(mutex_);
+    if (offset + bytes <= size_) {
+      copy();
+      return;
+    }
+  }
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  if (offset + bytes > size_)
+    resizeLocked(offset + bytes);
+  copy();
+}
+
+uint64_t MemoryBackend::size() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return size_;
+}
+
+void MemoryBackend::resize(uint64_t size) {
+  std::unique_lock<std::shared_mutex> lock(mutex_);
+  resizeLocked(size);
+}
+
+void MemoryBackend::resizeLocked(uint64_t size) {
+  size_t want = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+  while (chunks_.size() < want) {
+    void *p = MAP_FAILED;
+    bool huge = false;
+    if (hugePages_) {
+      p = mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+      huge = p != MAP_FAILED;
+    }
+    if (p == MAP_FAILED) {
+      p = mmap(nullptr, CHUNK_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (p == MAP_FAILED)
+        throw std::bad_alloc();
+      if (hugePages_)
+        (void)madvise(p, CHUNK_SIZE, MADV_HUGEPAGE);
+    }
+    chunks_.push_back(static_cast<uint8_t *>(p));
+    huge_.push_back(huge);
+  }
+  while (chunks_.size() > want) {
+    munmap(chunks_.back(), CHUNK_SIZE);
+    chunks_.pop_back();
+    huge_.pop_back();
+  }
+  // what a later grow brings back has to read as zeros
+  if (size < size_ && size % CHUNK_SIZE != 0) {
+    size_t within = size % CHUNK_SIZE;
+    uint64_t end = std::min<uint64_t>(size_, size - within + CHUNK_SIZE);
+    memset(chunks_.back() + within, 0, end - size);
+  }
+  size_ = size;
+}
+
+size_t MemoryBackend::hugeChunks() const {
+  std::shared_lock<std::shared_mutex> lock(mutex_);
+  return std::count(huge_.begin(), huge_.end(), true);
+}
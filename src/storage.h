@@ -0,0 +1,96 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <vector>
+
+// Where a Pager keeps its pages: a flat, growable array of bytes. Reads
+// must lie within size(); writes past the end grow it, and growing
+// zero-fills. Reads may run on several threads alongside a writer as long
+// as they don't touch the bytes being written.
+class StorageBackend {
+public:
+  virtual ~StorageBackend() = default;
+
+  virtual void read(uint8_t *buf, size_t bytes, uint64_t offset) const = 0;
+  virtual void write(const uint8_t *buf, size_t bytes, uint64_t offset) = 0;
+  virtual uint64_t size() const = 0;
+  virtual void resize(uint64_t size) = 0;
+  // makes the writes so far durable
+  virtual void sync() = 0;
+  // hints that [offset, offset + bytes) is about to be read
+  virtual void willNeed(uint64_t, uint64_t) const {}
+};
+
+// A file, read and written with pread/pwrite, optionally opened O_DIRECT
+// (then buffers, sizes and offsets must be page aligned). A read-only one
+// must exist already, and its write, resize and sync throw.
+class FileBackend : public StorageBackend {
+public:
+  FileBackend(const std::string &path, bool directIO, bool readOnly = false);
+  ~FileBackend() override;
+
+  FileBackend(const FileBackend &) = delete;
+  FileBackend &operator=(const FileBackend &) = delete;
+
+  void read(uint8_t *buf, size_t bytes, uint64_t offset) const override;
+  void write(const uint8_t *buf, size_t bytes, uint64_t offset) override;
+  uint64_t size() const override;
+  void resize(uint64_t size) override;
+  void sync() override;
+  void willNeed(uint64_t offset, uint64_t bytes) const override;
+
+private:
+  void checkWritable() const;
+
+  int fd_;
+  bool readOnly_;
+};
+
+// Anonymous memory in 2 MiB chunks, optionally huge pages, with no
+// durability: sync does nothing and reads and writes are plain copies, so
+// the only system calls are the mappings made as it grows.
+//
+// A memory file made with open(path) is kept in a process-wide table, so
+// reopening the path finds the same bytes, as on a tmpfs private to the
+// process, until remove(path). One made directly is gone with its last
+// owner.
+class MemoryBackend : public StorageBackend {
+public:
+  static constexpr size_t CHUNK_SIZE = 2 * 1024 * 1024;
+
+  explicit MemoryBackend(bool hugePages = false);
+  ~MemoryBackend() override;
+
+  MemoryBackend(const MemoryBackend &) = delete;
+  MemoryBackend &operator=(const MemoryBackend &) = delete;
+
+  static std::shared_ptr<MemoryBackend> open(const std::string &path,
+                                             bool hugePages = false);
+  static bool exists(const std::string &path);
+  // false when there was no such memory file; open owners keep theirs
+  static bool remove(const std::string &path);
+
+  void read(uint8_t *buf, size_t bytes, uint64_t offset) const override;
+  void write(const uint8_t *buf, size_t bytes, uint64_t offset) override;
+  uint64_t size() const override;
+  void resize(uint64_t size) override;
+  void sync() override {}
+
+  // chunks mapped from the huge page pool; with hugePages the others were
+  // only advised to use transparent huge pages
+  size_t hugeChunks() const;
+
+private:
+  void resizeLocked(uint64_t size);
+
+  bool hugePages_;
+  // guards the chunk table and size; the bytes themselves are not locked
+  mutable std::shared_mutex mutex_;
+  std::vector<uint8_t *> chunks_;
+  std::vector<bool> huge_;
+  uint64_t size_ = 0;
+};
@@ -0,0 +1,215 @@
+#include "tree_stats.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+#include "btree.h"
+#include "database.h"
+
+namespace {
+
+// deeper than any tree that fits in 2^32 pages; a walk this deep is a cycle
+constexpr uint32_t MAX_DEPTH = 64;
+
+// one thread's share of the walk
+struct Walker {
+  const Pager *pager;
+  TreeStats stats;
+  std::vector<uint32_t> seen;
+
+  // records the node at pageId and appends its children to `children`
+  void visit(uint32_t pageId, uint32_t depth,
+             std::vector<uint32_t> &children) {
+    seen.push_back(pageId);
+    if (pageId == 0 || pageId >= pager->nextPageId() || depth >= MAX_DEPTH) {
+      stats.corruptPages++;
+      return;
+    }
+
+    BNode node;
+    size_t packed = 0;
+    try {
+      PageBuffer page = pager->readCommittedPage(pageId);
+      if (BNode::isPacked(page))
+        packed = BNode::packedSize(page);
+      node = BNode(std::move(page));
+    } catch (const std::exception &) {
+      stats.corruptPages++;
+      return;
+    }
+    if (packed > 0) {
+      stats.packedLeaves++;
+      stats.packedNodeBytes += node.size();
+      stats.packedBytes += packed;
+    }
+
+    if (stats.levels.size() <= depth)
+      stats.levels.resize(depth + 1);
+    TreeStats::Level &level = stats.levels[depth];
+    uint16_t n = node.getNumOfKeys();
+    level.nodes++;
+    level.keys += n;
+    level.bytes += node.size();
+    stats.fill[std::min<size_t>(TreeStats::FILL_BUCKETS - 1,
+                                node.size() * TreeStats::FILL_BUCKETS /
+                                    BTREE_PAGE_USABLE_SIZE)]++;
+
+    switch (node.getType()) {
+    case BNODE_LEAF:
+      for (uint16_t i = 0; i < n; i++) {
+        size_t k = node.getKey(i).size();
+        size_t v = node.getValue(i).size();
+        stats.entries++;
+        stats.keyBytes += k;
+        stats.valueBytes += v;
+        stats.keySizes[TreeStats::sizeBucket(k)]++;
+        stats.valueSizes[TreeStats::sizeBucket(v)]++;
+      }
+      break;
+    case BNODE_INTERNAL:
+      for (uint16_t i = 0; i < n; i++) {
+        uint32_t ptr = node.getPtr(i);
+        if (i > 0) {
+          uint32_t prev = node.getPtr(i - 1);
+          stats.siblingPairs++;
+          stats.siblingDistance += ptr > prev ? ptr - prev : prev - ptr;
+        }
+        children.push_back(ptr);
+      }
+      break;
+    default:
+      stats.corruptPages++;
+    }
+  }
+
+  void walk(uint32_t pageId, uint32_t depth) {
+    std::vector<uint32_t> children;
+    visit(pageId, depth, children);
+    for (uint32_t child : children)
+      walk(child, depth + 1);
+  }
+
+  void merge(const Walker &other) {
+    const TreeStats &o = other.stats;
+    if (stats.levels.size() < o.levels.size())
+      stats.levels.resize(o.levels.size());
+    for (size_t i = 0; i < o.levels.size(); i++) {
+      stats.levels[i].nodes += o.levels[i].nodes;
+      stats.levels[i].keys += o.levels[i].keys;
+      stats.levels[i].bytes += o.levels[i].bytes;
+    }
+    for (size_t i = 0; i < TreeStats::FILL_BUCKETS; i++)
+      stats.fill[i] += o.fill[i];
+    for (size_t i = 0; i < TreeStats::SIZE_BUCKETS; i++) {
+      stats.keySizes[i] += o.keySizes[i];
+      stats.valueSizes[i] += o.valueSizes[i];
+    }
+    stats.entries += o.entries;
+    stats.keyBytes += o.keyBytes;
+    stats.valueBytes += o.valueBytes;
+    stats.corruptPages += o.corruptPages;
+    stats.packedLeaves += o.packedLeaves;
+    stats.packedNodeBytes += o.packedNodeBytes;
+    stats.packedBytes += o.packedBytes;
+    stats.siblingPairs += o.siblingPairs;
+    stats.siblingDistance += o.siblingDistance;
+    seen.insert(seen.end(), other.seen.begin(), other.seen.end());
+  }
+};
+
+// roots of the named trees listed by the catalog subtree at pageId; pages
+// that can't be read are left for the walk to report
+void catalogRoots(const Pager &pager, uint32_t pageId, uint32_t depth,
+                  std::vector<uint32_t> &out) {
+  if (pageId == 0 || pageId >= pager.nextPageId() || depth >= MAX_DEPTH)
+    return;
+  BNode node;
+  try {
+    node = BNode(pager.readCommittedPage(pageId));
+  } catch (const std::exception &) {
+    return;
+  }
+  for (uint16_t i = 0; i < node.getNumOfKeys(); i++) {
+    if (node.getType() == BNODE_INTERNAL) {
+      catalogRoots(pager, node.getPtr(i), depth + 1, out);
+    } else if (node.getType() == BNODE_LEAF) {
+      try {
+        out.push_back(Database::decodeEntry(node.getValue(i)).first);
+      } catch (const std::exception &) {
+        // a bad entry names no tree
+      }
+    }
+  }
+}
+
+} // namespace
+
+size_t TreeStats::sizeBucket(size_t size) {
+  size_t bucket = 0;
+  while (size > 0 && bucket + 1 < SIZE_BUCKETS) {
+    size >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+TreeStats analyzeTree(const Pager &pager, unsigned threads) {
+  if (threads == 0)
+    threads = std::max(1u, std::thread::hardware_concurrency());
+
+  // the top levels are walked here until there are enough subtrees to keep
+  // every thread busy; the threads then take subtrees off a shared counter
+  Walker top{&pager, {}, {}};
+  std::vector<uint32_t> frontier;
+  uint32_t depth = 0;
+  if (pager.rootPage() != 0) {
+    frontier.push_back(pager.rootPage());
+    if (pager.metaFlags() & META_FLAG_CATALOG)
+      catalogRoots(pager, pager.rootPage(), 0, frontier);
+  }
+  while (!frontier.empty() && frontier.size() < 8 * threads) {
+    std::vector<uint32_t> below;
+    for (uint32_t id : frontier)
+      top.visit(id, depth, below);
+    frontier = std::move(below);
+    depth++;
+  }
+
+  std::vector<Walker> walkers(threads, Walker{&pager, {}, {}});
+  std::atomic<size_t> next{0};
+  std::vector<std::thread> pool;
+  for (unsigned t = 0; t < threads; t++) {
+    pool.emplace_back([&, t] {
+      for (size_t i = next++; i < frontier.size(); i = next++)
+        walkers[t].walk(frontier[i], depth);
+    });
+  }
+  for (std::thread &t : pool)
+    t.join();
+  for (const Walker &w : walkers)
+    top.merge(w);
+
+  TreeStats stats = std::move(top.stats);
+  stats.height = static_cast<uint32_t>(stats.levels.size());
+  stats.nextPageId = pager.nextPageId();
+  stats.freePages = pager.freePageCount();
+  stats.freelistPages = pager.freelistPageCount();
+
+  std::vector<uint8_t> refs(stats.nextPageId, 0);
+  for (uint32_t id : top.seen) {
+    if (id == 0 || id >= stats.nextPageId)
+      continue;
+    if (refs[id] == 0)
+      stats.reachablePages++;
+    else if (refs[id] == 1)
+      stats.sharedPages++;
+    refs[id] = std::min(refs[id] + 1, 2);
+  }
+
+  uint64_t accounted =
+      stats.reachablePages + stats.freePages + stats.freelistPages;
+  uint64_t pages = stats.nextPageId > 0 ? stats.nextPageId - 1 : 0;
+  stats.leakedPages = pages > accounted ? pages - accounted : 0;
+  return stats;
+}
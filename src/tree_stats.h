@@ -0,0 +1,73 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "pager.h"
+
+// Shape and space use of the tree in a database file, as gathered by
+// analyzeTree. Levels are counted from the root (level 0) down; in a
+// Database file the catalog and every named tree count as trees of their
+// own, all adding to the same levels.
+struct TreeStats {
+  struct Level {
+    uint64_t nodes = 0;
+    uint64_t keys = 0;
+    uint64_t bytes = 0; // node bytes in use, out of BTREE_PAGE_USABLE_SIZE
+  };
+
+  // size buckets: 0 holds size 0, bucket b > 0 sizes in [2^(b-1), 2^b)
+  static constexpr size_t SIZE_BUCKETS = 17;
+  // fill factor buckets, 10% wide
+  static constexpr size_t FILL_BUCKETS = 10;
+
+  uint32_t height = 0;
+  std::vector<Level> levels;
+  std::array<uint64_t, FILL_BUCKETS> fill{};
+
+  // leaf entries
+  uint64_t entries = 0;
+  uint64_t keyBytes = 0;
+  uint64_t valueBytes = 0;
+  std::array<uint64_t, SIZE_BUCKETS> keySizes{};
+  std::array<uint64_t, SIZE_BUCKETS> valueSizes{};
+
+  // page accounting; every page below nextPageId but the meta page should
+  // be reachable, free, or part of the freelist
+  uint32_t nextPageId = 0;
+  uint64_t reachablePages = 0;
+  uint64_t freePages = 0;     // ids listed on the freelist
+  uint64_t freelistPages = 0; // pages holding the freelist
+  uint64_t leakedPages = 0;   // none of the above
+  uint64_t sharedPages = 0;   // referenced from more than one place
+  uint64_t corruptPages = 0;  // unreadable; their subtrees aren't counted
+
+  // leaves stored compressed (BNODE_FLAG_COMPRESSED leaves bigger than a
+  // page): their node bytes and the page bytes they were packed into
+  uint64_t packedLeaves = 0;
+  uint64_t packedNodeBytes = 0;
+  uint64_t packedBytes = 0;
+
+  // page-id distance between adjacent children of the same node
+  uint64_t siblingPairs = 0;
+  uint64_t siblingDistance = 0;
+
+  double averageSiblingDistance() const {
+    return siblingPairs ? static_cast<double>(siblingDistance) / siblingPairs
+                        : 0.0;
+  }
+
+  double compressionRatio() const {
+    return packedBytes ? static_cast<double>(packedNodeBytes) / packedBytes
+                       : 0.0;
+  }
+
+  static size_t sizeBucket(size_t size);
+};
+
+// Walks the tree at pager.rootPage(), splitting the walk over subtrees on
+// `threads` threads (0: one per hardware thread). Pages are read with
+// Pager::readCommittedPage, so no write transaction may be open.
+TreeStats analyzeTree(const Pager &pager, unsigned threads = 0);
@@ -0,0 +1,231 @@
+#include "value_cache.h"
+
+#include <algorithm>
+#include <list>
+#include <mutex>
+#include <string_view>
+#include <unordered_map>
+
+#include "bloom.h"
+
+namespace {
+
+// bookkeeping charged to each entry on top of its key and value
+constexpr size_t ENTRY_OVERHEAD = 96;
+// the sketch gets a counter per this many bytes of the shard's budget,
+// several per entry of a typical size
+constexpr size_t SKETCH_BYTES_PER_COUNTER = 16;
+constexpr size_t SKETCH_PROBES = 4;
+constexpr uint8_t SKETCH_MAX = 15;
+
+uint64_t keyHash(const std::vector<uint8_t> &key) {
+  return BloomFilter::hash(key.data(), key.size());
+}
+
+std::string_view keyView(const std::vector<uint8_t> &key) {
+  return {reinterpret_cast<const char *>(key.data()), key.size()};
+}
+
+// Count-min sketch: a key's count is the least of its four counters, so
+// collisions only ever overestimate. Once there have been half as many
+// increments as counters every counter is halved, which keeps the counts
+// about recent popularity rather than all-time totals.
+class FrequencySketch {
+public:
+  explicit FrequencySketch(size_t counters) {
+    size_t width = 64;
+    while (width < counters)
+      width <<= 1;
+    counters_.assign(width, 0);
+  }
+
+  void increment(uint64_t h) {
+    for (size_t i = 0; i < SKETCH_PROBES; i++) {
+      uint8_t &c = counters_[slot(h, i)];
+      if (c < SKETCH_MAX)
+        c++;
+    }
+    if (++additions_ >= counters_.size() / 2)
+      age();
+  }
+
+  uint8_t estimate(uint64_t h) const {
+    uint8_t m = SKETCH_MAX;
+    for (size_t i = 0; i < SKETCH_PROBES; i++)
+      m = std::min(m, counters_[slot(h, i)]);
+    return m;
+  }
+
+private:
+  size_t slot(uint64_t h, size_t i) const {
+    uint64_t probe = h + i * ((h >> 32) | 1);
+    return probe & (counters_.size() - 1);
+  }
+
+  void age() {
+    for (uint8_t &c : counters_)
+      c >>= 1;
+    additions_ = 0;
+  }
+
+  size_t additions_ = 0;
+  std::vector<uint8_t> counters_;
+};
+
+} // namespace
+
+struct ValueCache::Shard {
+  struct Entry {
+    std::vector<uint8_t> key;
+    std::vector<uint8_t> value;
+    uint64_t hash;
+    size_t charge;
+  };
+  using Lru = std::list<Entry>;
+
+  explicit Shard(size_t capacity)
+      : capacity(capacity),
+        sketch(capacity / SKETCH_BYTES_PER_COUNTER) {}
+
+  void unlink(Lru::iterator it) {
+    bytes -= it->charge;
+    map.erase(keyView(it->key));
+    lru.erase(it);
+  }
+
+  std::mutex mutex;
+  size_t capacity;
+  size_t bytes = 0;
+  // most recently used first; the map's views point into the entries' keys
+  Lru lru;
+  std::unordered_map<std::string_view, Lru::iterator> map;
+  FrequencySketch sketch;
+  uint64_t hits = 0;
+  uint64_t misses = 0;
+  uint64_t admitted = 0;
+  uint64_t rejected = 0;
+  uint64_t evicted = 0;
+  uint64_t generation = 0; // bumped by every erase that reaches the shard
+};
+
+ValueCache::ValueCache(size_t capacityBytes, size_t shards)
+    : capacity_(capacityBytes) {
+  shards = std::max<size_t>(shards, 1);
+  for (size_t i = 0; i < shards; i++)
+    shards_.push_back(std::make_unique<Shard>(capacityBytes / shards));
+}
+
+ValueCache::~ValueCache() = default;
+
+std::optional<std::vector<uint8_t>>
+ValueCache::get(const std::vector<uint8_t> &key) {
+  uint64_t h = keyHash(key);
+  Shard &s = shardFor(h);
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.sketch.increment(h);
+  auto it = s.map.find(keyView(key));
+  if (it == s.map.end()) {
+    s.misses++;
+    return std::nullopt;
+  }
+  s.hits++;
+  s.lru.splice(s.lru.begin(), s.lru, it->second);
+  return it->second->value;
+}
+
+uint64_t ValueCache::generation(const std::vector<uint8_t> &key) {
+  Shard &s = shardFor(keyHash(key));
+  std::lock_guard<std::mutex> lock(s.mutex);
+  return s.generation;
+}
+
+void ValueCache::put(const std::vector<uint8_t> &key,
+                     const std::vector<uint8_t> &value, uint64_t generation) {
+  uint64_t h = keyHash(key);
+  Shard &s = shardFor(h);
+  size_t charge = key.size() + value.size() + ENTRY_OVERHEAD;
+  std::lock_guard<std::mutex> lock(s.mutex);
+  // a write committed while the value was being read
+  if (s.generation != generation)
+    return;
+
+  auto found = s.map.find(keyView(key));
+  if (found != s.map.end())
+    s.unlink(found->second);
+  if (charge > s.capacity) {
+    s.rejected++;
+    return;
+  }
+
+  // the candidate has to be hotter than every entry it would push out
+  uint8_t freq = s.sketch.estimate(h);
+  size_t freed = 0;
+  auto victim = s.lru.end();
+  while (s.bytes - freed + charge > s.capacity) {
+    --victim;
+    if (s.sketch.estimate(victim->hash) >= freq) {
+      s.rejected++;
+      return;
+    }
+    freed += victim->charge;
+  }
+  while (victim != s.lru.end()) {
+    auto next = std::next(victim);
+    s.unlink(victim);
+    s.evicted++;
+    victim = next;
+  }
+
+  s.lru.push_front(Shard::Entry{key, value, h, charge});
+  s.map.emplace(keyView(s.lru.front().key), s.lru.begin());
+  s.bytes += charge;
+  s.admitted++;
+}
+
+void ValueCache::erase(const std::vector<uint8_t> &key) {
+  Shard &s = shardFor(keyHash(key));
+  std::lock_guard<std::mutex> lock(s.mutex);
+  s.generation++;
+  auto it = s.map.find(keyView(key));
+  if (it != s.map.end())
+    s.unlink(it->second);
+}
+
+void ValueCache::eraseIf(
+    const std::function<bool(const std::vector<uint8_t> &)> &pred) {
+  for (auto &s : shards_) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->generation++;
+    for (auto it = s->lru.begin(); it != s->lru.end();) {
+      auto next = std::next(it);
+      if (pred(it->key))
+        s->unlink(it);
+      it = next;
+    }
+  }
+}
+
+void ValueCache::clear() {
+  for (auto &s : shards_) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    s->generation++;
+    s->map.clear();
+    s->lru.clear();
+    s->bytes = 0;
+  }
+}
+
+ValueCache::Stats ValueCache::stats() const {
+  Stats st;
+  for (const auto &s : shards_) {
+    std::lock_guard<std::mutex> lock(s->mutex);
+    st.hits += s->hits;
+    st.misses += s->misses;
+    st.admitted += s->admitted;
+    st.rejected += s->rejected;
+    st.evicted += s->evicted;
+    st.entries += s->lru.size();
+    st.bytes += s->bytes;
+  }
+  return st;
+}
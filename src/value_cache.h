@@ -0,0 +1,68 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <vector>
+
+// A key -> value cache for point lookups, bounded by bytes and split into
+// independently locked shards. Each shard evicts in LRU order, but a new
+// entry only gets in if it has been asked for more often than every entry
+// it would push out (TinyLFU). Access counts live in a small count-min
+// sketch per shard that is halved every so often, so a burst of one-off
+// lookups can't flush the keys that are actually hot.
+class ValueCache {
+public:
+  struct Stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t admitted = 0;
+    uint64_t rejected = 0; // colder than the entries they'd evict
+    uint64_t evicted = 0;
+    size_t entries = 0;
+    size_t bytes = 0;
+
+    double hitRate() const {
+      uint64_t lookups = hits + misses;
+      return lookups ? static_cast<double>(hits) / lookups : 0.0;
+    }
+  };
+
+  explicit ValueCache(size_t capacityBytes, size_t shards = 16);
+  ~ValueCache();
+
+  ValueCache(const ValueCache &) = delete;
+  ValueCache &operator=(const ValueCache &) = delete;
+
+  // counts the access whether or not it hits
+  std::optional<std::vector<uint8_t>> get(const std::vector<uint8_t> &key);
+  // Invalidations so far of the key's shard. A reader takes it before it
+  // reads the key from the tree and hands it to put.
+  uint64_t generation(const std::vector<uint8_t> &key);
+  // Offers a value read from the tree; admission may turn it down. It is
+  // also dropped if the key's shard has been invalidated since
+  // `generation` was taken, as the value may predate that write.
+  void put(const std::vector<uint8_t> &key, const std::vector<uint8_t> &value,
+           uint64_t generation);
+  void erase(const std::vector<uint8_t> &key);
+  void eraseIf(const std::function<bool(const std::vector<uint8_t> &)> &pred);
+  void clear();
+
+  size_t capacity() const { return capacity_; }
+  Stats stats() const;
+
+private:
+  struct Shard;
+
+  // The sketch probes with the hash's low bits, so the shard is picked from
+  // a remix instead; taking both from the same bits would leave a shard's
+  // keys on a fraction of its counters.
+  Shard &shardFor(uint64_t hash) {
+    return *shards_[((hash * 0x9E3779B97F4A7C15ull) >> 32) % shards_.size()];
+  }
+
+  size_t capacity_;
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+// One thread that runs tasks strictly in submission order, for work that
+// has to be serialized against a single owner (a shard's tree and pager).
+// The destructor finishes the queued tasks before joining.
+class Worker {
+public:
+  Worker();
+  ~Worker();
+
+  Worker(const Worker &) = delete;
+  Worker &operator=(const Worker &) = delete;
+
+  // queues fn; its result or exception comes back through the future
+  template <typename Fn> auto run(Fn fn) -> std::future<decltype(fn())> {
+    using Result = decltype(fn());
+    auto task = std::make_shared<std::packaged_task<Result()>>(std::move(fn));
+    std::future<Result> result = task->get_future();
+    submit([task] { (*task)(); });
+    return result;
+  }
+
+private:
+  void submit(std::function<void()> task);
+  void loop();
+
+  std::mutex mutex_;
+  std::condition_variable ready_;
+  std::deque<std::function<void()>> queue_;
+  bool stopping_ = false;
+  std::thread thread_;
+};
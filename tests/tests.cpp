@@ -1,10 +1,26 @@
 #include <algorithm>
 #include <cassert>
+#include <cstdlib>
 #include <filesystem>
+#include <fstream>
 #include <functional>
+#include <iterator>
 #include <random>
+#include <thread>
 
 #include "../src/btree.h"
+#include "../src/database.h"
+#include "../src/int_search.h"
+#include "../src/lz.h"
+#include "../src/sharded_store.h"
+#include "../src/tree_stats.h"
+
+// Tests run on files unless DBITE_STORAGE=memory puts every pager they
+// open without naming a storage in memory instead.
+void removeFile(const std::string &path) {
+  std::remove(path.c_str());
+  MemoryBackend::remove(path);
+}
 
 void test_header() {
   BNode node;
@@ -227,6 +243,396 @@ void test_node_split_half() {
   std::cout << "Node split half test passed\n";
 }
 
+void test_slotted_node() {
+  BNode node;
+  node.setHeader(BNODE_LEAF, 0, BNODE_FORMAT_SLOTTED);
+  assert(node.getType() == BNODE_LEAF);
+  assert(node.getFormat() == BNODE_FORMAT_SLOTTED);
+
+  // keys sharing prefixes, shorter and longer than the 4-byte slot prefix
+  std::vector<std::vector<uint8_t>> keys = {{'a'},
+                                            {'a', 0},
+                                            {'a', 'b'},
+                                            {'a', 'b', 'c'},
+                                            {'a', 'b', 'c', 'd'},
+                                            {'a', 'b', 'c', 'd', 'e'},
+                                            {'a', 'b', 'c', 'd', 'f'},
+                                            {'b'},
+                                            {0xFF, 0xFF, 0xFF, 0xFF, 0}};
+  std::vector<std::vector<uint8_t>> shuffled = keys;
+  std::mt19937 gen(1);
+  std::shuffle(shuffled.begin(), shuffled.end(), gen);
+
+  for (auto &k : shuffled) {
+    auto index = node.indexLookup(k);
+    node = node.leafInsert(index, k, {k.back()});
+  }
+
+  assert(node.getNumOfKeys() == keys.size());
+  for (uint16_t i = 0; i < keys.size(); i++) {
+    assert(node.getKey(i) == keys[i]);
+    assert(node.getValue(i) == std::vector<uint8_t>{keys[i].back()});
+    assert(node.indexLookup(keys[i]) == i);
+    assert(node.compareKeyAt(i, keys[i]) == 0);
+  }
+  assert(node.indexLookup({'a', 'b', 'c', 'd', 'e', 0}) == 6);
+  assert(node.indexLookup({}) == 0);
+
+  auto smaller = node.leafDelete(3);
+  assert(smaller.getFormat() == BNODE_FORMAT_SLOTTED);
+  assert(smaller.getKey(3) == keys[4]);
+  assert(smaller.indexLookup(keys[5]) == 4);
+
+  std::cout << "Slotted node test passed\n";
+}
+
+void test_compact_node() {
+  // small entries: a compact leaf has no pointers and one-byte sizes
+  auto fill = [](uint8_t format) {
+    BNode node;
+    node.setHeader(BNODE_LEAF, 0, format);
+    for (uint32_t i = 0;; i++) {
+      std::vector<uint8_t> key = {'k', static_cast<uint8_t>(i >> 16),
+                                  static_cast<uint8_t>(i >> 8),
+                                  static_cast<uint8_t>(i)};
+      BNode next = node.leafInsert(i, key, {'v', 'a', 'l'});
+      if (next.size() > BTREE_PAGE_USABLE_SIZE)
+        return node;
+      node = std::move(next);
+    }
+  };
+  BNode classic = fill(BNODE_FORMAT_CLASSIC);
+  BNode compact = fill(BNODE_FORMAT_COMPACT);
+  assert(compact.getFormat() == BNODE_FORMAT_COMPACT);
+  assert(compact.getNumOfKeys() * 10 >= classic.getNumOfKeys() * 13);
+  for (uint16_t i = 0; i < classic.getNumOfKeys(); i++) {
+    assert(compact.getKey(i) == classic.getKey(i));
+    assert(compact.getValue(i) == classic.getValue(i));
+  }
+  for (uint16_t i = 0; i < compact.getNumOfKeys(); i++)
+    assert(compact.indexLookup(compact.getKey(i)) == i);
+
+  // sizes that need a second varint byte, and empty keys and values
+  BNode leaf;
+  leaf.setHeader(BNODE_LEAF, 0, BNODE_FORMAT_COMPACT);
+  std::vector<std::vector<uint8_t>> keys = {
+      {}, {'a'}, std::vector<uint8_t>(127, 'b'), std::vector<uint8_t>(128, 'b'),
+      std::vector<uint8_t>(300, 'c')};
+  for (size_t i = 0; i < keys.size(); i++)
+    leaf = leaf.leafInsert(i, keys[i], std::vector<uint8_t>(i * 100, 'v'));
+  for (size_t i = 0; i < keys.size(); i++) {
+    assert(leaf.getKey(i) == keys[i]);
+    assert(leaf.getValue(i).size() == i * 100);
+    assert(leaf.indexLookup(keys[i]) == i);
+  }
+  auto parts = leaf.leafDelete(0).splitHalf();
+  assert(parts.first.getKey(0) == keys[1]);
+  assert(parts.second.getKey(parts.second.getNumOfKeys() - 1) == keys[4]);
+
+  // internal nodes keep their pointers (and counts) but store no values
+  BNode internal;
+  internal.setHeader(BNODE_INTERNAL, 3,
+                     BNODE_FORMAT_COMPACT | BNODE_FLAG_COUNTED);
+  for (uint16_t i = 0; i < 3; i++) {
+    internal.setPtrAndKeyValue(i, 100 + i, keys[i + 1], {});
+    internal.setCount(i, 10 * i);
+  }
+  assert(internal.size() ==
+         PAGE_HEADER_SIZE + 3 * (PTR_SIZE + COUNT_SIZE + OFFSET_SIZE) + 1 +
+             1 + 1 + 127 + 2 + 128);
+  for (uint16_t i = 0; i < 3; i++) {
+    assert(internal.getPtr(i) == 100u + i);
+    assert(internal.getCount(i) == 10u * i);
+    assert(internal.getKey(i) == keys[i + 1]);
+    assert(internal.getValue(i).empty());
+  }
+  assert(internal.indexLookup(std::vector<uint8_t>(200, 'b')) == 2);
+
+  std::cout << "Compact node test passed\n";
+}
+
+void test_btree_slotted() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  const int N = 1500;
+  auto keyOf = [](int i) {
+    // common 4-byte prefix so many comparisons fall through to the heap
+    return std::vector<uint8_t>{'u', 's', 'e', 'r',
+                                static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+
+  {
+    BTreeOptions options;
+    options.format = BNODE_FORMAT_SLOTTED;
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+    for (int i = 0; i < N; i++)
+      tree.insert(keyOf(i), {static_cast<uint8_t>(i)});
+    for (int i = 0; i < N; i += 3)
+      assert(tree.remove(keyOf(i)));
+  }
+
+  {
+    // reopened with default options: the tree keeps its slotted nodes
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    BNode root(pager->readPage(tree.rootPage()));
+    assert(root.getFormat() == BNODE_FORMAT_SLOTTED);
+    for (int i = 0; i < N; i++) {
+      auto res = tree.search(keyOf(i));
+      if (i % 3 == 0) {
+        assert(!res.has_value());
+      } else {
+        assert(res.has_value());
+        assert(res.value() == std::vector<uint8_t>{static_cast<uint8_t>(i)});
+      }
+    }
+  }
+
+  removeFile(file_name);
+
+  std::cout << "BTree slotted format test passed\n";
+}
+
+static std::vector<uint8_t> be64(uint64_t v) {
+  std::vector<uint8_t> key(8);
+  BigEndian::store_u64(key.data(), v);
+  return key;
+}
+
+void test_int64_node() {
+  std::mt19937_64 gen(3);
+
+  // the dense-array search against std::lower_bound, across window edges
+  for (size_t n : {0, 1, 2, 3, 15, 16, 17, 31, 100, 257}) {
+    std::vector<int64_t> vals(n);
+    for (auto &v : vals)
+      v = static_cast<int64_t>(gen());
+    std::sort(vals.begin(), vals.end());
+    std::vector<uint8_t> raw(8 * n);
+    for (size_t i = 0; i < n; i++)
+      LittleEndian::store_u64(raw.data() + 8 * i, vals[i]);
+    for (int probe = 0; probe < 200; probe++) {
+      int64_t t = static_cast<int64_t>(gen());
+      if (probe % 2 && n)
+        t = vals[gen() % n];
+      size_t expected =
+          std::lower_bound(vals.begin(), vals.end(), t) - vals.begin();
+      assert(int64LowerBound(raw.data(), n, t) == expected);
+    }
+  }
+
+  BNode node;
+  node.setHeader(BNODE_LEAF, 0, BNODE_FORMAT_INT64);
+  std::vector<uint64_t> keys = {0, 1, 255, 256, 1ull << 62, 1ull << 63,
+                                (1ull << 63) + 1, UINT64_MAX};
+  std::vector<uint64_t> shuffled = keys;
+  std::shuffle(shuffled.begin(), shuffled.end(), gen);
+  for (uint64_t k : shuffled) {
+    auto index = node.indexLookup(be64(k));
+    node = node.leafInsert(index, be64(k), {static_cast<uint8_t>(k)});
+  }
+
+  for (uint16_t i = 0; i < keys.size(); i++) {
+    assert(node.getKey(i) == be64(keys[i]));
+    assert(node.getValue(i) == std::vector<uint8_t>{static_cast<uint8_t>(
+                                   keys[i])});
+    assert(node.indexLookup(be64(keys[i])) == i);
+  }
+  assert(node.indexLookup(be64(2)) == 2);
+  // keys of other sizes still order bytewise against the stored ones
+  assert(node.indexLookup({0, 0, 0, 0, 0, 0, 1}) == 3);
+  assert(!node.acceptsKey({1, 2, 3}));
+
+  std::cout << "Int64 node test passed\n";
+}
+
+void test_btree_int64() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  const uint64_t N = 3000;
+  {
+    BTreeOptions options;
+    options.format = BNODE_FORMAT_INT64;
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+    for (uint64_t i = 0; i < N; i++)
+      tree.insert(be64(i * 7919 % N), {static_cast<uint8_t>(i * 7919 % N)});
+    for (uint64_t i = 0; i < N; i += 4)
+      assert(tree.remove(be64(i)));
+
+    bool threw = false;
+    try {
+      tree.insert({'n', 'o'}, {'x'});
+    } catch (const std::invalid_argument &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (uint64_t i = 0; i < N; i++) {
+      auto res = tree.search(be64(i));
+      if (i % 4 == 0) {
+        assert(!res.has_value());
+      } else {
+        assert(res.has_value());
+        assert(res.value() == std::vector<uint8_t>{static_cast<uint8_t>(i)});
+      }
+    }
+    assert(!tree.search(be64(N)).has_value());
+    assert(!tree.search({'n', 'o'}).has_value());
+  }
+
+  removeFile(file_name);
+
+  std::cout << "BTree int64 format test passed\n";
+}
+
+static std::vector<uint8_t> tuple(std::vector<std::string> parts) {
+  std::vector<uint8_t> key;
+  for (auto &p : parts) {
+    key.push_back(p.size() & 0xFF);
+    key.push_back(p.size() >> 8);
+    key.insert(key.end(), p.begin(), p.end());
+  }
+  return key;
+}
+
+static std::vector<uint8_t> native64(uint64_t v) {
+  std::vector<uint8_t> key(8);
+  memcpy(key.data(), &v, 8);
+  return key;
+}
+
+void test_key_orders() {
+  auto cmp = [](auto order, const std::vector<uint8_t> &a,
+                const std::vector<uint8_t> &b) {
+    return decltype(order)::compare(a.data(), a.size(), b.data(), b.size());
+  };
+
+  assert(cmp(U64Order{}, native64(2), native64(256)) < 0);
+  assert(cmp(U64Order{}, native64(UINT64_MAX), native64(0)) > 0);
+  assert(cmp(ReverseOrder{}, {'a'}, {'b'}) > 0);
+  assert(cmp(ReverseOrder{}, {'a'}, {'a', 'a'}) > 0);
+  // bytewise would put ("ab","c") after ("b") because of the length prefix
+  assert(cmp(TupleOrder{}, tuple({"ab", "c"}), tuple({"b"})) < 0);
+  assert(cmp(TupleOrder{}, tuple({"a"}), tuple({"a", ""})) < 0);
+  assert(cmp(TupleOrder{}, tuple({"a", "z"}), tuple({"aa"})) < 0);
+  assert(cmp(TupleOrder{}, tuple({"x", "y"}), tuple({"x", "y"})) == 0);
+  // truncated components that read the same are still different keys
+  std::vector<uint8_t> truncated = {5, 0, 'a', 'b'};
+  assert(cmp(TupleOrder{}, truncated, tuple({"ab"})) != 0);
+  assert(cmp(TupleOrder{}, truncated, tuple({"ab"})) ==
+         -cmp(TupleOrder{}, tuple({"ab"}), truncated));
+  assert(cmp(TupleOrder{}, {'x'}, tuple({"x"})) != 0);
+
+  struct Case {
+    uint8_t order;
+    std::vector<std::vector<uint8_t>> sorted;
+  };
+  std::vector<Case> cases = {
+      {KEY_ORDER_U64,
+       {native64(1), native64(2), native64(300), native64(1ull << 40)}},
+      {KEY_ORDER_REVERSE, {{'z'}, {'m', 'm'}, {'m'}, {'a'}}},
+      {KEY_ORDER_TUPLE,
+       {tuple({"a"}), tuple({"a", "b"}), tuple({"ab"}), tuple({"b", ""})}},
+  };
+
+  for (auto &c : cases) {
+    std::mt19937 gen(std::random_device{}());
+    int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+    std::string dir = "tmp";
+    std::filesystem::create_directories(dir);
+    std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+    {
+      BTreeOptions options;
+      options.keyOrder = c.order;
+      auto pager = std::make_shared<Pager>(file_name);
+      BTree tree(pager, options);
+      auto shuffled = c.sorted;
+      std::shuffle(shuffled.begin(), shuffled.end(), gen);
+      for (auto &k : shuffled)
+        tree.insert(k, {'v'});
+
+      BNode root(pager->readPage(tree.rootPage()));
+      assert(root.getNumOfKeys() == c.sorted.size());
+      for (uint16_t i = 0; i < c.sorted.size(); i++)
+        assert(root.getKey(i) == c.sorted[i]);
+    }
+
+    {
+      auto pager = std::make_shared<Pager>(file_name);
+      BTree tree(pager);
+      assert(tree.keyOrder() == c.order);
+
+      // enough keys to split the root, in the order's terms
+      for (int i = 0; i < 800; i++) {
+        std::vector<uint8_t> k =
+            c.order == KEY_ORDER_U64
+                ? native64(i * 1000 + 7)
+                : tuple({std::to_string(i % 17), std::to_string(i)});
+        tree.insert(k, {static_cast<uint8_t>(i)});
+      }
+      for (auto &k : c.sorted)
+        assert(tree.search(k).has_value());
+
+      if (c.order == KEY_ORDER_U64) {
+        // other key sizes have no place in the order
+        int refused = 0;
+        for (auto op : {0, 1, 2}) {
+          try {
+            if (op == 0)
+              tree.insert({'a', 'b', 'c'}, {'v'});
+            else if (op == 1)
+              tree.remove({'a', 'b', 'c'});
+            else
+              tree.removeRange(native64(1), {'z'});
+          } catch (const std::invalid_argument &) {
+            refused++;
+          }
+        }
+        assert(refused == 3);
+      } else if (c.order == KEY_ORDER_TUPLE) {
+        // keys equal only componentwise are stored apart
+        std::vector<uint8_t> truncated = {5, 0, 'a', 'b'};
+        tree.insert(truncated, {'t'});
+        assert(tree.search(tuple({"ab"})).value() == std::vector<uint8_t>{'v'});
+        assert(tree.search(truncated).value() == std::vector<uint8_t>{'t'});
+        assert(tree.remove(truncated));
+      }
+      for (int i = 0; i < 800; i += 2) {
+        std::vector<uint8_t> k =
+            c.order == KEY_ORDER_U64
+                ? native64(i * 1000 + 7)
+                : tuple({std::to_string(i % 17), std::to_string(i)});
+        assert(tree.search(k).value() ==
+               std::vector<uint8_t>{static_cast<uint8_t>(i)});
+        assert(tree.remove(k));
+        assert(!tree.search(k).has_value());
+      }
+    }
+
+    removeFile(file_name);
+  }
+
+  std::cout << "Key order test passed\n";
+}
+
 void test_btree_insert() {
   std::mt19937 gen(std::random_device{}());
   int number = std::uniform_int_distribution<>(1000, 9999)(gen);
@@ -717,11 +1123,1894 @@ void test_btree_persistence() {
   }
 
   // Clean up test file
-  std::remove(file_name.c_str());
+  removeFile(file_name);
 
   std::cout << "BTree persistence test passed.\n";
 }
 
+void test_btree_remove_range() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  // long keys keep the fan-out low so the tree gets three levels
+  auto key = [](int i) {
+    std::vector<uint8_t> k(200, 'k');
+    k[0] = static_cast<uint8_t>(i >> 8);
+    k[1] = static_cast<uint8_t>(i);
+    return k;
+  };
+  auto inRange = [](int i, int lo, int hi) { return i >= lo && i < hi; };
+
+  const int N = 1200;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < N; i++)
+      tree.insert(key(i), {static_cast<uint8_t>(i)});
+
+    assert(tree.removeRange(key(300), key(900)));
+    assert(!tree.removeRange(key(300), key(900)));
+    assert(!tree.removeRange(key(20), key(10)));
+    assert(tree.removeRange(key(10), key(11)));
+
+    for (int i = 0; i < N; i++) {
+      bool gone = inRange(i, 300, 900) || i == 10;
+      assert(tree.search(key(i)).has_value() == !gone);
+    }
+
+    tree.insert(key(600), {'v'});
+    assert(tree.search(key(600)).has_value());
+    assert(tree.remove(key(600)));
+  }
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < N; i++) {
+      bool gone = inRange(i, 300, 900) || i == 10;
+      assert(tree.search(key(i)).has_value() == !gone);
+    }
+
+    assert(tree.removeRange(key(0), key(N)));
+    for (int i = 0; i < N; i++)
+      assert(!tree.search(key(i)).has_value());
+
+    tree.insert(key(7), {'v'});
+    assert(tree.search(key(7)).has_value());
+  }
+
+  removeFile(file_name);
+
+  // with merging disabled, removals never read siblings but still work
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTreeOptions options;
+    options.mergeThreshold = 0;
+    BTree tree(pager, options);
+    for (int i = 0; i < 500; i++)
+      tree.insert(key(i), {'v'});
+    for (int i = 0; i < 500; i += 2)
+      assert(tree.remove(key(i)));
+    for (int i = 0; i < 500; i++)
+      assert(tree.search(key(i)).has_value() == (i % 2 == 1));
+  }
+
+  removeFile(file_name);
+
+  std::cout << "BTree range remove test passed\n";
+}
+
+void test_btree_scan() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  auto key = [](int i) {
+    return std::vector<uint8_t>{static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+  auto collect = [](const BTree &tree, const std::vector<uint8_t> &begin,
+                    const std::vector<uint8_t> &end, size_t limit) {
+    std::vector<std::vector<uint8_t>> keys;
+    tree.scan(begin, end, [&](const auto &k, const auto &v) {
+      assert(v.size() == 1 && v[0] == k[1]);
+      keys.push_back(k);
+      return keys.size() < limit;
+    });
+    return keys;
+  };
+
+  const int N = 600;
+  for (uint16_t window : {uint16_t(0), uint16_t(4)}) {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTreeOptions options;
+    options.prefetchWindow = window;
+    BTree tree(pager, options);
+    if (window == 0) {
+      for (int i = N - 1; i >= 0; i--)
+        tree.insert(key(i), {static_cast<uint8_t>(i)});
+    }
+
+    auto all = collect(tree, {}, {}, SIZE_MAX);
+    assert(all.size() == N);
+    for (int i = 0; i < N; i++)
+      assert(all[i] == key(i));
+
+    auto mid = collect(tree, key(100), key(350), SIZE_MAX);
+    assert(mid.size() == 250 && mid.front() == key(100));
+    assert(mid.back() == key(349));
+
+    // bounds that fall between stored keys
+    auto loose = collect(tree, {0, 99, 0}, {1, 0, 0}, SIZE_MAX);
+    assert(loose.size() == 256 - 100 + 1 && loose.front() == key(100));
+
+    auto firstTen = collect(tree, key(42), {}, 10);
+    assert(firstTen.size() == 10 && firstTen.back() == key(51));
+
+    assert(collect(tree, key(300), key(300), SIZE_MAX).empty());
+    assert(collect(tree, key(N), {}, SIZE_MAX).empty());
+  }
+  removeFile(file_name);
+
+  // scans follow the tree's key order
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTreeOptions options;
+    options.keyOrder = KEY_ORDER_REVERSE;
+    BTree tree(pager, options);
+    for (int i = 0; i < 100; i++)
+      tree.insert(key(i), {static_cast<uint8_t>(i)});
+
+    auto desc = collect(tree, key(80), key(20), SIZE_MAX);
+    assert(desc.size() == 60);
+    for (size_t i = 0; i < desc.size(); i++)
+      assert(desc[i] == key(80 - static_cast<int>(i)));
+  }
+  removeFile(file_name);
+
+  std::cout << "BTree scan test passed\n";
+}
+
+void test_btree_counted() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  // every order statistic against the keys that should be in the tree
+  auto check = [](const BTree &tree, const std::vector<uint64_t> &keys) {
+    assert(tree.count({}, {}) == keys.size());
+    for (size_t i = 0; i < keys.size(); i += 7) {
+      assert(tree.rank(be64(keys[i])) == i);
+      assert(tree.rank(be64(keys[i] + 1)) == i + 1);
+      auto entry = tree.at(i);
+      assert(entry.has_value() && entry->first == be64(keys[i]));
+      assert(entry->second == std::vector<uint8_t>(40, keys[i] & 0xFF));
+    }
+    assert(!tree.at(keys.size()).has_value());
+    assert(tree.count(be64(1000), be64(2000)) ==
+           static_cast<uint64_t>(
+               std::lower_bound(keys.begin(), keys.end(), 2000) -
+               std::lower_bound(keys.begin(), keys.end(), 1000)));
+    assert(tree.count(be64(2000), be64(1000)) == 0);
+  };
+
+  const uint8_t formats[] = {BNODE_FORMAT_CLASSIC | BNODE_FLAG_COUNTED,
+                             BNODE_FORMAT_SLOTTED | BNODE_FLAG_COUNTED,
+                             BNODE_FORMAT_INT64 | BNODE_FLAG_COUNTED,
+                             BNODE_FORMAT_CLASSIC};
+  for (uint8_t format : formats) {
+    const uint64_t N = 4000;
+    std::vector<uint64_t> keys;
+    {
+      BTreeOptions options;
+      options.format = format;
+      auto pager = std::make_shared<Pager>(file_name);
+      BTree tree(pager, options);
+      for (uint64_t i = 0; i < N; i++) {
+        uint64_t k = i * 7919 % N;
+        tree.insert(be64(k), std::vector<uint8_t>(40, k & 0xFF));
+      }
+      // updates don't change the counts
+      for (uint64_t i = 0; i < N; i += 10)
+        tree.insert(be64(i), std::vector<uint8_t>(40, i & 0xFF));
+      for (uint64_t i = 0; i < N; i += 3)
+        assert(tree.remove(be64(i)));
+      assert(tree.removeRange(be64(2500), be64(3100)));
+
+      for (uint64_t i = 0; i < N; i++) {
+        if (i % 3 != 0 && (i < 2500 || i >= 3100))
+          keys.push_back(i);
+      }
+      check(tree, keys);
+
+      BNode root(pager->readPage(tree.rootPage()));
+      assert(root.getType() == BNODE_INTERNAL);
+      assert(root.hasCounts() == ((format & BNODE_FLAG_COUNTED) != 0));
+      if (root.hasCounts())
+        assert(root.subtreeCount() == keys.size());
+    }
+
+    // the counts are part of the pages and survive a reopen
+    {
+      auto pager = std::make_shared<Pager>(file_name);
+      BTree tree(pager);
+      check(tree, keys);
+      tree.removeRange(be64(0), be64(N));
+      assert(tree.count({}, {}) == 0 && !tree.at(0).has_value());
+      assert(tree.rank(be64(5)) == 0);
+    }
+
+    removeFile(file_name);
+  }
+
+  std::cout << "BTree counted format test passed\n";
+}
+
+static std::vector<uint8_t> jsonValue(int i) {
+  std::string s = "{\"id\":" + std::to_string(i) + ",\"name\":\"user" +
+                  std::to_string(i) +
+                  "\",\"active\":true,\"roles\":[\"reader\",\"writer\"],"
+                  "\"address\":{\"city\":\"Springfield\",\"zip\":\"" +
+                  std::to_string(10000 + i % 500) + "\"}}";
+  return std::vector<uint8_t>(s.begin(), s.end());
+}
+
+void test_lz_codec() {
+  std::mt19937 gen(3);
+  std::vector<uint8_t> text, noise(5000);
+  for (int i = 0; text.size() < 12000; i++) {
+    std::vector<uint8_t> v = jsonValue(i);
+    text.insert(text.end(), v.begin(), v.end());
+  }
+  for (uint8_t &b : noise)
+    b = static_cast<uint8_t>(gen());
+
+  for (const std::vector<uint8_t> *src : {&text, &noise}) {
+    std::vector<uint8_t> packed(src->size() + src->size() / 64 + 16);
+    size_t n = lzCompress(src->data(), src->size(), packed.data(),
+                          packed.size());
+    assert(n > 0);
+    if (src == &text)
+      assert(n * 4 < src->size());
+
+    std::vector<uint8_t> out(src->size());
+    assert(lzDecompress(packed.data(), n, out.data(), out.size()));
+    assert(out == *src);
+    // truncated blocks and wrong sizes are refused
+    assert(!lzDecompress(packed.data(), n - 1, out.data(), out.size()));
+    assert(!lzDecompress(packed.data(), n, out.data(), out.size() - 1));
+  }
+
+  // a block that doesn't fit the output is reported as such
+  std::vector<uint8_t> small(100);
+  assert(lzCompress(noise.data(), noise.size(), small.data(), small.size()) ==
+         0);
+  assert(lzCompress(text.data(), 0, small.data(), small.size()) == 1);
+
+  std::cout << "LZ codec test passed\n";
+}
+
+void test_btree_compressed() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+  std::string plain_name = dir + "/dbite" + std::to_string(number) + "p.db";
+
+  // a leaf bigger than a page goes to disk packed and comes back whole
+  {
+    BNode node(COMPRESSED_LEAF_MAX_SIZE);
+    node.setHeader(BNODE_LEAF, 0, BNODE_FLAG_COMPRESSED);
+    for (int i = 0; node.size() < 3 * BTREE_PAGE_SIZE; i++)
+      node = node.leafInsert(node.getNumOfKeys(), be64(i), jsonValue(i));
+    assert(node.fitsPage());
+    BNode copy = node;
+    PageBuffer page = copy.release();
+    assert(page.size() == BTREE_PAGE_SIZE && BNode::isPacked(page));
+    assert(BNode::packedSize(page) <= BTREE_PAGE_USABLE_SIZE);
+    BNode back(page);
+    assert(back.size() == node.size());
+    assert(memcmp(back.data().data(), node.data().data(), node.size()) == 0);
+
+    BNode plain(BTREE_PAGE_SIZE);
+    plain.setHeader(BNODE_LEAF, 0);
+    assert(!BNode::isPacked(plain.data()));
+  }
+
+  const int N = 3000;
+  auto key = [](int i) { return be64(static_cast<uint64_t>(i) * 7); };
+  auto kept = [](int i) { return i % 3 != 0 && (i < 1000 || i >= 1500); };
+  for (const std::string &name : {file_name, plain_name}) {
+    BTreeOptions options;
+    if (name == file_name)
+      options.format = BNODE_FORMAT_SLOTTED | BNODE_FLAG_COMPRESSED;
+    auto pager = std::make_shared<Pager>(name);
+    BTree tree(pager, options);
+    pager->beginTxn();
+    for (int i = 0; i < N; i++)
+      tree.insert(key(i * 7919 % N), jsonValue(i * 7919 % N));
+    pager->commitTxn();
+  }
+  {
+    Pager compressed(file_name), plain(plain_name);
+    // the same entries in far fewer pages
+    TreeStats stats = analyzeTree(compressed, 1);
+    TreeStats plainStats = analyzeTree(plain, 1);
+    assert(stats.reachablePages * 4 < plainStats.reachablePages);
+    assert(stats.entries == N && stats.packedLeaves > 0);
+    assert(stats.compressionRatio() > 2.0);
+    assert(stats.corruptPages == 0 && stats.leakedPages == 0);
+  }
+  removeFile(plain_name);
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < N; i += 3)
+      assert(tree.remove(key(i)));
+    assert(tree.removeRange(key(1000), key(1500)));
+    // values that don't compress still end up in leaves that fit
+    for (int i = 0; i < 200; i++) {
+      std::vector<uint8_t> noise(300);
+      for (uint8_t &b : noise)
+        b = static_cast<uint8_t>(gen());
+      tree.insert(be64(1000000 + i), noise);
+    }
+    assert(tree.removeRange(be64(1000000), be64(2000000)));
+    tree.compact();
+  }
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < N; i++) {
+      auto res = tree.search(key(i));
+      assert(res.has_value() == kept(i));
+      if (kept(i))
+        assert(*res == jsonValue(i));
+    }
+    size_t seen = 0;
+    tree.scan({}, {},
+              [&](const std::vector<uint8_t> &, const std::vector<uint8_t> &) {
+                seen++;
+                return true;
+              });
+    size_t expected = 0;
+    for (int i = 0; i < N; i++)
+      expected += kept(i);
+    assert(seen == expected);
+  }
+
+  removeFile(file_name);
+
+  std::cout << "BTree compressed format test passed\n";
+}
+
+void test_btree_update() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  auto i64 = [](int64_t v) {
+    std::vector<uint8_t> out(8);
+    LittleEndian::store_u64(out.data(), static_cast<uint64_t>(v));
+    return out;
+  };
+
+  BTreeOptions options;
+  options.filterBitsPerKey = 10;
+  options.valueCacheBytes = 1 << 16;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+    pager->beginTxn();
+    for (uint64_t i = 0; i < 1000; i++)
+      tree.insert(be64(i * 7919 % 1000), {'a'});
+    pager->commitTxn();
+
+    // fn sees the current value, or null for an absent key
+    assert(tree.update(be64(5), [](const std::vector<uint8_t> *cur) {
+      assert(cur && *cur == std::vector<uint8_t>{'a'});
+      return std::vector<uint8_t>{'b'};
+    }));
+    assert(tree.search(be64(5)) == std::vector<uint8_t>{'b'});
+    assert(tree.update(be64(5000), [](const std::vector<uint8_t> *cur) {
+      assert(cur == nullptr);
+      return std::vector<uint8_t>{'n'};
+    }));
+    assert(tree.search(be64(5000)) == std::vector<uint8_t>{'n'});
+
+    // nothing is written unless the value changes
+    uint64_t txn = pager->currentTxnId();
+    assert(!tree.update(be64(6), [](const std::vector<uint8_t> *) {
+      return std::nullopt;
+    }));
+    assert(!tree.update(be64(7), [](const std::vector<uint8_t> *cur) {
+      return std::optional<std::vector<uint8_t>>(*cur);
+    }));
+    assert(!tree.putIfAbsent(be64(7), {'x'}));
+    assert(!tree.compareAndSwap(be64(7), {'z'}, {'x'}));
+    assert(!tree.compareAndSwap(be64(9999), {'a'}, {'x'}));
+    assert(pager->currentTxnId() == txn);
+
+    assert(tree.putIfAbsent(be64(6000), {'p'}));
+    assert(tree.search(be64(6000)) == std::vector<uint8_t>{'p'});
+    assert(tree.compareAndSwap(be64(7), {'a'}, {'c'}));
+    assert(tree.search(be64(7)) == std::vector<uint8_t>{'c'});
+
+    // merge operators
+    // adding 0 changes nothing
+    for (int i = 0; i < 10; i++)
+      assert(tree.merge("add64", be64(7000), i64(i - 2)) == (i != 2));
+    assert(tree.search(be64(7000)) == i64(25));
+    tree.merge("append", be64(8000), {'x'});
+    tree.merge("append", be64(8000), {'y', 'z'});
+    assert(tree.search(be64(8000)) == (std::vector<uint8_t>{'x', 'y', 'z'}));
+    tree.registerMergeOperator(
+        "max", [](const std::vector<uint8_t> *cur,
+                  const std::vector<uint8_t> &op) {
+          return cur && *cur > op ? *cur : op;
+        });
+    tree.merge("max", be64(9000), {5});
+    tree.merge("max", be64(9000), {3});
+    assert(tree.search(be64(9000)) == std::vector<uint8_t>{5});
+
+    bool threw = false;
+    try {
+      tree.merge("nope", be64(1), {});
+    } catch (const std::invalid_argument &) {
+      threw = true;
+    }
+    assert(threw);
+    // an operator that throws leaves the tree as it was
+    threw = false;
+    try {
+      tree.merge("add64", be64(8000), i64(1));
+    } catch (const std::invalid_argument &) {
+      threw = true;
+    }
+    assert(threw);
+    assert(tree.search(be64(8000)) == (std::vector<uint8_t>{'x', 'y', 'z'}));
+  }
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    assert(tree.search(be64(7000)) == i64(25));
+    assert(tree.search(be64(5)) == std::vector<uint8_t>{'b'});
+  }
+  removeFile(file_name);
+
+  std::cout << "BTree update test passed\n";
+}
+
+void test_btree_filter() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  const uint64_t N = 3000;
+  BTreeOptions options;
+  options.filterBitsPerKey = 10;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+    pager->beginTxn();
+    for (uint64_t i = 0; i < N; i++)
+      tree.insert(be64(2 * i), {static_cast<uint8_t>(i)});
+    pager->commitTxn();
+    // the filter outgrew its size inside the transaction; the first write
+    // after it rebuilds it
+    assert(tree.filterStats().keys == N);
+    tree.insert(be64(0), {1});
+    assert(tree.filterStats().keys == N);
+    assert(tree.filterStats().memoryBytes * 8 >= 2 * N * 10);
+    for (uint64_t i = 0; i < N; i += 5)
+      assert(tree.remove(be64(2 * i)));
+
+    // present keys always get through, and removed ones (still set in the
+    // filter) aren't found
+    for (uint64_t i = 0; i < N; i++)
+      assert(tree.search(be64(2 * i)).has_value() == (i % 5 != 0));
+    BTree::FilterStats before = tree.filterStats();
+    assert(before.memoryBytes > 0 && before.removed == N / 5);
+    assert(before.falsePositives == N / 5 && before.ruledOut == 0);
+
+    // keys never inserted are mostly ruled out
+    for (uint64_t i = 0; i < N; i++)
+      assert(!tree.search(be64(2 * i + 1)).has_value());
+    BTree::FilterStats stats = tree.filterStats();
+    uint64_t passed = stats.falsePositives - before.falsePositives;
+    assert(stats.ruledOut + passed == N);
+    assert(passed < N / 20);
+  }
+
+  // rebuilt on open, and used by multiSearch too
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+    assert(tree.filterStats().keys == N - N / 5);
+    std::vector<std::vector<uint8_t>> keys;
+    for (uint64_t i = 0; i < 2 * N; i++)
+      keys.push_back(be64(i));
+    auto results = tree.multiSearch(keys);
+    for (uint64_t i = 0; i < 2 * N; i++)
+      assert(results[i].has_value() == (i % 2 == 0 && i % 10 != 0));
+    assert(tree.filterStats().ruledOut > N / 2);
+
+    BTree plain(pager);
+    assert(plain.filterStats().memoryBytes == 0);
+  }
+  removeFile(file_name);
+
+  // a filter that outgrows its size inside a transaction is only rebuilt
+  // once it commits, so an abort can't leave it without the keys it brings
+  // back
+  {
+    Database db(file_name);
+    BTree &tree = db.open("t", options);
+    tree.insert(be64(1), {'a'});
+    db.beginTxn();
+    tree.remove(be64(1));
+    for (uint64_t i = 0; i < 1100; i++)
+      tree.insert(be64(100 + i), {'b'});
+    assert(!tree.search(be64(1)).has_value());
+    assert(tree.filterStats().keys == 1101);
+    db.abortTxn();
+    assert(tree.search(be64(1)).has_value());
+    assert(!tree.search(be64(100)).has_value());
+
+    db.beginTxn();
+    for (uint64_t i = 0; i < 1100; i++)
+      tree.insert(be64(100 + i), {'b'});
+    assert(tree.filterStats().keys == 2201);
+    db.commitTxn();
+    assert(tree.filterStats().keys == 1101);
+    assert(tree.filterStats().removed == 0);
+
+    // a tree first opened in a transaction gets its filter at the commit
+    db.beginTxn();
+    BTree &fresh = db.open("u", options);
+    fresh.insert(be64(5), {'c'});
+    assert(fresh.filterStats().memoryBytes == 0);
+    assert(fresh.search(be64(5)).has_value());
+    db.commitTxn();
+    assert(fresh.filterStats().keys == 1);
+    assert(!fresh.search(be64(6)).has_value());
+    assert(fresh.filterStats().ruledOut == 1);
+  }
+  removeFile(file_name);
+
+  std::cout << "BTree filter test passed\n";
+}
+
+void test_value_cache() {
+  auto key = [](int i) {
+    return std::vector<uint8_t>{'k', static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+  const std::vector<uint8_t> value(100, 'v');
+
+  // one shard, room for a few dozen entries
+  ValueCache cache(8192, 1);
+  assert(!cache.get(key(0)).has_value());
+  cache.put(key(0), value, cache.generation(key(0)));
+  assert(cache.get(key(0)) == value);
+  cache.erase(key(0));
+  assert(!cache.get(key(0)).has_value());
+
+  // hot keys asked for again and again
+  for (int round = 0; round < 8; round++) {
+    for (int i = 0; i < 20; i++) {
+      if (!cache.get(key(i)))
+        cache.put(key(i), value, cache.generation(key(i)));
+    }
+  }
+  // a scan of one-off keys alongside them is mostly turned away rather
+  // than flushing them
+  for (int i = 1000; i < 3000; i++) {
+    if (!cache.get(key(i)))
+      cache.put(key(i), value, cache.generation(key(i)));
+    cache.get(key(i % 20));
+  }
+  for (int i = 0; i < 20; i++)
+    assert(cache.get(key(i)) == value);
+  ValueCache::Stats stats = cache.stats();
+  assert(stats.bytes <= 8192 && stats.rejected > 0);
+
+  cache.eraseIf([](const std::vector<uint8_t> &k) { return k[2] % 2 == 0; });
+  assert(!cache.get(key(0)).has_value() && cache.get(key(1)) == value);
+  cache.clear();
+  assert(cache.stats().entries == 0 && cache.stats().bytes == 0);
+
+  // a value read before an invalidation isn't cached after it
+  uint64_t before = cache.generation(key(5));
+  cache.erase(key(5));
+  cache.put(key(5), value, before);
+  assert(!cache.get(key(5)).has_value());
+
+  // Readers race a writer that commits a new value, then invalidates.
+  // A reader that read the old value must not leave it cached, so a hit
+  // is never older than the last value invalidated before the lookup.
+  {
+    ValueCache shared(1 << 16, 4);
+    std::atomic<uint64_t> committed{0}, invalidated{0};
+    std::atomic<bool> done{false};
+    std::vector<std::thread> readers;
+    for (int t = 0; t < 3; t++) {
+      readers.emplace_back([&] {
+        while (!done) {
+          uint64_t floor = invalidated;
+          if (auto hit = shared.get(key(7))) {
+            assert(*hit >= be64(floor));
+            continue;
+          }
+          uint64_t generation = shared.generation(key(7));
+          std::vector<uint8_t> read = be64(committed);
+          std::this_thread::yield();
+          shared.put(key(7), read, generation);
+        }
+      });
+    }
+    for (uint64_t v = 1; v <= 20000; v++) {
+      committed = v;
+      shared.erase(key(7));
+      invalidated = v;
+    }
+    done = true;
+    for (std::thread &t : readers)
+      t.join();
+    auto last = shared.get(key(7));
+    assert(!last.has_value() || *last == be64(20000));
+  }
+
+  std::cout << "Value cache test passed\n";
+}
+
+void test_btree_value_cache() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  const uint64_t N = 2000;
+  BTreeOptions options;
+  options.valueCacheBytes = 1 << 20;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+    pager->beginTxn();
+    for (uint64_t i = 0; i < N; i++)
+      tree.insert(be64(i), {'a'});
+    pager->commitTxn();
+
+    for (int round = 0; round < 2; round++) {
+      for (uint64_t i = 0; i < 100; i++)
+        assert(tree.search(be64(i)) == std::vector<uint8_t>{'a'});
+    }
+    ValueCache::Stats stats = tree.valueCacheStats();
+    assert(stats.hits == 100 && stats.entries == 100);
+
+    // writes drop the keys they touch
+    tree.insert(be64(1), {'b'});
+    assert(tree.search(be64(1)) == std::vector<uint8_t>{'b'});
+    assert(tree.remove(be64(2)));
+    assert(!tree.search(be64(2)).has_value());
+    assert(tree.removeRange(be64(10), be64(20)));
+    for (uint64_t i = 0; i < 100; i++)
+      assert(tree.search(be64(i)).has_value() ==
+             (i != 2 && (i < 10 || i >= 20)));
+
+    // inside a transaction lookups see its writes and bypass the cache
+    uint64_t hits = tree.valueCacheStats().hits;
+    pager->beginTxn();
+    tree.insert(be64(3), {'c'});
+    assert(tree.search(be64(3)) == std::vector<uint8_t>{'c'});
+    assert(tree.search(be64(4)) == std::vector<uint8_t>{'a'});
+    pager->commitTxn();
+    assert(tree.valueCacheStats().hits == hits);
+
+    auto results = tree.multiSearch({be64(3), be64(4), be64(2), be64(500)});
+    assert(results[0] == std::vector<uint8_t>{'c'});
+    assert(results[1] == std::vector<uint8_t>{'a'});
+    assert(!results[2].has_value() && results[3].has_value());
+    assert(tree.valueCacheStats().hits == hits + 1);
+
+    BTree plain(pager);
+    assert(plain.valueCacheStats().entries == 0);
+  }
+  removeFile(file_name);
+
+  // an aborted transaction leaves the committed values cached
+  {
+    Database db(file_name);
+    BTree &tree = db.open("t", options);
+    tree.insert(be64(1), {'a'});
+    tree.insert(be64(2), {'a'});
+    assert(tree.search(be64(1)).has_value() && tree.search(be64(2)));
+    db.beginTxn();
+    tree.insert(be64(1), {'b'});
+    tree.remove(be64(2));
+    assert(tree.search(be64(1)) == std::vector<uint8_t>{'b'});
+    db.abortTxn();
+    assert(tree.search(be64(1)) == std::vector<uint8_t>{'a'});
+    assert(tree.search(be64(2)) == std::vector<uint8_t>{'a'});
+  }
+  removeFile(file_name);
+
+  std::cout << "BTree value cache test passed\n";
+}
+
+void test_btree_compact() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+  std::string copy_name = dir + "/dbite" + std::to_string(number) + "c.db";
+
+  auto key = [](int i) {
+    return std::vector<uint8_t>{'k', static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+  auto kept = [](int i) { return i < 50 || i >= 550; };
+  const std::vector<uint8_t> value(100, 'v');
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < 600; i++)
+      tree.insert(key(i), value);
+    tree.removeRange(key(50), key(550));
+
+    uint32_t before = pager->nextPageId();
+    assert(pager->freePageCount() > 0);
+    uint32_t shrunk = tree.compact();
+    assert(shrunk > 0 && pager->nextPageId() == before - shrunk);
+    assert(pager->fileSize() == pager->nextPageId() * BTREE_PAGE_SIZE);
+
+    for (int i = 0; i < 600; i++)
+      assert(tree.search(key(i)).has_value() == kept(i));
+
+    tree.copyTo(copy_name);
+    bool caught = false;
+    try {
+      tree.copyTo(copy_name);
+    } catch (const std::invalid_argument &) {
+      caught = true;
+    }
+    assert(caught);
+  }
+
+  // both files reopen with the same keys, and the copy has no free pages
+  for (const std::string &name : {file_name, copy_name}) {
+    auto pager = std::make_shared<Pager>(name);
+    BTree tree(pager);
+    for (int i = 0; i < 600; i++)
+      assert(tree.search(key(i)).has_value() == kept(i));
+    if (name == copy_name)
+      assert(pager->freePageCount() == 0);
+
+    tree.insert(key(300), value);
+    assert(tree.search(key(300)).has_value());
+  }
+
+  // a freelist spread over many leaves: single-key commits keep it
+  // consistent, and compaction still packs the file down to the live pages
+  removeFile(file_name);
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    const std::vector<uint8_t> big(1000, 'b');
+    pager->beginTxn();
+    for (int i = 0; i < 6000; i++)
+      tree.insert(key(i), big);
+    pager->commitTxn();
+    tree.removeRange(key(50), key(5950));
+    assert(pager->freePageCount() > 2 * FREELIST_IDS_PER_PAGE);
+    size_t listPages = pager->freelistPageCount();
+    assert(listPages > 2);
+    for (int i = 0; i < 50; i++)
+      tree.insert(key(3000 + i), value);
+    assert(pager->freelistPageCount() <= listPages + 1);
+  }
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    TreeStats stats = analyzeTree(*pager);
+    assert(stats.leakedPages == 0);
+
+    uint32_t before = pager->nextPageId();
+    assert(tree.compact() > 0);
+    stats = analyzeTree(*pager);
+    assert(stats.leakedPages == 0 && pager->freePageCount() == 0);
+    assert(pager->nextPageId() == 1 + stats.reachablePages);
+    assert(pager->nextPageId() * 10 < before);
+    assert(pager->fileSize() == pager->nextPageId() * BTREE_PAGE_SIZE);
+    for (int i = 0; i < 6000; i++) {
+      bool expected = i < 50 || i >= 5950 || (i >= 3000 && i < 3050);
+      assert(tree.search(key(i)).has_value() == expected);
+    }
+  }
+
+  // an aborted transaction gives its pages back
+  {
+    Pager pager(file_name);
+    uint32_t next = pager.nextPageId();
+    size_t free = pager.freePageCount();
+    pager.beginTxn();
+    for (int i = 0; i < 3; i++)
+      pager.createPage(PageBuffer(BTREE_PAGE_SIZE));
+    pager.abortTxn();
+    assert(pager.nextPageId() == next && pager.freePageCount() == free);
+  }
+
+  removeFile(file_name);
+  removeFile(copy_name);
+
+  std::cout << "BTree compact test passed\n";
+}
+
+void test_btree_snapshot() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string base = dir + "/dbite" + std::to_string(number);
+  std::string file_name = base + ".db";
+  std::string plain_name = base + "s.db";
+  std::string dense_name = base + "d.db";
+  std::string live_name = base + "l.db";
+
+  auto key = [](int i) {
+    return std::vector<uint8_t>{'k', static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+  auto kept = [](int i) { return i < 100 || i >= 400; };
+  const std::vector<uint8_t> value(100, 'v');
+  // snapshotTo writes real files whatever the pagers' storage
+  PagerOptions onDisk;
+  onDisk.storage = STORAGE_FILE;
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < 600; i++)
+      tree.insert(key(i), value);
+    tree.removeRange(key(100), key(400));
+    assert(pager->freePageCount() > 0);
+
+    tree.snapshotTo(plain_name);
+    tree.snapshotTo(dense_name, true);
+    bool caught = false;
+    try {
+      tree.snapshotTo(plain_name);
+    } catch (const std::runtime_error &) {
+      caught = true;
+    }
+    assert(caught);
+
+    // a pinned snapshot's pages aren't reused by later transactions
+    Pager::Snapshot snap = pager->pinSnapshot();
+    PageBuffer root = pager->readCommittedPage(snap.rootPage);
+    for (int i = 450; i < 460; i++) {
+      tree.remove(key(i));
+      tree.insert(key(i), value);
+    }
+    assert(tree.rootPage() != snap.rootPage);
+    assert(memcmp(pager->readCommittedPage(snap.rootPage).data(), root.data(),
+                  BTREE_PAGE_SIZE) == 0);
+    pager->unpinSnapshot();
+
+    // taken while writes go on: the copy must match the tree after some
+    // prefix of the writer's operations
+    std::thread writer([&] {
+      for (int i = 0; i < 100; i++) {
+        tree.remove(key(i));
+        tree.insert(key(600 + i), value);
+      }
+    });
+    tree.snapshotTo(live_name, true);
+    writer.join();
+  }
+
+  // the plain copy keeps page ids and lists the unreachable pages as free;
+  // the dense one has no free pages at all
+  for (const std::string &name : {plain_name, dense_name}) {
+    auto pager = std::make_shared<Pager>(name, onDisk);
+    BTree tree(pager);
+    for (int i = 0; i < 600; i++)
+      assert(tree.search(key(i)).has_value() == kept(i));
+    if (name == plain_name)
+      assert(pager->freePageCount() > 0);
+    else
+      assert(pager->freePageCount() == 0);
+    tree.insert(key(250), value);
+    assert(tree.search(key(250)).has_value());
+  }
+  assert(std::filesystem::file_size(dense_name) <
+         std::filesystem::file_size(plain_name));
+
+  {
+    auto pager = std::make_shared<Pager>(live_name, onDisk);
+    BTree tree(pager);
+    int removed = 0, added = 0;
+    for (int i = 0; i < 100; i++) {
+      removed += !tree.search(key(i)).has_value();
+      added += tree.search(key(600 + i)).has_value();
+    }
+    assert(added == removed || added == removed - 1);
+    for (int i = 0; i < 100; i++) {
+      assert(tree.search(key(i)).has_value() == (i >= removed));
+      assert(tree.search(key(600 + i)).has_value() == (i < added));
+    }
+    for (int i = 400; i < 600; i++)
+      assert(tree.search(key(i)).has_value());
+  }
+
+  for (const std::string &name : {file_name, plain_name, dense_name, live_name})
+    removeFile(name);
+
+  std::cout << "BTree snapshot test passed\n";
+}
+
+void test_tree_stats() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  auto pager = std::make_shared<Pager>(file_name);
+  {
+    BTree tree(pager);
+    for (int i = 0; i < 400; i++)
+      tree.insert({'k', static_cast<uint8_t>(i >> 8), static_cast<uint8_t>(i)},
+                  std::vector<uint8_t>(i % 2 ? 100 : 0, 'v'));
+  }
+
+  TreeStats one = analyzeTree(*pager, 1);
+  TreeStats four = analyzeTree(*pager, 4);
+  for (const TreeStats &s : {one, four}) {
+    assert(s.entries == 400 && s.keyBytes == 3 * 400);
+    assert(s.valueBytes == 200 * 100);
+    assert(s.keySizes[TreeStats::sizeBucket(3)] == 400);
+    assert(s.valueSizes[0] == 200 && s.valueSizes[7] == 200);
+    assert(s.height > 1 && s.levels.size() == s.height);
+    assert(s.levels[0].nodes == 1);
+
+    uint64_t nodes = 0, filled = 0;
+    for (const TreeStats::Level &l : s.levels)
+      nodes += l.nodes;
+    for (uint64_t n : s.fill)
+      filled += n;
+    assert(nodes == s.reachablePages && filled == nodes);
+    assert(s.leakedPages == 0 && s.sharedPages == 0 && s.corruptPages == 0);
+    assert(s.reachablePages + s.freePages + s.freelistPages + 1 ==
+           s.nextPageId);
+  }
+  assert(one.siblingDistance == four.siblingDistance);
+
+  // a committed page nothing points at shows up as leaked
+  pager->beginTxn();
+  pager->createPage(PageBuffer(BTREE_PAGE_SIZE));
+  pager->commitTxn();
+  assert(analyzeTree(*pager).leakedPages == 1);
+
+  removeFile(file_name);
+
+  std::cout << "Tree stats test passed\n";
+}
+
+void test_database() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+  std::string single_name = dir + "/dbite" + std::to_string(number) + "s.db";
+
+  auto key = [](int i) {
+    return std::vector<uint8_t>{'k', static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+  const std::vector<uint8_t> value(50, 'v');
+
+  {
+    Database db(file_name);
+    BTree &users = db.open("users");
+    BTreeOptions reverse;
+    reverse.keyOrder = KEY_ORDER_REVERSE;
+    BTree &events = db.open("events", reverse);
+    assert(&db.open("users") == &users);
+
+    // both trees change in one commit
+    uint64_t txn = db.pager().currentTxnId();
+    db.beginTxn();
+    for (int i = 0; i < 200; i++) {
+      users.insert(key(i), value);
+      events.insert(key(i), value);
+    }
+    db.commitTxn();
+    assert(db.pager().currentTxnId() == txn + 1);
+
+    // an aborted transaction leaves no trace, trees it created included
+    db.beginTxn();
+    users.insert(key(1000), value);
+    users.remove(key(0));
+    db.open("scratch").insert(key(1), value);
+    db.abortTxn();
+    assert(!users.search(key(1000)).has_value());
+    assert(users.search(key(0)).has_value());
+    assert(!db.contains("scratch"));
+
+    // outside a transaction every operation commits on its own
+    events.remove(key(199));
+    assert(!db.pager().inTxn());
+
+    bool caught = false;
+    try {
+      db.commitTxn();
+    } catch (const std::runtime_error &) {
+      caught = true;
+    }
+    assert(caught);
+  }
+
+  {
+    Database db(file_name);
+    assert((db.names() == std::vector<std::string>{"events", "users"}));
+    BTree &users = db.open("users");
+    BTree &events = db.open("events");
+    assert(events.keyOrder() == KEY_ORDER_REVERSE);
+    for (int i = 0; i < 200; i++) {
+      assert(users.search(key(i)).has_value());
+      assert(events.search(key(i)).has_value() == (i != 199));
+    }
+    std::vector<uint8_t> first;
+    events.scan({}, {},
+                [&](const std::vector<uint8_t> &k,
+                    const std::vector<uint8_t> &) {
+                  first = k;
+                  return false;
+                });
+    assert(first == key(198));
+
+    TreeStats stats = analyzeTree(db.pager());
+    assert(stats.entries == 2 + 200 + 199 && stats.leakedPages == 0);
+
+    size_t free = db.pager().freePageCount();
+    assert(db.drop("users") && !db.drop("users"));
+    assert(!db.contains("users") && db.pager().freePageCount() > free);
+
+    // named trees share the file, so none of them compacts it
+    bool caught = false;
+    try {
+      events.compact();
+    } catch (const std::invalid_argument &) {
+      caught = true;
+    }
+    assert(caught);
+  }
+
+  // a drop that fails inside a transaction leaves the rest of it alone
+  uint32_t doomedRoot;
+  {
+    Database db(file_name);
+    BTree &doomed = db.open("doomed");
+    for (int i = 0; i < 200; i++)
+      doomed.insert(key(i), value);
+    doomedRoot = doomed.rootPage();
+  }
+  {
+    std::shared_ptr<StorageBackend> raw;
+    if (Pager::defaultStorage() == STORAGE_MEMORY)
+      raw = MemoryBackend::open(file_name);
+    else
+      raw = std::make_shared<FileBackend>(file_name, false);
+    uint8_t c;
+    raw->read(&c, 1, uint64_t(doomedRoot) * BTREE_PAGE_SIZE + 10);
+    c ^= 0xFF;
+    raw->write(&c, 1, uint64_t(doomedRoot) * BTREE_PAGE_SIZE + 10);
+  }
+  {
+    Database db(file_name);
+    BTree &events = db.open("events");
+    db.beginTxn();
+    events.insert(key(500), value);
+    bool caught = false;
+    try {
+      db.drop("doomed");
+    } catch (const ChecksumError &) {
+      caught = true;
+    }
+    assert(caught && db.pager().inTxn());
+    assert(events.search(key(500)).has_value());
+
+    caught = false;
+    try {
+      db.commitTxn();
+    } catch (const std::runtime_error &) {
+      caught = true;
+    }
+    assert(caught);
+    db.abortTxn();
+    assert(!events.search(key(500)).has_value() && db.contains("doomed"));
+  }
+
+  {
+    Database db(file_name);
+    assert((db.names() == std::vector<std::string>{"doomed", "events"}));
+
+    // a file of named trees isn't a single tree, nor the other way round
+    bool caught = false;
+    try {
+      BTree tree(std::make_shared<Pager>(file_name));
+    } catch (const std::invalid_argument &) {
+      caught = true;
+    }
+    assert(caught);
+  }
+
+  {
+    auto pager = std::make_shared<Pager>(single_name);
+    BTree tree(pager);
+    tree.insert(key(1), value);
+    assert(!tree.remove(key(2)) && !pager->inTxn());
+  }
+  bool caught = false;
+  try {
+    Database db(single_name);
+  } catch (const std::invalid_argument &) {
+    caught = true;
+  }
+  assert(caught);
+
+  removeFile(file_name);
+  removeFile(single_name);
+
+  std::cout << "Database test passed\n";
+}
+
+void test_sharded_store() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string path = dir + "/dbite" + std::to_string(number);
+  auto removeShards = [&path](size_t n) {
+    for (size_t i = 0; i < n; i++)
+      removeFile((path + "." + std::to_string(i)));
+  };
+
+  const uint64_t N = 2000;
+  {
+    ShardedStore store(path, 4);
+    std::vector<ShardedStore::Entry> batch;
+    for (uint64_t i = 0; i < N; i++)
+      batch.emplace_back(be64(i * 7919 % N), std::vector<uint8_t>{'a'});
+    store.insertBatch(batch);
+
+    // every shard gets a share
+    std::vector<size_t> perShard(4);
+    for (uint64_t i = 0; i < N; i++)
+      perShard[store.shardOf(be64(i))]++;
+    for (size_t n : perShard)
+      assert(n > N / 8);
+    // routing is part of the file layout: these must never move
+    const size_t pinned[] = {3, 1, 2, 0, 1, 2, 0, 3};
+    for (uint64_t i = 0; i < 8; i++)
+      assert(store.shardOf(be64(i)) == pinned[i]);
+
+    store.insert(be64(N), {'b'});
+    assert(store.search(be64(N)) == std::vector<uint8_t>{'b'});
+    assert(store.remove(be64(N)) && !store.remove(be64(N)));
+
+    std::vector<std::vector<uint8_t>> odd;
+    for (uint64_t i = 1; i < N; i += 2)
+      odd.push_back(be64(i));
+    odd.push_back(be64(N + 1));
+    assert(store.removeBatch(odd) == N / 2);
+  }
+
+  // reopened: the keys are where they were routed
+  {
+    ShardedStore store(path, 4);
+    std::vector<std::vector<uint8_t>> keys;
+    for (uint64_t i = 0; i < N + 10; i++)
+      keys.push_back(be64(i));
+    auto results = store.multiSearch(keys);
+    for (uint64_t i = 0; i < N + 10; i++)
+      assert(results[i].has_value() == (i < N && i % 2 == 0));
+
+    bool refused = false;
+    try {
+      ShardedStore other(path, 3);
+    } catch (const std::invalid_argument &) {
+      refused = true;
+    }
+    assert(refused);
+  }
+  removeShards(4);
+
+  // range routing
+  {
+    ShardedStoreOptions options;
+    options.splitKeys = {be64(100), be64(200)};
+    ShardedStore store(path, 3, options);
+    assert(store.shardOf(be64(0)) == 0 && store.shardOf(be64(99)) == 0);
+    assert(store.shardOf(be64(100)) == 1 && store.shardOf(be64(199)) == 1);
+    assert(store.shardOf(be64(200)) == 2 && store.shardOf(be64(9999)) == 2);
+    store.insertBatch({{be64(50), {'x'}}, {be64(150), {'y'}}});
+    assert(store.search(be64(150)) == std::vector<uint8_t>{'y'});
+  }
+  removeShards(3);
+
+  std::cout << "Sharded store test passed\n";
+}
+
+void test_btree_compact_nodes() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+  std::string file_name = "tmp/dbite" + std::to_string(number) + ".db";
+
+  const int N = 3000;
+  auto value = [](int i) {
+    return std::vector<uint8_t>(i % 200, static_cast<uint8_t>(i));
+  };
+
+  // the same small entries take fewer leaf bytes
+  uint64_t classicBytes;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < N; i++)
+      tree.insert(be64((i * 7919) % N), {'v'});
+    classicBytes = analyzeTree(*pager, 1).levels.back().bytes;
+  }
+  removeFile(file_name);
+
+  {
+    BTreeOptions options;
+    options.format = BNODE_FORMAT_COMPACT | BNODE_FLAG_COUNTED;
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager, options);
+    for (int i = 0; i < N; i++)
+      tree.insert(be64((i * 7919) % N), {'v'});
+    TreeStats stats = analyzeTree(*pager, 1);
+    assert(stats.levels.back().bytes * 10 < classicBytes * 8);
+    assert(stats.leakedPages == 0 && stats.corruptPages == 0);
+
+    for (int i = 0; i < N; i++)
+      tree.insert(be64(i), value(i));
+    for (int i = 0; i < N; i += 3)
+      assert(tree.remove(be64(i)));
+    assert(tree.removeRange(be64(1000), be64(1100)) > 0);
+  }
+
+  {
+    // reopened with default options: the tree keeps its compact nodes
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    BNode root(pager->readPage(tree.rootPage()));
+    assert(root.getType() == BNODE_INTERNAL);
+    assert(root.getFormat() == (BNODE_FORMAT_COMPACT | BNODE_FLAG_COUNTED));
+    uint64_t present = 0;
+    for (int i = 0; i < N; i++) {
+      auto res = tree.search(be64(i));
+      bool gone = i % 3 == 0 || (i >= 1000 && i < 1100);
+      assert(res.has_value() == !gone);
+      if (!gone)
+        assert(res.value() == value(i));
+      present += !gone;
+    }
+    assert(tree.count({}, {}) == present);
+    assert(tree.at(0)->first == be64(1));
+    assert(tree.rank(be64(2)) == 1);
+  }
+
+  removeFile(file_name);
+
+  std::cout << "BTree compact nodes test passed\n";
+}
+
+void test_page_checksum() {
+  const char digits[] = "123456789";
+  assert(crc32c(reinterpret_cast<const uint8_t *>(digits), 9) == 0xE3069283);
+
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  uint32_t root;
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < 50; i++) {
+      std::vector<uint8_t> key = {'k', static_cast<uint8_t>(i)};
+      tree.insert(key, {'v'});
+    }
+    root = tree.rootPage();
+  }
+
+  // flips one byte behind the pager's back
+  auto flip = [&](uint64_t pos) {
+    std::shared_ptr<StorageBackend> raw;
+    if (Pager::defaultStorage() == STORAGE_MEMORY)
+      raw = MemoryBackend::open(file_name);
+    else
+      raw = std::make_shared<FileBackend>(file_name, false);
+    uint8_t c;
+    raw->read(&c, 1, pos);
+    c ^= 0xFF;
+    raw->write(&c, 1, pos);
+  };
+  flip(uint64_t(root) * BTREE_PAGE_SIZE + 10);
+
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    bool caught = false;
+    try {
+      tree.search({'k', 1});
+    } catch (const ChecksumError &e) {
+      caught = e.pageId() == root;
+    }
+    assert(caught);
+  }
+
+  // a damaged meta page is an error, never a reason to start a new file
+  for (uint64_t pos : {uint64_t(100), uint64_t(0), uint64_t(7)}) {
+    flip(pos);
+    bool refused = false;
+    try {
+      Pager pager(file_name);
+    } catch (const ChecksumError &e) {
+      refused = pos == 100 && e.pageId() == 0;
+    } catch (const FormatError &e) {
+      // the version digit, or the magic itself
+      refused = std::string(e.what()).find(pos == 0 ? "version" : "no dbite") !=
+                std::string::npos;
+    }
+    assert(refused);
+    flip(pos);
+  }
+
+  // a file of the first format version, which had no checksums, is told
+  // apart from a damaged one
+  {
+    std::string old_name = file_name + ".v1";
+    {
+      std::shared_ptr<StorageBackend> raw;
+      if (Pager::defaultStorage() == STORAGE_MEMORY)
+        raw = MemoryBackend::open(old_name);
+      else
+        raw = std::make_shared<FileBackend>(old_name, false);
+      PageBuffer meta(2 * BTREE_PAGE_SIZE, 0);
+      uint64_t magic = (META_MAGIC & ~uint64_t(0xFF)) | '1';
+      memcpy(meta.data(), &magic, sizeof(magic));
+      raw->write(meta.data(), meta.size(), 0);
+    }
+    bool refused = false;
+    try {
+      Pager pager(old_name);
+    } catch (const FormatError &e) {
+      refused = std::string(e.what()).find("version 001") != std::string::npos;
+    }
+    assert(refused);
+    removeFile(old_name);
+  }
+  {
+    Pager pager(file_name);
+    assert(pager.rootPage() == root);
+  }
+
+  removeFile(file_name);
+
+  std::cout << "Page checksum test passed\n";
+}
+
+void test_pager_read_only() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+  std::string file_name = "tmp/dbite" + std::to_string(number) + ".db";
+
+  PagerOptions readOnly;
+  readOnly.storage = STORAGE_FILE;
+  readOnly.readOnly = true;
+
+  auto contents = [&] {
+    std::ifstream in(file_name, std::ios::binary);
+    return std::string(std::istreambuf_iterator<char>(in), {});
+  };
+  auto refused = [&] {
+    try {
+      Pager pager(file_name, readOnly);
+    } catch (const std::runtime_error &) {
+      return true;
+    }
+    return false;
+  };
+
+  // a missing file isn't created, a foreign one isn't touched
+  assert(refused() && !std::filesystem::exists(file_name));
+  {
+    std::ofstream out(file_name, std::ios::binary);
+    out << "not a database";
+  }
+  assert(refused() && contents() == "not a database");
+  std::filesystem::resize_file(file_name, 2 * BTREE_PAGE_SIZE);
+  std::string blank = contents();
+  assert(refused() && contents() == blank);
+  std::remove(file_name.c_str());
+
+  PagerOptions onDisk;
+  onDisk.storage = STORAGE_FILE;
+  {
+    auto pager = std::make_shared<Pager>(file_name, onDisk);
+    BTree tree(pager);
+    for (int i = 0; i < 200; i++)
+      tree.insert(be64(i), {'v'});
+  }
+  std::string before = contents();
+  {
+    auto pager = std::make_shared<Pager>(file_name, readOnly);
+    BTree tree(pager);
+    assert(tree.search(be64(42)).has_value());
+    bool threw = false;
+    try {
+      tree.insert(be64(500), {'v'});
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+    assert(analyzeTree(*pager, 1).entries == 200);
+  }
+  assert(contents() == before);
+
+  std::remove(file_name.c_str());
+
+  std::cout << "Pager read-only test passed\n";
+}
+
+void test_page_pool() {
+  PagePool &pool = PagePool::local();
+  pool.resetStats();
+
+  // a freed node buffer is handed to the next node of the same size
+  const uint8_t *first;
+  {
+    BNode node(BTREE_PAGE_SIZE);
+    first = node.data().data();
+    assert(reinterpret_cast<uintptr_t>(first) % BTREE_PAGE_SIZE == 0);
+  }
+  {
+    BNode node(BTREE_PAGE_SIZE);
+    assert(node.data().data() == first);
+  }
+  PagePool::Stats st = pool.stats();
+  assert(st.acquired == 2 && st.allocated <= 1);
+
+  // pages read on I/O threads and freed here, with no commit in between,
+  // don't pile up in this thread's pool
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+  std::string file_name = "tmp/dbite" + std::to_string(number) + ".db";
+  {
+    auto pager = std::make_shared<Pager>(file_name);
+    BTree tree(pager);
+    for (int i = 0; i < 500; i++)
+      tree.insert(be64((i * 7919) % 500), std::vector<uint8_t>(50, 'v'));
+    uint32_t pages = pager->nextPageId();
+
+    for (int round = 0; round < 20; round++) {
+      std::vector<std::future<PageBuffer>> reads;
+      for (uint32_t id = 1; id < pages; id++)
+        reads.push_back(pager->readPageAsync(id));
+      for (auto &f : reads)
+        f.get();
+
+      std::vector<std::vector<uint8_t>> keys;
+      for (int i = 0; i < 500; i += 5)
+        keys.push_back(be64(i));
+      assert(tree.multiSearch(keys).size() == keys.size());
+      assert(pool.stats().retained <=
+             PagePool::NUM_CLASSES * PagePool::RETAIN_PER_CLASS);
+    }
+  }
+  removeFile(file_name);
+
+  std::cout << "Page pool test passed\n";
+}
+
+void test_pager_page_handoff() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  uint32_t moved;
+  {
+    Pager pager(file_name);
+    pager.beginTxn();
+
+    // an rvalue buffer becomes the dirty page itself
+    PageBuffer buf(BTREE_PAGE_SIZE, 0);
+    buf[0] = 0xAB;
+    moved = pager.createPage(std::move(buf));
+    assert(buf.empty());
+    assert(pager.readPage(moved)[0] == 0xAB);
+
+    pager.commitTxn();
+  }
+  {
+    Pager pager(file_name);
+    assert(pager.readPage(moved)[0] == 0xAB);
+  }
+
+  removeFile(file_name);
+
+  std::cout << "Pager page handoff test passed\n";
+}
+
+void test_pager_locality() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  Pager pager(file_name);
+  const PageBuffer page(BTREE_PAGE_SIZE, 0);
+  pager.beginTxn();
+  for (int i = 0; i < 20; i++)
+    assert(pager.createPage(page) == static_cast<uint32_t>(i + 1));
+  pager.commitTxn();
+
+  pager.beginTxn();
+  for (uint32_t id : {3, 10, 11, 17})
+    pager.deletePage(id);
+  pager.commitTxn();
+  assert(pager.freePageCount() == 4);
+
+  // the free page closest to the hint wins, ties go to the higher id;
+  // without a hint the lowest free page is used
+  pager.beginTxn();
+  assert(pager.createPage(page, 15) == 17);
+  assert(pager.createPage(page, 7) == 10);
+  assert(pager.createPage(page) == 3);
+  assert(pager.createPage(page, 1000) == 11);
+  assert(pager.createPage(page, 5) == pager.nextPageId() - 1);
+  pager.commitTxn();
+
+  removeFile(file_name);
+
+  std::cout << "Pager locality test passed\n";
+}
+
+void test_async_read() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  auto key = [](int i) {
+    return std::vector<uint8_t>{'k', static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+
+  PagerOptions pagerOptions;
+  pagerOptions.ioThreads = 4;
+  auto pager = std::make_shared<Pager>(file_name, pagerOptions);
+  BTree tree(pager);
+  for (int i = 0; i < 400; i += 2)
+    tree.insert(key(i), {static_cast<uint8_t>(i)});
+
+  // futures and callbacks see the same bytes as a blocking read
+  uint32_t root = tree.rootPage();
+  std::future<PageBuffer> fut = pager->readPageAsync(root);
+  std::promise<bool> called;
+  pager->readPageAsync(root, [&](PageBuffer page, std::exception_ptr err) {
+    called.set_value(!err && page.size() == BTREE_PAGE_SIZE &&
+                     memcmp(page.data(), pager->readPage(root).data(),
+                            BTREE_PAGE_SIZE) == 0);
+  });
+  PageBuffer page = fut.get();
+  assert(memcmp(page.data(), pager->readPage(root).data(), BTREE_PAGE_SIZE) ==
+         0);
+  assert(called.get_future().get());
+
+  // errors come back through the future
+  bool caught = false;
+  try {
+    pager->readPageAsync(pager->nextPageId() + 100).get();
+  } catch (const std::runtime_error &) {
+    caught = true;
+  }
+  assert(caught);
+
+  std::vector<std::vector<uint8_t>> keys;
+  for (int i = 0; i < 400; i++)
+    keys.push_back(key(i));
+  auto results = tree.multiSearch(keys);
+  assert(results.size() == keys.size());
+  for (int i = 0; i < 400; i++) {
+    assert(results[i].has_value() == (i % 2 == 0));
+    if (i % 2 == 0)
+      assert(results[i].value() == std::vector<uint8_t>{uint8_t(i)});
+  }
+
+  removeFile(file_name);
+
+  std::cout << "Async read test passed\n";
+}
+
+void test_direct_io() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+
+  std::string dir = "tmp";
+  std::filesystem::create_directories(dir);
+  std::string file_name = dir + "/dbite" + std::to_string(number) + ".db";
+
+  auto key = [](int i) {
+    return std::vector<uint8_t>{'k', static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+
+  // a read that finishes after the page was written or freed is dropped
+  // rather than cached over the newer bytes
+  {
+    PageCache cache(4);
+    PageBuffer stale(BTREE_PAGE_SIZE, 1), fresh(BTREE_PAGE_SIZE, 2);
+    uint64_t gen = cache.generation(7);
+    cache.put(7, fresh);
+    assert(!cache.fill(7, stale, gen));
+    assert((*cache.get(7))[0] == 2);
+
+    gen = cache.generation(8);
+    cache.erase(7);
+    assert(cache.fill(8, stale, gen));
+    assert(!cache.fill(8, fresh, cache.generation(8)));
+    assert((*cache.get(8))[0] == 1);
+    gen = cache.generation(7);
+    assert(cache.fill(7, stale, gen) && (*cache.get(7))[0] == 1);
+  }
+
+  PagerOptions options;
+  options.directIO = true;
+  options.cachePages = 16;
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    for (int i = 0; i < 300; i++)
+      tree.insert(key(i), {static_cast<uint8_t>(i)});
+    for (int i = 0; i < 300; i++)
+      assert(tree.search(key(i)).value()[0] == static_cast<uint8_t>(i));
+
+    // lookups are served from the pager's cache, which stays bounded
+    assert(pager->cacheStats().hits > 0);
+  }
+
+  // the file reads back the same with and without O_DIRECT
+  for (bool direct : {true, false}) {
+    PagerOptions reopen;
+    reopen.directIO = direct;
+    auto pager = std::make_shared<Pager>(file_name, reopen);
+    BTree tree(pager);
+    for (int i = 0; i < 300; i++)
+      assert(tree.search(key(i)).has_value());
+    assert(pager->cacheStats().hits == 0);
+  }
+
+  removeFile(file_name);
+
+  std::cout << "Direct I/O test passed\n";
+}
+
+void test_memory_storage() {
+  // chunked memory reads and writes like a file
+  {
+    MemoryBackend mem;
+    const size_t chunk = MemoryBackend::CHUNK_SIZE;
+    std::vector<uint8_t> out(100, 0xAB), in(100);
+    mem.write(out.data(), out.size(), chunk - 50);
+    assert(mem.size() == chunk + 50);
+    mem.read(in.data(), in.size(), chunk - 50);
+    assert(in == out);
+
+    // shrinking then growing brings back zeros
+    mem.resize(chunk - 10);
+    mem.resize(2 * chunk);
+    mem.read(in.data(), in.size(), chunk - 50);
+    for (size_t i = 0; i < in.size(); i++)
+      assert(in[i] == (i < 40 ? 0xAB : 0));
+
+    bool threw = false;
+    try {
+      mem.read(in.data(), in.size(), 2 * chunk - 10);
+    } catch (const std::runtime_error &) {
+      threw = true;
+    }
+    assert(threw);
+  }
+
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+  std::string file_name = "tmp/dbite" + std::to_string(number) + "m.db";
+
+  auto key = [](int i) {
+    return std::vector<uint8_t>{'k', static_cast<uint8_t>(i >> 8),
+                                static_cast<uint8_t>(i)};
+  };
+
+  PagerOptions options;
+  options.storage = STORAGE_MEMORY;
+  options.hugePages = true;
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    for (int i = 0; i < 500; i++)
+      tree.insert(key(i), {static_cast<uint8_t>(i)});
+    tree.removeRange(key(100), key(400));
+  }
+  assert(!std::filesystem::exists(file_name));
+  assert(Pager::exists(file_name, options));
+
+  // reopening the memory file finds the committed tree, compaction included
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    for (int i = 0; i < 500; i++)
+      assert(tree.search(key(i)).has_value() == (i < 100 || i >= 400));
+    assert(tree.compact() > 0);
+    assert(pager->fileSize() == pager->nextPageId() * BTREE_PAGE_SIZE);
+  }
+
+  assert(MemoryBackend::remove(file_name));
+  assert(!Pager::exists(file_name, options));
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    assert(!tree.search(key(0)).has_value());
+  }
+  MemoryBackend::remove(file_name);
+
+  std::cout << "Memory storage test passed\n";
+}
+
+void test_hot_manifest() {
+  std::mt19937 gen(std::random_device{}());
+  int number = std::uniform_int_distribution<>(1000, 9999)(gen);
+  std::string file_name = "tmp/dbite" + std::to_string(number) + ".db";
+  std::string manifest = file_name + ".hot";
+
+  PagerOptions options;
+  options.storage = STORAGE_FILE;
+  options.hotManifestLeaves = 4;
+  options.hotManifestInterval = 1000;
+
+  const int n = 2000;
+  const std::vector<uint8_t> value(100, 'v');
+  uint32_t root;
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    for (int i = 0; i < n; i++)
+      tree.insert(be64((i * 7919) % n), value);
+    root = tree.rootPage();
+    for (int r = 0; r < 20; r++)
+      assert(tree.search(be64(7)).has_value());
+
+    std::vector<uint32_t> hot = pager->hotPages();
+    assert(std::is_sorted(hot.begin(), hot.end()));
+    assert(std::binary_search(hot.begin(), hot.end(), root));
+  }
+  assert(std::filesystem::exists(manifest));
+
+  // the next open prefetches what the manifest lists, root first in line
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    const std::vector<uint32_t> &warm = pager->warmUpPages();
+    assert(!warm.empty() && std::is_sorted(warm.begin(), warm.end()));
+    assert(std::binary_search(warm.begin(), warm.end(), root));
+    for (uint32_t id : warm)
+      assert(id > 0 && id < pager->nextPageId());
+    for (int i = 0; i < n; i += 97)
+      assert(tree.search(be64(i)).has_value());
+  }
+
+  // a damaged manifest is ignored
+  {
+    FILE *f = fopen(manifest.c_str(), "r+b");
+    assert(f);
+    fseek(f, 12, SEEK_SET);
+    fputc(0xFF, f);
+    fclose(f);
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    assert(pager->warmUpPages().empty());
+    assert(tree.search(be64(7)).has_value());
+  }
+
+  // commits rewrite it every interval
+  std::remove(manifest.c_str());
+  options.hotManifestInterval = 1;
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    assert(tree.search(be64(7)).has_value());
+    tree.insert(be64(n), value);
+    assert(std::filesystem::exists(manifest));
+  }
+
+  // freelist pages reread by an abort aren't counted as nodes
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    pager->beginTxn();
+    for (int i = 0; i < n; i += 2)
+      assert(tree.remove(be64(i)));
+    pager->commitTxn();
+  }
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    assert(pager->freelistPageCount() > 0);
+    pager->beginTxn();
+    pager->abortTxn();
+    assert(pager->hotPages().empty());
+  }
+
+  // and nothing is kept when it is off
+  std::remove(manifest.c_str());
+  options.hotManifestLeaves = 0;
+  {
+    auto pager = std::make_shared<Pager>(file_name, options);
+    BTree tree(pager);
+    assert(tree.search(be64(7)).has_value());
+    assert(pager->hotPages().empty());
+  }
+  assert(!std::filesystem::exists(manifest));
+
+  removeFile(file_name);
+
+  std::cout << "Hot page manifest test passed\n";
+}
+
 void test_all() {
   BNode node;
   test_header();
@@ -733,13 +3022,46 @@ void test_all() {
   test_node_size();
   test_node_leaf_insert_update();
   test_node_split_half();
+  test_slotted_node();
+  test_compact_node();
+  test_int64_node();
   test_btree_insert();
   test_btree_remove();
   test_btree_persistence();
+  test_btree_remove_range();
+  test_btree_scan();
+  test_btree_counted();
+  test_lz_codec();
+  test_btree_compressed();
+  test_btree_update();
+  test_btree_filter();
+  test_value_cache();
+  test_btree_value_cache();
+  test_btree_compact();
+  test_btree_snapshot();
+  test_tree_stats();
+  test_database();
+  test_sharded_store();
+  test_page_checksum();
+  test_btree_slotted();
+  test_btree_compact_nodes();
+  test_btree_int64();
+  test_key_orders();
+  test_pager_read_only();
+  test_page_pool();
+  test_pager_page_handoff();
+  test_pager_locality();
+  test_async_read();
+  test_direct_io();
+  test_memory_storage();
+  test_hot_manifest();
   std::cout << "All tests passed\n";
 }
 
 int main() {
+  const char *storage = std::getenv("DBITE_STORAGE");
+  if (storage && std::string(storage) == "memory")
+    Pager::setDefaultStorage(STORAGE_MEMORY);
   test_all();
   return 0;
 }
@@ -0,0 +1,136 @@
+// dbite-stat: reports the shape and space use of the tree in a database
+// file, to guide page size and compaction decisions.
+//
+//   dbite-stat [-j threads] <file>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <exception>
+#include <string>
+
+#include <sys/stat.h>
+
+#include "lz.h"
+#include "tree_stats.h"
+
+static void usage() {
+  fprintf(stderr, "usage: dbite-stat [-j threads] <file>\n");
+  exit(2);
+}
+
+static double percent(uint64_t part, uint64_t whole) {
+  return whole ? 100.0 * part / whole : 0.0;
+}
+
+// prints the non-empty buckets of a TreeStats size histogram
+static void printSizes(const char *title,
+                       const std::array<uint64_t, TreeStats::SIZE_BUCKETS> &h,
+                       uint64_t total) {
+  printf("%s\n", title);
+  for (size_t b = 0; b < h.size(); b++) {
+    if (h[b] == 0)
+      continue;
+    if (b <= 1)
+      printf("  %13zu %12llu  %5.1f%%\n", b, (unsigned long long)h[b],
+             percent(h[b], total));
+    else
+      printf("  %6zu-%-6zu %12llu  %5.1f%%\n", size_t(1) << (b - 1),
+             (size_t(1) << b) - 1, (unsigned long long)h[b],
+             percent(h[b], total));
+  }
+}
+
+int main(int argc, char **argv) {
+  unsigned threads = 0;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+      threads = static_cast<unsigned>(atoi(argv[++i]));
+    else if (argv[i][0] != '-' && path == nullptr)
+      path = argv[i];
+    else
+      usage();
+  }
+  if (path == nullptr)
+    usage();
+
+  struct stat st;
+  if (stat(path, &st) != 0) {
+    fprintf(stderr, "dbite-stat: %s: no such file\n", path);
+    return 1;
+  }
+
+  TreeStats s;
+  try {
+    // read-only: a damaged or foreign file is reported, never rewritten
+    PagerOptions options;
+    options.storage = STORAGE_FILE;
+    options.readOnly = true;
+    Pager pager(path, options);
+    lzResetStats();
+    s = analyzeTree(pager, threads);
+  } catch (const std::exception &e) {
+    fprintf(stderr, "dbite-stat: %s: %s\n", path, e.what());
+    return 1;
+  }
+
+  printf("file          %s (%lld bytes, %u pages of %zu)\n", path,
+         (long long)st.st_size, s.nextPageId, BTREE_PAGE_SIZE);
+  printf("height        %u\n", s.height);
+
+  printf("\nlevel        nodes         keys   avg keys   avg fill\n");
+  uint64_t nodes = 0;
+  for (size_t i = 0; i < s.levels.size(); i++) {
+    const TreeStats::Level &l = s.levels[i];
+    nodes += l.nodes;
+    printf("%5zu %12llu %12llu %10.1f %9.1f%%\n", i,
+           (unsigned long long)l.nodes, (unsigned long long)l.keys,
+           l.nodes ? double(l.keys) / l.nodes : 0.0,
+           percent(l.bytes, l.nodes * BTREE_PAGE_USABLE_SIZE));
+  }
+
+  printf("\nfill factor\n");
+  for (size_t b = 0; b < s.fill.size(); b++)
+    printf("  %3zu-%3zu%% %12llu  %5.1f%%\n", b * 10, b * 10 + 10,
+           (unsigned long long)s.fill[b], percent(s.fill[b], nodes));
+
+  printf("\nentries       %llu (%llu key bytes, %llu value bytes)\n",
+         (unsigned long long)s.entries, (unsigned long long)s.keyBytes,
+         (unsigned long long)s.valueBytes);
+  printSizes("key sizes", s.keySizes, s.entries);
+  printSizes("value sizes", s.valueSizes, s.entries);
+
+  uint64_t pages = s.nextPageId > 0 ? s.nextPageId - 1 : 0;
+  printf("\npages         %llu besides meta\n", (unsigned long long)pages);
+  printf("  reachable   %12llu  %5.1f%%\n",
+         (unsigned long long)s.reachablePages,
+         percent(s.reachablePages, pages));
+  printf("  free        %12llu  %5.1f%%\n", (unsigned long long)s.freePages,
+         percent(s.freePages, pages));
+  printf("  freelist    %12llu  %5.1f%%\n",
+         (unsigned long long)s.freelistPages, percent(s.freelistPages, pages));
+  printf("  leaked      %12llu  %5.1f%%\n", (unsigned long long)s.leakedPages,
+         percent(s.leakedPages, pages));
+  if (s.sharedPages > 0)
+    printf("  shared      %12llu  (referenced more than once)\n",
+           (unsigned long long)s.sharedPages);
+  if (s.corruptPages > 0)
+    printf("  corrupt     %12llu  (unreadable, subtrees skipped)\n",
+           (unsigned long long)s.corruptPages);
+
+  if (s.packedLeaves > 0) {
+    LzStats lz = lzStats();
+    printf("\ncompressed    %llu leaves, %llu node bytes in %llu (%.2fx)\n",
+           (unsigned long long)s.packedLeaves,
+           (unsigned long long)s.packedNodeBytes,
+           (unsigned long long)s.packedBytes, s.compressionRatio());
+    printf("  decompress  %.1f ms (%.0f MB/s)\n", lz.decompressNs / 1e6,
+           lz.decompressNs ? lz.decompressedOut * 1e3 / lz.decompressNs : 0.0);
+  }
+
+  printf("\nsibling distance %.1f pages on average (%llu pairs)\n",
+         s.averageSiblingDistance(), (unsigned long long)s.siblingPairs);
+
+  return s.corruptPages > 0 || s.sharedPages > 0 ? 1 : 0;
+}